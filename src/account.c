@@ -1,135 +1,10 @@
 #include "account.h"
 #include "crypt.h"
 #include "file_io.h"
-#include "oidc_array.h"
+#include "discovery_cache.h"
 
 #include <syslog.h>
 
-/** @fn struct oidc_account* addAccount(struct oidc_account* p, size_t* size, struct oidc_account account)   
- * @brief adds a account to an array 
- * @param p a pointer to the start of an array
- * @param size a pointer to the number of accounts in the array
- * @param account the account to be added. 
- * @return a pointer to the new array
- */
-struct oidc_account* addAccount(struct oidc_account* p, size_t* size, struct oidc_account account) {
-  void* tmp = realloc(p, sizeof(struct oidc_account) * (*size + 1));
-  if(tmp==NULL) {
-    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) realloc() failed: %m\n", __func__, __FILE__, __LINE__);
-    oidc_errno = OIDC_EALLOC;
-    return NULL;
-  }
-  p = tmp;
-  memcpy(p + *size, &account, sizeof(struct oidc_account));
-  (*size)++;
-  // For some reason using the following function insted of the above same
-  // statements doesn't work.
-  // p= arr_addElement(p, size, sizeof(struct oidc_account), &account);    
-  return p;
-}
-
-/** @fn int account_comparator(const void* v1, const void* v2)
- * @brief compares two accounts by their name. Can be used for sorting.
- * @param v1 pointer to the first element
- * @param v2 pointer to the second element
- * @return -1 if v1<v2; 1 if v1>v2; 0 if v1=v2
- */
-int account_comparatorByName(const void *v1, const void *v2) {
-  const struct oidc_account *p1 = (struct oidc_account *)v1;
-  const struct oidc_account *p2 = (struct oidc_account *)v2;
-  if(account_getName(*p1)==NULL && account_getName(*p2)==NULL) {
-    return 0;
-  }
-  if(account_getName(*p1)==NULL) {
-    return -1;
-  }
-  if(account_getName(*p2)==NULL) {
-    return 1;
-  }
-  return strcmp(account_getName(*p1), account_getName(*p2));
-}
-
-/** @fn int account_comparator(const void* v1, const void* v2)
- * @brief compares two accounts by their name. Can be used for sorting.
- * @param v1 pointer to the first element
- * @param v2 pointer to the second element
- * @return -1 if v1<v2; 1 if v1>v2; 0 if v1=v2
- */
-int account_comparatorByState(const void *v1, const void *v2) {
-  const struct oidc_account *p1 = (struct oidc_account *)v1;
-  const struct oidc_account *p2 = (struct oidc_account *)v2;
-  if(account_getUsedState(*p1)==NULL && account_getUsedState(*p2)==NULL) {
-    return 0;
-  }
-  if(account_getUsedState(*p1)==NULL) {
-    return -1;
-  }
-  if(account_getUsedState(*p2)==NULL) {
-    return 1;
-  }
-  return strcmp(account_getUsedState(*p1), account_getUsedState(*p2));
-}
-
-/** @fn void sortAccount()
- * @brief sorts accounts by their name using \f account_comparator 
- * @param p the array to be sorted
- * @param size the number of accounts in \p p
- * @return the sorted array
- */
-struct oidc_account* sortAccount(struct oidc_account* p, size_t size) {
-  return arr_sort(p, size, sizeof(struct oidc_account), account_comparatorByName);
-}
-
-/** @fn struct oidc_account* findAccount(struct oidc_account* p, size_t size, struct oidc_account key) 
- * @brief finds a account in an array.
- * @param p the array that should be searched
- * @param size the number of elements in arr
- * @param key the account to be found. 
- * @return a pointer to the found account. If no account could be found
- * NULL is returned.
- */
-struct oidc_account* findAccountByName(struct oidc_account* p, size_t size, struct oidc_account key) {
-  return arr_find(p, size, sizeof(struct oidc_account), &key, account_comparatorByName);
-}
-
-/** @fn struct oidc_account* findAccount(struct oidc_account* p, size_t size, struct oidc_account key) 
- * @brief finds a account in an array.
- * @param p the array that should be searched
- * @param size the number of elements in arr
- * @param key the account to be found. 
- * @return a pointer to the found account. If no account could be found
- * NULL is returned.
- */
-struct oidc_account* findAccountByState(struct oidc_account* p, size_t size, struct oidc_account key) {
-  return arr_find(p, size, sizeof(struct oidc_account), &key, account_comparatorByState);
-}
-
-/** @fn struct oidc_account* removeAccount(struct oidc_account* p, size_t* size, struct oidc_account account)   
- * @brief removes a account from an array 
- * @param p a pointer to the start of an array
- * @param size a pointer to the number of accounts in the array
- * @param account the account to be removed. 
- * @return a pointer to the new array
- */
-struct oidc_account* removeAccount(struct oidc_account* p, size_t* size, struct oidc_account key) {
-  void* pos = findAccountByName(p, *size,  key);
-  if(NULL==pos) {
-    return p;
-  }
-  freeAccountContent(pos);
-  memmove(pos, p + *size - 1, sizeof(struct oidc_account));
-  (*size)--;
-  void* tmp = realloc(p, sizeof(struct oidc_account) * (*size));
-  if(tmp==NULL && *size > 0) {
-    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) realloc() failed: %m\n", __func__, __FILE__, __LINE__);
-    oidc_errno = OIDC_EALLOC;
-    return NULL;
-  }
-  p = tmp;
-  return p;
-
-}
-
 /** @fn struct oidc_account* getAccountFromJSON(char* json)
  * @brief parses a json encoded account
  * @param json the json string
@@ -155,7 +30,8 @@ struct oidc_account* getAccountFromJSON(char* json) {
   pairs[9].key = "redirect_uris"; pairs[9].value = NULL;
   pairs[10].key = "scope"; pairs[10].value = NULL;
   pairs[11].key = "device_authorization_endpoint"; pairs[11].value = NULL;
-  if(getJSONValues(json, pairs, sizeof(pairs)/sizeof(*pairs))>0) {
+  static struct json_keyset keyset = JSON_KEYSET_INIT;
+  if(getJSONValuesByKeySet(json, pairs, sizeof(pairs)/sizeof(*pairs), &keyset)>0) {
     struct oidc_issuer* iss = calloc(sizeof(struct oidc_issuer), 1);
     if(pairs[0].value) {
       issuer_setIssuerUrl(iss, pairs[0].value);
@@ -186,6 +62,33 @@ struct oidc_account* getAccountFromJSON(char* json) {
   return NULL;
 }
 
+/** @fn void account_writeJSON(struct json_writer* w, struct oidc_account p)
+ * @brief writes an account as json object to a writer
+ * @param w the writer; the object is written as next value
+ * @param p the oidc_account to be written
+ */
+void account_writeJSON(struct json_writer* w, struct oidc_account p) {
+  jsonwriter_beginObject(w);
+  jsonwriter_addString(w, "name", isValid(account_getName(p)) ? account_getName(p) : "");
+  jsonwriter_addString(w, "issuer_url", isValid(account_getIssuerUrl(p)) ? account_getIssuerUrl(p) : "");
+  jsonwriter_addString(w, "device_authorization_endpoint", isValid(account_getDeviceAuthorizationEndpoint(p)) ? account_getDeviceAuthorizationEndpoint(p) : "");
+  jsonwriter_addString(w, "client_id", isValid(account_getClientId(p)) ? account_getClientId(p) : "");
+  jsonwriter_addString(w, "client_secret", isValid(account_getClientSecret(p)) ? account_getClientSecret(p) : "");
+  jsonwriter_addString(w, "refresh_token", isValid(account_getRefreshToken(p)) ? account_getRefreshToken(p) : "");
+  jsonwriter_addString(w, "cert_path", isValid(account_getCertPath(p)) ? account_getCertPath(p) : "");
+  jsonwriter_addString(w, "username", isValid(account_getUsername(p)) ? account_getUsername(p) : "");
+  jsonwriter_addString(w, "password", isValid(account_getPassword(p)) ? account_getPassword(p) : "");
+  jsonwriter_key(w, "redirect_uris");
+  jsonwriter_beginArray(w);
+  unsigned int i;
+  for(i=0; i<account_getRedirectUrisCount(p); i++) {
+    jsonwriter_string(w, account_getRedirectUris(p)[i]);
+  }
+  jsonwriter_endArray(w);
+  jsonwriter_addString(w, "scope", isValid(account_getScope(p)) ? account_getScope(p) : "");
+  jsonwriter_endObject(w);
+}
+
 /** @fn char* accountToJSON(struct oidc_rovider p)
  * @brief converts a account into a json string
  * @param p the oidc_account to be converted
@@ -193,28 +96,56 @@ struct oidc_account* getAccountFromJSON(char* json) {
  * after usage.
  */
 char* accountToJSON(struct oidc_account p) {
-  char* fmt = "{\n\"name\":\"%s\",\n\"issuer_url\":\"%s\",\n\"device_authorization_endpoint\":\"%s\",\n\"client_id\":\"%s\",\n\"client_secret\":\"%s\",\n\"refresh_token\":\"%s\",\n\"cert_path\":\"%s\",\n\"username\":\"%s\",\n\"password\":\"%s\",\n\"redirect_uris\":%s,\n\"scope\":\"%s\"\n}";
-  char* redirect_uris = calloc(sizeof(char), 2+1);
-  strcpy(redirect_uris, "[]");;
-  unsigned int i;
-  for(i=0; i<account_getRedirectUrisCount(p); i++) {
-    redirect_uris = json_arrAdd(redirect_uris, account_getRedirectUris(p)[i]);
+  struct json_writer w;
+  jsonwriter_init(&w);
+  account_writeJSON(&w, p);
+  return jsonwriter_finish(&w);
+}
+
+/** @fn struct oidc_account* copyAccount(struct oidc_account p)
+ * @brief creates a deep copy of an account, so that it can be used without
+ * holding the lock on the loaded accounts. The issuer metadata is not copied,
+ * the copy references the shared record.
+ * @param p the account to be copied
+ * @return a pointer to the copy. Has to be freed after usage using
+ * \f freeAccount. On failure NULL is returned.
+ */
+struct oidc_account* copyAccount(struct oidc_account p) {
+  struct oidc_account* copy = calloc(sizeof(struct oidc_account), 1);
+  if(copy==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
+  copy->issuer = copyIssuer(account_getIssuer(p));
+  // the metadata is shared; the copy gets the current record, so refreshed
+  // metadata is used by all accounts as soon as it is available
+  copy->metadata = discovery_current(account_getConfigEndpoint(p));
+  if(copy->metadata==NULL) {
+    copy->metadata = issuer_ref(account_getMetadata(p));
   }
-  char* p_json = oidc_sprintf(fmt, 
-      isValid(account_getName(p)) ? account_getName(p) : "", 
-      isValid(account_getIssuerUrl(p)) ? account_getIssuerUrl(p) : "", 
-      isValid(account_getDeviceAuthorizationEndpoint(p)) ? account_getDeviceAuthorizationEndpoint(p) : "", 
-      isValid(account_getClientId(p)) ? account_getClientId(p) : "", 
-      isValid(account_getClientSecret(p)) ? account_getClientSecret(p) : "", 
-      isValid(account_getRefreshToken(p)) ? account_getRefreshToken(p) : "", 
-      isValid(account_getCertPath(p)) ? account_getCertPath(p) : "",
-      isValid(account_getUsername(p)) ? account_getUsername(p) : "", 
-      isValid(account_getPassword(p)) ? account_getPassword(p) : "",
-      redirect_uris,
-      isValid(account_getScope(p)) ? account_getScope(p) : ""
-      );
-  clearFreeString(redirect_uris);
-  return p_json;
+  copy->name = oidc_strcopyIfValid(account_getName(p));
+  copy->client_id = oidc_strcopyIfValid(account_getClientId(p));
+  copy->client_secret = oidc_strcopyIfValid(account_getClientSecret(p));
+  copy->scope = oidc_strcopyIfValid(account_getScope(p)); // not using the setter, it would recompute the usable scopes
+  copy->username = oidc_strcopyIfValid(account_getUsername(p));
+  copy->password = oidc_strcopyIfValid(account_getPassword(p));
+  copy->refresh_token = oidc_strcopyIfValid(account_getRefreshToken(p));
+  copy->token.access_token = oidc_strcopyIfValid(account_getAccessToken(p));
+  copy->token.token_expires_at = account_getTokenExpiresAt(p);
+  copy->cert_path = oidc_strcopyIfValid(account_getCertPath(p));
+  copy->usedState = oidc_strcopyIfValid(account_getUsedState(p));
+  if(account_getRedirectUrisCount(p) > 0) {
+    copy->redirect_uris = calloc(sizeof(char*), account_getRedirectUrisCount(p));
+    if(copy->redirect_uris!=NULL) {
+      size_t i;
+      for(i=0; i<account_getRedirectUrisCount(p); i++) {
+        copy->redirect_uris[i] = oidc_strcopyIfValid(account_getRedirectUris(p)[i]);
+      }
+      copy->redirect_uris_count = account_getRedirectUrisCount(p);
+    }
+  }
+  return copy;
 }
 
 /** void freeAccount(struct oidc_account* p)
@@ -239,6 +170,7 @@ void freeAccountContent(struct oidc_account* p) {
   }
   account_setName(p, NULL);
   account_setIssuer(p, NULL);
+  account_setMetadata(p, NULL);
   account_setClientId(p, NULL);
   account_setClientSecret(p, NULL);
   account_setScope(p, NULL);
@@ -246,6 +178,8 @@ void freeAccountContent(struct oidc_account* p) {
   account_setPassword(p, NULL);
   account_setRefreshToken(p, NULL);
   account_setAccessToken(p, NULL);
+  account_setScopedTokens(p, NULL);
+  account_setRefreshFailures(p, NULL);
   account_setCertPath(p, NULL);
   account_setRedirectUris(p, NULL, 0);
   account_setUsedState(p, NULL);
@@ -289,30 +223,6 @@ struct oidc_account* decryptAccountText(char* fileContent, const char* password)
   return p;
 }
 
-/** @fn char* getAccountNameList(struct oidc_account* p, size_t size) 
- * @brief gets the account short names from an array of accounts
- * @param p a pointer to the first account
- * @param size the nubmer of accounts
- * @return a pointer to a JSON Array String containing all the account names.
- * Has to be freed after usage.
- */
-char* getAccountNameList(struct oidc_account* p, size_t size) {
-  if(NULL==p) {
-    oidc_setArgNullFuncError(__func__);
-    return NULL;
-  }
-  char* accountList = calloc(sizeof(char), 2+1);
-  strcpy(accountList, "[]");
-  if(0==size) {
-    return accountList;
-  }
-  unsigned int i;
-  for(i=0; i<size; i++) {
-    accountList = json_arrAdd(accountList, account_getName(*(p+i)));
-  }
-  return accountList;
-}
-
 int hasRedirectUris(struct oidc_account account) {
   char* str = arrToListString(account_getRedirectUris(account), account_getRedirectUrisCount(account), ' ', 1);
   int ret = str != NULL ? 1 : 0;
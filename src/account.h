@@ -2,9 +2,13 @@
 #define ACCOUNT_H
 
 #include "json.h"
+#include "json_writer.h"
 #include "issuer.h"
+#include "token_cache.h"
+#include "refresh_failure.h"
 #include "oidc_utilities.h"
 
+#include <time.h>
 #include <stdlib.h>
 
 struct token {
@@ -12,8 +16,19 @@ struct token {
   unsigned long token_expires_at;
 };
 
+/* when the agent refreshes the access token in the background, before a
+ * client needs a new one */
+struct refresh_schedule {
+  time_t refresh_at;      // 0 if no refresh is scheduled
+  time_t wanted_validity; // largest min_valid_period requested since the last refresh
+  time_t jitter;          // per account offset, so refreshes are spread
+  time_t lifetime;        // lifetime of the last refreshed token; 0 if unknown
+  int in_use;             // the token was requested since the last refresh
+};
+
 struct oidc_account {
-  struct oidc_issuer* issuer;
+  struct oidc_issuer* issuer; // issuer url and the values configured for this account
+  struct oidc_issuer* metadata; // discovered metadata; shared by all accounts of the provider, NULL until discovered
   char* name;                           
   char* client_id;                     
   char* client_secret;                
@@ -22,24 +37,32 @@ struct oidc_account {
   char* password;
   char* refresh_token;            
   struct token token;
+  struct token_cache* scoped_tokens; // tokens for non default scopes; not copied
+  list_t* refresh_failures; // struct refresh_failure*; not copied
   char* cert_path;
   char** redirect_uris;
   size_t redirect_uris_count;
   char* usedState;
+  struct refresh_schedule schedule; // only used by the agent; not copied
 };
 
 char* defineUsableScopes(struct oidc_account account) ;
 inline static struct oidc_issuer* account_getIssuer(struct oidc_account p) { return p.issuer; }
+inline static struct oidc_issuer* account_getMetadata(struct oidc_account p) { return p.metadata; }
 inline static char* account_getIssuerUrl(struct oidc_account p) {return p.issuer ? issuer_getIssuerUrl(*(p.issuer)) : NULL; }
-inline static char* account_getConfigEndpoint(struct oidc_account p) { return issuer_getConfigEndpoint(*p.issuer); }
-inline static char* account_getTokenEndpoint(struct oidc_account p) { return issuer_getTokenEndpoint(*p.issuer); }
-inline static char* account_getAuthorizationEndpoint(struct oidc_account p) { return issuer_getAuthorizationEndpoint(*p.issuer); }
-inline static char* account_getRevocationEndpoint(struct oidc_account p) { return issuer_getRevocationEndpoint(*p.issuer); }
-inline static char* account_getRegistrationEndpoint(struct oidc_account p) { return issuer_getRegistrationEndpoint(*p.issuer); }
-inline static char* account_getDeviceAuthorizationEndpoint(struct oidc_account p) { return issuer_getDeviceAuthorizationEndpoint(*p.issuer); }
-inline static char* account_getScopesSupported(struct oidc_account p) { return issuer_getScopesSupported(*p.issuer); }
-inline static char* account_getGrantTypesSupported(struct oidc_account p) { return issuer_getGrantTypesSupported(*p.issuer); }
-inline static char* account_getResponseTypesSupported(struct oidc_account p) { return issuer_getResponseTypesSupported(*p.issuer); }
+inline static char* account_getConfigEndpoint(struct oidc_account p) { return p.issuer ? issuer_getConfigEndpoint(*p.issuer) : NULL; }
+inline static char* account_getTokenEndpoint(struct oidc_account p) { return p.metadata ? issuer_getTokenEndpoint(*p.metadata) : NULL; }
+inline static char* account_getAuthorizationEndpoint(struct oidc_account p) { return p.metadata ? issuer_getAuthorizationEndpoint(*p.metadata) : NULL; }
+inline static char* account_getRevocationEndpoint(struct oidc_account p) { return p.metadata ? issuer_getRevocationEndpoint(*p.metadata) : NULL; }
+inline static char* account_getRegistrationEndpoint(struct oidc_account p) { return p.metadata ? issuer_getRegistrationEndpoint(*p.metadata) : NULL; }
+inline static char* account_getDeviceAuthorizationEndpoint(struct oidc_account p) { 
+  // a discovered endpoint takes precedence over a configured one
+  if(p.metadata && issuer_getDeviceAuthorizationEndpoint(*p.metadata)) { return issuer_getDeviceAuthorizationEndpoint(*p.metadata); }
+  return p.issuer ? issuer_getDeviceAuthorizationEndpoint(*p.issuer) : NULL;
+}
+inline static char* account_getScopesSupported(struct oidc_account p) { return p.metadata ? issuer_getScopesSupported(*p.metadata) : NULL; }
+inline static char* account_getGrantTypesSupported(struct oidc_account p) { return p.metadata ? issuer_getGrantTypesSupported(*p.metadata) : NULL; }
+inline static char* account_getResponseTypesSupported(struct oidc_account p) { return p.metadata ? issuer_getResponseTypesSupported(*p.metadata) : NULL; }
 inline static char* account_getName(struct oidc_account p) { return p.name; }
 inline static char* account_getClientId(struct oidc_account p) { return p.client_id; }
 inline static char* account_getClientSecret(struct oidc_account p) { return p.client_secret; }
@@ -49,6 +72,9 @@ inline static char* account_getPassword(struct oidc_account p) { return p.passwo
 inline static char* account_getRefreshToken(struct oidc_account p) { return p.refresh_token; }
 inline static char* account_getAccessToken(struct oidc_account p) { return p.token.access_token; }
 inline static unsigned long account_getTokenExpiresAt(struct oidc_account p) { return p.token.token_expires_at; }
+inline static struct token_cache* account_getScopedTokens(struct oidc_account p) { return p.scoped_tokens; }
+inline static list_t* account_getRefreshFailures(struct oidc_account p) { return p.refresh_failures; }
+inline static struct refresh_schedule* account_getRefreshSchedule(struct oidc_account* p) { return &(p->schedule); }
 inline static char* account_getCertPath(struct oidc_account p) { return p.cert_path; }
 inline static char** account_getRedirectUris(struct oidc_account p) { return p.redirect_uris; }
 inline static size_t account_getRedirectUrisCount(struct oidc_account p) { return p.redirect_uris_count; }
@@ -66,16 +92,21 @@ inline static void account_setScope(struct oidc_account* p, char* scope) {
   }
 }
 inline static void account_setIssuer(struct oidc_account* p, struct oidc_issuer* issuer) { clearFreeIssuer(p->issuer); p->issuer=issuer; if(issuer) {account_setScope(p, defineUsableScopes(*p));}}
-inline static void account_setScopesSupported(struct oidc_account* p, char* scopes_supported) {
-  issuer_setScopesSupported(p->issuer, scopes_supported);
-  char* usable = defineUsableScopes(*p);
-  clearFreeString(p->scope); p->scope=usable;
+// takes over the reference to \p metadata
+inline static void account_setMetadata(struct oidc_account* p, struct oidc_issuer* metadata) {
+  issuer_unref(p->metadata); p->metadata=metadata;
+  if(metadata) {
+    char* usable = defineUsableScopes(*p);
+    clearFreeString(p->scope); p->scope=usable;
+  }
 }
 inline static void account_setUsername(struct oidc_account* p, char* username) { clearFreeString(p->username); p->username=username; }
 inline static void account_setPassword(struct oidc_account* p, char* password) { clearFreeString(p->password); p->password=password; }
 inline static void account_setRefreshToken(struct oidc_account* p, char* refresh_token) { clearFreeString(p->refresh_token); p->refresh_token=refresh_token; }
 inline static void account_setAccessToken(struct oidc_account* p, char* access_token) { clearFreeString(p->token.access_token); p->token.access_token=access_token; }
 inline static void account_setTokenExpiresAt(struct oidc_account* p, unsigned long token_expires_at) { p->token.token_expires_at=token_expires_at; }
+inline static void account_setScopedTokens(struct oidc_account* p, struct token_cache* scoped_tokens) { clearFreeTokenCache(p->scoped_tokens); p->scoped_tokens=scoped_tokens; }
+inline static void account_setRefreshFailures(struct oidc_account* p, list_t* refresh_failures) { if(p->refresh_failures) { list_destroy(p->refresh_failures); } p->refresh_failures=refresh_failures; }
 inline static void account_setCertPath(struct oidc_account* p, char* cert_path) { clearFreeString(p->cert_path); p->cert_path=cert_path; }
 inline static void account_setRedirectUris(struct oidc_account* p, char** redirect_uris, size_t redirect_uris_count) { 
   size_t i;
@@ -88,19 +119,16 @@ inline static void account_setRedirectUris(struct oidc_account* p, char** redire
 }
 inline static void account_setUsedState(struct oidc_account* p, char* used_state) { clearFreeString(p->usedState); p->usedState=used_state; }
 
-struct oidc_account* addAccount(struct oidc_account* p, size_t* size, struct oidc_account account) ;
-struct oidc_account* findAccountByName(struct oidc_account* p, size_t size, struct oidc_account key) ;
-struct oidc_account* findAccountByState(struct oidc_account* p, size_t size, struct oidc_account key) ;
-struct oidc_account* removeAccount(struct oidc_account* p, size_t* size, struct oidc_account key) ;
 struct oidc_account* getAccountFromJSON(char* json) ;
+void account_writeJSON(struct json_writer* w, struct oidc_account p) ;
 char* accountToJSON(struct oidc_account p) ;
+struct oidc_account* copyAccount(struct oidc_account p) ;
 void freeAccount(struct oidc_account* p) ;
 void freeAccountContent(struct oidc_account* p) ;
 
 int accountConfigExists(const char* accountname) ;
 struct oidc_account* decryptAccount(const char* accountname, const char* password) ;
 struct oidc_account* decryptAccountText(char* fileText, const char* password) ;
-char* getAccountNameList(struct oidc_account* p, size_t size) ;
 int hasRedirectUris(struct oidc_account account) ;
 
 #endif // ACCOUNT_H
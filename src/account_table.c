@@ -0,0 +1,329 @@
+#include "account_table.h"
+
+#include <stdint.h>
+#include <syslog.h>
+
+#define ACCOUNTTABLE_MIN_CAPACITY 16
+
+struct index_entry {
+  struct oidc_account* account;
+  size_t pos; // position of the account in the storage
+  struct index_entry* next;
+};
+
+/* a chained hash index over the accounts. The key is read from the account
+ * itself, so it has to be removed from the index before the key changes. */
+struct account_index {
+  struct index_entry** buckets;
+  size_t bucket_count; // always a power of 2
+  size_t count;
+  char* (*key)(struct oidc_account);
+};
+
+/* the loaded accounts. They are stored unordered in an array that grows and
+ * shrinks geometrically; lookups go through the hash indices and never
+ * reorder the storage. Pointers to accounts stay valid until they are
+ * removed. */
+struct account_table {
+  struct oidc_account** accounts;
+  size_t count;
+  size_t capacity;
+  struct account_index byName;
+  struct account_index byState; // only accounts with a pending state
+};
+
+static size_t hashString(const char* str) {
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a
+  while(*str) {
+    hash ^= (unsigned char) *str++;
+    hash *= 1099511628211ULL;
+  }
+  return (size_t) hash;
+}
+
+static oidc_error_t index_init(struct account_index* idx, char* (*key)(struct oidc_account)) {
+  idx->buckets = calloc(sizeof(struct index_entry*), ACCOUNTTABLE_MIN_CAPACITY);
+  if(idx->buckets==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return oidc_errno;
+  }
+  idx->bucket_count = ACCOUNTTABLE_MIN_CAPACITY;
+  idx->count = 0;
+  idx->key = key;
+  return OIDC_SUCCESS;
+}
+
+static void index_free(struct account_index* idx) {
+  size_t i;
+  for(i=0; i<idx->bucket_count; i++) {
+    struct index_entry* entry = idx->buckets[i];
+    while(entry) {
+      struct index_entry* next = entry->next;
+      clearFree(entry, sizeof(struct index_entry));
+      entry = next;
+    }
+  }
+  clearFree(idx->buckets, sizeof(struct index_entry*) * idx->bucket_count);
+}
+
+static struct index_entry* index_find(struct account_index* idx, const char* key) {
+  struct index_entry* entry = idx->buckets[hashString(key) & (idx->bucket_count-1)];
+  while(entry && strcmp(idx->key(*(entry->account)), key)!=0) {
+    entry = entry->next;
+  }
+  return entry;
+}
+
+/** @fn void index_rehash(struct account_index* idx, size_t bucket_count)
+ * @brief distributes the entries on a new number of buckets. If the buckets
+ * cannot be allocated the index keeps working with the old ones.
+ */
+static void index_rehash(struct account_index* idx, size_t bucket_count) {
+  struct index_entry** buckets = calloc(sizeof(struct index_entry*), bucket_count);
+  if(buckets==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    return;
+  }
+  size_t i;
+  for(i=0; i<idx->bucket_count; i++) {
+    struct index_entry* entry = idx->buckets[i];
+    while(entry) {
+      struct index_entry* next = entry->next;
+      size_t b = hashString(idx->key(*(entry->account))) & (bucket_count-1);
+      entry->next = buckets[b];
+      buckets[b] = entry;
+      entry = next;
+    }
+  }
+  clearFree(idx->buckets, sizeof(struct index_entry*) * idx->bucket_count);
+  idx->buckets = buckets;
+  idx->bucket_count = bucket_count;
+}
+
+static oidc_error_t index_insert(struct account_index* idx, struct oidc_account* account, size_t pos) {
+  struct index_entry* entry = calloc(sizeof(struct index_entry), 1);
+  if(entry==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return oidc_errno;
+  }
+  if(idx->count >= idx->bucket_count) {
+    index_rehash(idx, idx->bucket_count * 2);
+  }
+  size_t b = hashString(idx->key(*account)) & (idx->bucket_count-1);
+  entry->account = account;
+  entry->pos = pos;
+  entry->next = idx->buckets[b];
+  idx->buckets[b] = entry;
+  idx->count++;
+  return OIDC_SUCCESS;
+}
+
+/** @fn size_t index_remove(struct account_index* idx, struct oidc_account*
+ * account)
+ * @brief removes an account from an index
+ * @return the stored position of the removed account
+ */
+static size_t index_remove(struct account_index* idx, struct oidc_account* account) {
+  struct index_entry** link = &(idx->buckets[hashString(idx->key(*account)) & (idx->bucket_count-1)]);
+  while(*link && (*link)->account!=account) {
+    link = &((*link)->next);
+  }
+  struct index_entry* entry = *link;
+  if(entry==NULL) {
+    return 0;
+  }
+  size_t pos = entry->pos;
+  *link = entry->next;
+  clearFree(entry, sizeof(struct index_entry));
+  idx->count--;
+  if(idx->bucket_count > ACCOUNTTABLE_MIN_CAPACITY && idx->count < idx->bucket_count/4) {
+    index_rehash(idx, idx->bucket_count / 2);
+  }
+  return pos;
+}
+
+/** @fn struct account_table* newAccountTable()
+ * @brief creates an empty account table
+ * @return a pointer to the new table. Has to be freed after usage using
+ * \f clearFreeAccountTable. On failure NULL is returned.
+ */
+struct account_table* newAccountTable() {
+  struct account_table* t = calloc(sizeof(struct account_table), 1);
+  if(t==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
+  if(index_init(&t->byName, account_getName)!=OIDC_SUCCESS) {
+    clearFree(t, sizeof(struct account_table));
+    return NULL;
+  }
+  if(index_init(&t->byState, account_getUsedState)!=OIDC_SUCCESS) {
+    index_free(&t->byName);
+    clearFree(t, sizeof(struct account_table));
+    return NULL;
+  }
+  return t;
+}
+
+/** @fn void clearFreeAccountTable(struct account_table* t)
+ * @brief frees an account table and all accounts in it
+ */
+void clearFreeAccountTable(struct account_table* t) {
+  if(t==NULL) {
+    return;
+  }
+  size_t i;
+  for(i=0; i<t->count; i++) {
+    freeAccount(t->accounts[i]);
+  }
+  clearFree(t->accounts, sizeof(struct oidc_account*) * t->capacity);
+  index_free(&t->byName);
+  index_free(&t->byState);
+  clearFree(t, sizeof(struct account_table));
+}
+
+static oidc_error_t accounttable_resize(struct account_table* t, size_t capacity) {
+  void* tmp = realloc(t->accounts, sizeof(struct oidc_account*) * capacity);
+  if(tmp==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) realloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return oidc_errno;
+  }
+  t->accounts = tmp;
+  t->capacity = capacity;
+  return OIDC_SUCCESS;
+}
+
+/** @fn oidc_error_t accounttable_add(struct account_table* t, struct
+ * oidc_account* account)
+ * @brief adds an account to the table. An account with the same name is
+ * replaced.
+ * @param account the account to be added. The table takes ownership of it;
+ * on failure it is freed.
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t accounttable_add(struct account_table* t, struct oidc_account* account) {
+  if(t==NULL || account==NULL || account_getName(*account)==NULL) {
+    freeAccount(account);
+    oidc_setArgNullFuncError(__func__);
+    return oidc_errno;
+  }
+  accounttable_remove(t, account_getName(*account));
+  if(t->count==t->capacity) {
+    size_t capacity = t->capacity ? t->capacity * 2 : ACCOUNTTABLE_MIN_CAPACITY;
+    if(accounttable_resize(t, capacity)!=OIDC_SUCCESS) {
+      freeAccount(account);
+      return oidc_errno;
+    }
+  }
+  if(index_insert(&t->byName, account, t->count)!=OIDC_SUCCESS) {
+    freeAccount(account);
+    return oidc_errno;
+  }
+  if(isValid(account_getUsedState(*account)) && index_insert(&t->byState, account, t->count)!=OIDC_SUCCESS) {
+    index_remove(&t->byName, account);
+    freeAccount(account);
+    return oidc_errno;
+  }
+  t->accounts[t->count++] = account;
+  return OIDC_SUCCESS;
+}
+
+/** @fn void accounttable_remove(struct account_table* t, const char* name)
+ * @brief removes an account from the table and frees it. The last account
+ * of the storage takes its place.
+ * @param name the short name of the account to be removed
+ */
+void accounttable_remove(struct account_table* t, const char* name) {
+  struct oidc_account* account = accounttable_findByName(t, name);
+  if(account==NULL) {
+    return;
+  }
+  if(isValid(account_getUsedState(*account))) {
+    index_remove(&t->byState, account);
+  }
+  size_t pos = index_remove(&t->byName, account);
+  size_t last = t->count - 1;
+  if(pos!=last) {
+    struct oidc_account* moved = t->accounts[last];
+    t->accounts[pos] = moved;
+    index_find(&t->byName, account_getName(*moved))->pos = pos;
+  }
+  t->count--;
+  freeAccount(account);
+  if(t->capacity > ACCOUNTTABLE_MIN_CAPACITY && t->count < t->capacity/4) {
+    accounttable_resize(t, t->capacity / 2); // keeps the old storage on failure
+  }
+}
+
+/** @fn struct oidc_account* accounttable_findByName(struct account_table* t,
+ * const char* name)
+ * @brief finds an account by its short name in constant time
+ * @return a pointer to the account or NULL if it is not in the table
+ */
+struct oidc_account* accounttable_findByName(struct account_table* t, const char* name) {
+  if(t==NULL || name==NULL) {
+    return NULL;
+  }
+  struct index_entry* entry = index_find(&t->byName, name);
+  return entry ? entry->account : NULL;
+}
+
+/** @fn struct oidc_account* accounttable_findByState(struct account_table* t,
+ * const char* state)
+ * @brief finds an account by the state of its pending authorization code
+ * flow in constant time
+ * @return a pointer to the account or NULL if no account uses \p state
+ */
+struct oidc_account* accounttable_findByState(struct account_table* t, const char* state) {
+  if(t==NULL || !isValid(state)) {
+    return NULL;
+  }
+  struct index_entry* entry = index_find(&t->byState, state);
+  return entry ? entry->account : NULL;
+}
+
+/** @fn void accounttable_setUsedState(struct account_table* t, struct
+ * oidc_account* account, char* state)
+ * @brief sets the used state of an account in the table. Has to be used
+ * instead of \f account_setUsedState, so that the state index stays valid.
+ * @param state the new state; the account takes ownership. Might be NULL.
+ */
+void accounttable_setUsedState(struct account_table* t, struct oidc_account* account, char* state) {
+  if(isValid(account_getUsedState(*account))) {
+    index_remove(&t->byState, account);
+  }
+  account_setUsedState(account, state);
+  if(isValid(state) && index_insert(&t->byState, account, 0)!=OIDC_SUCCESS) {
+    account_setUsedState(account, NULL);
+  }
+}
+
+size_t accounttable_count(struct account_table* t) {
+  return t ? t->count : 0;
+}
+
+/** @fn struct oidc_account* accounttable_at(struct account_table* t, size_t i)
+ * @brief can be used to iterate over all accounts. Adding or removing
+ * accounts changes the order.
+ * @return the account at position \p i or NULL if \p i is out of range
+ */
+struct oidc_account* accounttable_at(struct account_table* t, size_t i) {
+  return t && i<t->count ? t->accounts[i] : NULL;
+}
+
+/** @fn void accounttable_writeNameList(struct json_writer* w, struct account_table* t)
+ * @brief writes the short names of all accounts in the table as json array
+ * @param w the writer; the array is written as next value
+ */
+void accounttable_writeNameList(struct json_writer* w, struct account_table* t) {
+  jsonwriter_beginArray(w);
+  size_t i;
+  for(i=0; i<accounttable_count(t); i++) {
+    jsonwriter_string(w, account_getName(*(t->accounts[i])));
+  }
+  jsonwriter_endArray(w);
+}
@@ -0,0 +1,22 @@
+#ifndef ACCOUNT_TABLE_H
+#define ACCOUNT_TABLE_H
+
+#include "account.h"
+#include "oidc_error.h"
+
+#include <stddef.h>
+
+struct account_table;
+
+struct account_table* newAccountTable() ;
+void clearFreeAccountTable(struct account_table* t) ;
+oidc_error_t accounttable_add(struct account_table* t, struct oidc_account* account) ;
+void accounttable_remove(struct account_table* t, const char* name) ;
+struct oidc_account* accounttable_findByName(struct account_table* t, const char* name) ;
+struct oidc_account* accounttable_findByState(struct account_table* t, const char* state) ;
+void accounttable_setUsedState(struct account_table* t, struct oidc_account* account, char* state) ;
+size_t accounttable_count(struct account_table* t) ;
+struct oidc_account* accounttable_at(struct account_table* t, size_t i) ;
+void accounttable_writeNameList(struct json_writer* w, struct account_table* t) ;
+
+#endif // ACCOUNT_TABLE_H
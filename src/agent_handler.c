@@ -1,3 +1,5 @@
+#define _XOPEN_SOURCE 500
+
 #include "agent_handler.h"
 #include "ipc.h"
 #include "oidc.h"
@@ -6,12 +8,182 @@
 #include "ipc_values.h"
 #include "device_code.h"
 #include "flow_handler.h"
+#include "worker_pool.h"
+#include "timer.h"
+#include "json.h"
 
 #include "../lib/list/src/list.h"
 
 #include <syslog.h>
 #include <string.h>
 #include <strings.h>
+#include <pthread.h>
+
+/* guards the array of loaded accounts. Handlers run concurrently on the
+ * worker threads, therefore every access to the array (including lookups,
+ * which sort it) has to hold this lock. It must never be held during network
+ * communication. */
+static pthread_mutex_t loaded_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* refreshes that are currently in progress, keyed by account name and
+ * normalized scope. Clients asking for the same token while it is refreshed
+ * wait on the entry instead of sending their own request to the OpenID
+ * Provider. */
+struct token_flight {
+  char* key;
+  list_t* waiters; // struct token_waiter*
+};
+
+struct token_waiter {
+  struct connection* con;
+  char* request_id;
+  struct token_batch_item* item; // if not NULL, the waiter is part of a batch
+  time_t min_valid_period; // the refreshed token might not be valid long enough for every waiter
+};
+static list_t* flights = NULL;
+static pthread_mutex_t flights_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* a request for multiple tokens. Each item is answered from the cache, by
+ * its own refresh job or by joining a refresh in progress. The response is
+ * written by whoever finishes the last item. */
+struct token_batch {
+  struct connection* con;
+  char* request_id;
+  struct account_table* loaded;
+  struct token_batch_item* items;
+  size_t count;
+  size_t remaining; // unfinished items (+1 while dispatching); guarded by mutex
+  pthread_mutex_t mutex;
+};
+
+struct token_batch_item {
+  struct token_batch* batch;
+  char* short_name;
+  char* scope;
+  time_t min_valid_period;
+  char* access_token;
+  time_t stale_expires_in;
+  char* error;
+  time_t retry_after;
+};
+
+/* how many seconds more than requested by clients an access token has to be
+ * valid. Tokens of accounts in use are refreshed in the background when they
+ * fall below that, so clients are answered from the cache. 0 disables
+ * refreshing ahead. */
+static time_t refresh_ahead = 0;
+
+/* if not negative, requests the cached token cannot satisfy are answered
+ * with it anyway while it is refreshed in the background, as long as it is
+ * valid for more than this many seconds */
+static time_t serve_stale = -1;
+
+/* a refresh that is not done for a waiting client */
+struct background_refresh {
+  struct account_table* loaded;
+  char* short_name;
+  char* scope;
+};
+
+static void refreshAheadTimer(void* arg) ;
+static void revalidateToken(struct account_table* loaded, const char* short_name, const char* scope) ;
+static void batchItemRefreshed(const char* access_token, time_t expires_at, const char* error, time_t retry_after, void* arg) ;
+static void requestToken(struct connection* con, const char* request_id, struct account_table* loaded, const char* short_name, time_t min_valid_period, const char* scope) ;
+
+void agent_setRefreshAhead(time_t seconds) {
+  refresh_ahead = seconds;
+}
+
+void agent_setServeStale(time_t floor) {
+  serve_stale = floor;
+}
+
+static struct background_refresh* newBackgroundRefresh(struct account_table* loaded, const char* short_name, const char* scope) {
+  struct background_refresh* job = calloc(sizeof(struct background_refresh), 1);
+  if(job==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    return NULL;
+  }
+  job->loaded = loaded;
+  job->short_name = oidc_strcopy(short_name);
+  job->scope = oidc_strcopyIfValid(scope);
+  return job;
+}
+
+static void clearFreeBackgroundRefresh(struct background_refresh* job) {
+  clearFreeString(job->short_name);
+  clearFreeString(job->scope);
+  clearFree(job, sizeof(struct background_refresh));
+}
+
+/** @fn void markTokenUse(struct oidc_account* account, time_t
+ * min_valid_period)
+ * @brief records that a client asked for the access token of an account, so
+ * it is refreshed ahead. Has to be called with the lock on the loaded accounts
+ * held.
+ */
+static void markTokenUse(struct oidc_account* account, time_t min_valid_period) {
+  if(refresh_ahead<=0 || min_valid_period==FORCE_NEW_TOKEN) {
+    return;
+  }
+  struct refresh_schedule* schedule = account_getRefreshSchedule(account);
+  schedule->in_use = 1;
+  if(min_valid_period > schedule->wanted_validity) {
+    schedule->wanted_validity = min_valid_period;
+  }
+}
+
+/** @fn void scheduleRefreshAhead(struct account_table* loaded, struct
+ * oidc_account* account)
+ * @brief schedules the background refresh of an account's access token, if
+ * it is in use. The refresh is due when the token is valid for less than the
+ * largest requested min_valid_period plus the refresh ahead window and a per
+ * account jitter; but at the latest after half of its lifetime. Has to be
+ * called with the lock on the loaded accounts held.
+ */
+static void scheduleRefreshAhead(struct account_table* loaded, struct oidc_account* account) {
+  struct refresh_schedule* schedule = account_getRefreshSchedule(account);
+  if(refresh_ahead<=0 || !schedule->in_use || !isValid(account_getRefreshToken(*account)) || account_getTokenExpiresAt(*account)==0) {
+    return;
+  }
+  if(schedule->jitter==0) {
+    schedule->jitter = 1 + random() % (refresh_ahead/2 + 1);
+  }
+  time_t window = schedule->wanted_validity + refresh_ahead + schedule->jitter;
+  if(schedule->lifetime>0 && window > schedule->lifetime/2) {
+    window = schedule->lifetime/2;
+  }
+  time_t at = (time_t)account_getTokenExpiresAt(*account) - window;
+  time_t now = time(NULL);
+  if(at<now) {
+    at = now;
+  }
+  if(at==schedule->refresh_at) {
+    return;
+  }
+  struct background_refresh* job = newBackgroundRefresh(loaded, account_getName(*account), NULL);
+  if(job==NULL) {
+    return;
+  }
+  // a previously scheduled timer finds refresh_at changed and does nothing
+  if(timer_add(at, refreshAheadTimer, job)!=OIDC_SUCCESS) {
+    clearFreeBackgroundRefresh(job);
+    return;
+  }
+  schedule->refresh_at = at;
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Refreshing token for '%s' in %lu seconds", account_getName(*account), (unsigned long)(at-now));
+}
+
+/** @fn void writeConfigResponse(int sock, struct oidc_account account)
+ * @brief writes a success response containing the account configuration
+ */
+static void writeConfigResponse(int sock, struct oidc_account account) {
+  struct json_writer w;
+  ipc_beginResponse(&w, STATUS_SUCCESS);
+  jsonwriter_key(&w, "config");
+  account_writeJSON(&w, account);
+  ipc_writeResponse(sock, &w);
+}
 
 void initAuthCodeFlow(struct oidc_account* account, int sock, char* info) {
   char state[25];
@@ -20,15 +192,18 @@ void initAuthCodeFlow(struct oidc_account* account, int sock, char* info) {
   if(uri == NULL) {
     ipc_writeOidcErrno(sock);
   } else {
+    struct json_writer w;
+    ipc_beginResponse(&w, STATUS_ACCEPTED);
+    jsonwriter_addString(&w, "uri", uri);
+    jsonwriter_addString(&w, "state", state);
     if(info) {
-      ipc_write(sock, RESPONSE_STATUS_CODEURI_INFO, STATUS_ACCEPTED, uri, state, info);
-    } else {
-      ipc_write(sock, RESPONSE_STATUS_CODEURI, STATUS_ACCEPTED, uri, state);
+      jsonwriter_addString(&w, "info", info);
     }
+    ipc_writeResponse(sock, &w);
   }
   clearFreeString(uri);
 }
-void agent_handleGen(int sock, struct oidc_account** loaded_p, size_t* loaded_p_count, char* account_json, const char* flow) {
+void agent_handleGen(int sock, struct account_table* loaded, char* account_json, const char* flow) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle Gen request");
   struct oidc_account* account = getAccountFromJSON(account_json);
   if(account==NULL) {
@@ -77,7 +252,11 @@ void agent_handleGen(int sock, struct oidc_account** loaded_p, size_t* loaded_p_
       return;
       }
       char* json = deviceCodeToJSON(*dc);
-      ipc_write(sock, RESPONSE_ACCEPTED_DEVICE, json, account_json);
+      struct json_writer w;
+      ipc_beginResponse(&w, STATUS_ACCEPTED);
+      jsonwriter_addRaw(&w, "oidc_device", json);
+      jsonwriter_addRaw(&w, "config", account_json);
+      ipc_writeResponse(sock, &w);
       clearFreeString(json);
       clearFreeDeviceCode(dc);
       list_iterator_destroy(it);
@@ -85,7 +264,9 @@ void agent_handleGen(int sock, struct oidc_account** loaded_p, size_t* loaded_p_
       freeAccount(account);
       return;
     } else { //UNKNOWN FLOW
-      ipc_write(sock, RESPONSE_ERROR, "Unknown flow %s", current_flow->val);   
+      char* error = oidc_sprintf("Unknown flow %s", (char*) current_flow->val);
+      ipc_writeError(sock, error);
+      clearFreeString(error);
       list_iterator_destroy(it);
       list_destroy(flows);
       freeAccount(account);
@@ -99,28 +280,29 @@ void agent_handleGen(int sock, struct oidc_account** loaded_p, size_t* loaded_p_
   account_setUsername(account, NULL);
   account_setPassword(account, NULL);
   if(isValid(account_getRefreshToken(*account))) {
-    char* json = accountToJSON(*account);
-    ipc_write(sock, RESPONSE_STATUS_CONFIG, STATUS_SUCCESS, json);
-    clearFreeString(json);
-    *loaded_p = removeAccount(*loaded_p, loaded_p_count, *account);
-    *loaded_p = addAccount(*loaded_p, loaded_p_count, *account);
-    clearFree(account, sizeof(*account));
+    writeConfigResponse(sock, *account);
+    pthread_mutex_lock(&loaded_mutex);
+    accounttable_add(loaded, account);
+    pthread_mutex_unlock(&loaded_mutex);
   } else {
-    ipc_write(sock, RESPONSE_ERROR, success ? "OIDP response does not contain a refresh token" : "No flow was successfull.");   
+    ipc_writeError(sock, success ? "OIDP response does not contain a refresh token" : "No flow was successfull.");
     freeAccount(account);
   }
 } 
 
-void agent_handleAdd(int sock, struct oidc_account** loaded_p, size_t* loaded_p_count, char* account_json) {
+void agent_handleAdd(int sock, struct account_table* loaded, char* account_json) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle Add request");
   struct oidc_account* account = getAccountFromJSON(account_json);
   if(account==NULL) {
     ipc_writeOidcErrno(sock);
     return;
   }
-  if(NULL!=findAccountByName(*loaded_p, *loaded_p_count, *account)) {
+  pthread_mutex_lock(&loaded_mutex);
+  int isLoaded = NULL!=accounttable_findByName(loaded, account_getName(*account));
+  pthread_mutex_unlock(&loaded_mutex);
+  if(isLoaded) {
     freeAccount(account);
-    ipc_write(sock, RESPONSE_ERROR, "account already loaded");
+    ipc_writeError(sock, "account already loaded");
     return;
   }
   if(getIssuerConfig(account)!=OIDC_SUCCESS) {
@@ -137,21 +319,35 @@ void agent_handleAdd(int sock, struct oidc_account** loaded_p, size_t* loaded_p_
     ipc_writeOidcErrno(sock);
     return;
   }
-  *loaded_p = addAccount(*loaded_p, loaded_p_count, *account);
-  clearFree(account, sizeof(*account));
-  ipc_write(sock, RESPONSE_STATUS_SUCCESS);
+  pthread_mutex_lock(&loaded_mutex);
+  if(NULL!=accounttable_findByName(loaded, account_getName(*account))) { // added concurrently
+    pthread_mutex_unlock(&loaded_mutex);
+    freeAccount(account);
+    ipc_writeError(sock, "account already loaded");
+    return;
+  }
+  oidc_error_t added = accounttable_add(loaded, account);
+  pthread_mutex_unlock(&loaded_mutex);
+  if(added!=OIDC_SUCCESS) {
+    ipc_writeOidcErrno(sock);
+    return;
+  }
+  ipc_writeStatus(sock, STATUS_SUCCESS);
 }
 
-void agent_handleRm(int sock, struct oidc_account** loaded_p, size_t* loaded_p_count, char* account_json, int revoke) {
+void agent_handleRm(int sock, struct account_table* loaded, char* account_json, int revoke) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle Remove request");
   struct oidc_account* account = getAccountFromJSON(account_json);
   if(account==NULL) {
     ipc_writeOidcErrno(sock);
     return;
   }
-  if(NULL==findAccountByName(*loaded_p, *loaded_p_count, *account)) {
+  pthread_mutex_lock(&loaded_mutex);
+  int isLoaded = NULL!=accounttable_findByName(loaded, account_getName(*account));
+  pthread_mutex_unlock(&loaded_mutex);
+  if(!isLoaded) {
     freeAccount(account);
-    ipc_write(sock, RESPONSE_ERROR, revoke ? "Could not revoke token: account not loaded" : "account not loaded");
+    ipc_writeError(sock, revoke ? "Could not revoke token: account not loaded" : "account not loaded");
     return;
   }
   if(getIssuerConfig(account)!=OIDC_SUCCESS) {
@@ -162,56 +358,806 @@ void agent_handleRm(int sock, struct oidc_account** loaded_p, size_t* loaded_p_c
   if(revoke && (revokeToken(account)!=OIDC_SUCCESS)) {
     freeAccount(account);
     char* error = oidc_sprintf("Could not revoke token: %s", oidc_serror());
-    ipc_write(sock, RESPONSE_ERROR, error);
+    ipc_writeError(sock, error);
     clearFreeString(error);
     return;
   }
-  *loaded_p = removeAccount(*loaded_p, loaded_p_count, *account);
+  pthread_mutex_lock(&loaded_mutex);
+  accounttable_remove(loaded, account_getName(*account));
+  pthread_mutex_unlock(&loaded_mutex);
   freeAccount(account);
-  ipc_write(sock, RESPONSE_STATUS_SUCCESS);
+  ipc_writeStatus(sock, STATUS_SUCCESS);
 }
 
-void agent_handleToken(int sock, struct oidc_account* loaded_p, size_t loaded_p_count, char* short_name, char* min_valid_period_str, const char* scope) {
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle Token request");
-  if(short_name==NULL) {
-    ipc_write(sock, RESPONSE_ERROR, "Bad request. Required field 'account_name' not present.");
+/** @fn void writeTokenError(int sock, const char* error, time_t retry_after)
+ * @brief writes the error response to a token request
+ * @param retry_after if positive, the seconds until the agent tries to refresh
+ * the token again; it is included in the response
+ */
+static void writeTokenError(int sock, const char* error, time_t retry_after) {
+  struct json_writer w;
+  ipc_beginResponse(&w, STATUS_FAILURE);
+  jsonwriter_addString(&w, "error", error);
+  if(retry_after>0) {
+    jsonwriter_addUnsigned(&w, "retry_after", (unsigned long) retry_after);
+  }
+  ipc_writeResponse(sock, &w);
+}
+
+static void writeTokenResponse(int sock, const char* access_token, time_t stale_expires_in, time_t retry_after) {
+  if(access_token==NULL) {
+    writeTokenError(sock, oidc_serror(), retry_after);
     return;
   }
-  struct oidc_account key = { .name = short_name };
-  time_t min_valid_period = min_valid_period_str!=NULL ? atoi(min_valid_period_str) : 0;
-  struct oidc_account* account = findAccountByName(loaded_p, loaded_p_count, key);
-  if(account==NULL) {
-    ipc_write(sock, RESPONSE_ERROR, "Account not loaded.");
+  if(stale_expires_in<=0) {
+    ipc_writeToken(sock, access_token);
     return;
   }
-  char* access_token = getAccessTokenUsingRefreshFlow(account, min_valid_period, scope);
-  if(access_token==NULL) {
-    ipc_writeOidcErrno(sock);
+  struct json_writer w;
+  ipc_beginResponse(&w, STATUS_SUCCESS);
+  jsonwriter_addString(&w, "access_token", access_token);
+  jsonwriter_addUnsigned(&w, "expires_in", (unsigned long) stale_expires_in);
+  ipc_writeResponse(sock, &w);
+}
+
+/** @fn int getRefreshFailure(struct oidc_account* account, const char* scope,
+ * time_t* retry_after)
+ * @brief checks if refreshing a token of an account must not be tried,
+ * because it failed permanently or recently. Has to be called with the lock on
+ * the loaded accounts held.
+ * @param retry_after is set to the seconds until a refresh is tried again; 0
+ * if the failure is permanent
+ * @return 1 if the refresh must not be tried (oidc_errno is set to the cached
+ * error); 0 otherwise
+ */
+static int getRefreshFailure(struct oidc_account* account, const char* scope, time_t* retry_after) {
+  struct refresh_failure* failure = refreshfailure_find(account_getRefreshFailures(*account), scope);
+  if(failure==NULL) {
+    return 0;
+  }
+  oidc_errno = OIDC_EERROR;
+  oidc_seterror(failure->error);
+  *retry_after = failure->permanent ? 0 : failure->retry_at - time(NULL);
+  return 1;
+}
+
+/** @fn int getCachedToken(struct account_table* loaded, char* short_name,
+ * time_t min_valid_period, const char* scope, char** access_token, time_t*
+ * stale_expires_in, time_t* retry_after)
+ * @brief looks up the access token of a loaded account without contacting
+ * the OpenID Provider
+ * @param scope if valid, the account's cache of tokens for other scopes is
+ * used
+ * @param access_token is set to a copy of the cached access token, if it is
+ * valid long enough. Has to be freed after usage.
+ * @param stale_expires_in is set to the remaining lifetime of the token, if
+ * it is not valid long enough, but served anyway (see \f agent_setServeStale).
+ * The caller has to start a refresh using \f revalidateToken.
+ * @param retry_after is set if a refresh is needed, but it failed before; see
+ * \f getRefreshFailure
+ * @return 1 if the lookup is final, i.e. \p access_token was set or an error
+ * is returned (oidc_errno is set); 0 if a refresh is needed
+ */
+static int getCachedToken(struct account_table* loaded, char* short_name, time_t min_valid_period, const char* scope, char** access_token, time_t* stale_expires_in, time_t* retry_after) {
+  pthread_mutex_lock(&loaded_mutex);
+  struct oidc_account* account = accounttable_findByName(loaded, short_name);
+  if(account==NULL) {
+    pthread_mutex_unlock(&loaded_mutex);
+    oidc_errno = OIDC_EERROR;
+    oidc_seterror("Account not loaded.");
+    return 1;
+  }
+  if(!isValid(scope)) {
+    markTokenUse(account, min_valid_period);
+  }
+  *access_token = getCachedAccessToken(account, min_valid_period, scope, NULL);
+  int final = *access_token!=NULL;
+  if(final && !isValid(scope)) {
+    scheduleRefreshAhead(loaded, account);
+  }
+  if(!final && serve_stale>=0 && min_valid_period > serve_stale) {
+    unsigned long expires_at = 0;
+    *access_token = getCachedAccessToken(account, serve_stale, scope, &expires_at);
+    if(*access_token) {
+      *stale_expires_in = (time_t)expires_at - time(NULL);
+      final = 1;
+    }
+  }
+  if(!final) {
+    final = getRefreshFailure(account, scope, retry_after);
+  }
+  pthread_mutex_unlock(&loaded_mutex);
+  return final;
+}
+
+/** @fn int agent_handleCachedToken(int sock, struct account_table* loaded,
+ * char* short_name, char* min_valid_period_str, const char* scope)
+ * @brief answers a token request that can be answered without contacting the
+ * OpenID Provider, i.e. if the cached access token is valid long enough (or
+ * can be served stale) or the request is invalid. Does not block and can
+ * therefore be called from the thread running the event loop.
+ * @return 1 if the request was answered; 0 if \f agent_handleToken has to
+ * be called
+ */
+int agent_handleCachedToken(int sock, struct account_table* loaded, char* short_name, char* min_valid_period_str, const char* scope) {
+  if(short_name==NULL) {
+    ipc_writeError(sock, "Bad request. Required field 'account_name' not present.");
+    return 1;
+  }
+  time_t min_valid_period = min_valid_period_str!=NULL ? atoi(min_valid_period_str) : 0;
+  char* access_token = NULL;
+  time_t stale_expires_in = 0;
+  time_t retry_after = 0;
+  if(!getCachedToken(loaded, short_name, min_valid_period, scope, &access_token, &stale_expires_in, &retry_after)) {
+    return 0;
+  }
+  if(access_token!=NULL) {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Answered Token request from cache");
+  }
+  writeTokenResponse(sock, access_token, stale_expires_in, retry_after);
+  clearFreeString(access_token);
+  if(stale_expires_in>0) {
+    revalidateToken(loaded, short_name, scope);
+  }
+  return 1;
+}
+
+static char* tokenFlightKey(const char* short_name, const char* scope) {
+  char* normalized = normalizeScope(scope);
+  char* key = oidc_sprintf("%s %s", short_name, normalized);
+  clearFreeString(normalized);
+  return key;
+}
+
+static int matchTokenFlight(char* key, struct token_flight* flight) {
+  return strcmp(flight->key, key)==0;
+}
+
+static void clearFreeTokenWaiter(struct token_waiter* waiter) {
+  clearFreeString(waiter->request_id);
+  clearFree(waiter, sizeof(struct token_waiter));
+}
+
+static void clearFreeTokenFlight(struct token_flight* flight) {
+  clearFreeString(flight->key);
+  list_destroy(flight->waiters);
+  clearFree(flight, sizeof(struct token_flight));
+}
+
+/** @fn int joinTokenFlight(const char* short_name, const char* scope, time_t
+ * min_valid_period, struct connection* con, const char* request_id, struct
+ * token_batch_item* item)
+ * @brief coalesces token refreshes. If a refresh for the same account and
+ * scope is already in progress, a waiter for \p con (or \p item) is added to
+ * it; if both are NULL, nothing is added. Otherwise a new refresh is
+ * registered and the caller has to do it.
+ * @param min_valid_period the seconds the token has to be valid for the
+ * waiter; checked when the refresh is done, see \f answerTokenWaiters
+ * @return 1 if a refresh in progress was joined; 0 if the caller starts the
+ * refresh
+ */
+static int joinTokenFlight(const char* short_name, const char* scope, time_t min_valid_period, struct connection* con, const char* request_id, struct token_batch_item* item) {
+  char* key = tokenFlightKey(short_name, scope);
+  pthread_mutex_lock(&flights_mutex);
+  if(flights==NULL) {
+    flights = list_new();
+    flights->free = (void(*) (void*)) &clearFreeTokenFlight;
+    flights->match = (int(*) (void*, void*)) &matchTokenFlight;
+  }
+  list_node_t* node = list_find(flights, key);
+  if(node!=NULL && con==NULL && item==NULL) {
+    pthread_mutex_unlock(&flights_mutex);
+    clearFreeString(key);
+    return 1;
+  }
+  if(node!=NULL) {
+    struct token_flight* flight = node->val;
+    struct token_waiter* waiter = calloc(sizeof(struct token_waiter), 1);
+    waiter->con = con;
+    waiter->request_id = oidc_strcopyIfValid(request_id);
+    waiter->item = item;
+    waiter->min_valid_period = min_valid_period;
+    list_rpush(flight->waiters, list_node_new(waiter));
+    pthread_mutex_unlock(&flights_mutex);
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Waiting for token refresh in progress for '%s'", key);
+    clearFreeString(key);
+    return 1;
+  }
+  struct token_flight* flight = calloc(sizeof(struct token_flight), 1);
+  flight->key = key;
+  flight->waiters = list_new();
+  flight->waiters->free = (void(*) (void*)) &clearFreeTokenWaiter;
+  list_rpush(flights, list_node_new(flight));
+  pthread_mutex_unlock(&flights_mutex);
+  return 0;
+}
+
+/** @fn int agent_joinTokenRefresh(struct connection* con, const char*
+ * request_id, char* short_name, char* min_valid_period_str, const char* scope)
+ * @brief coalesces token refreshes. If a refresh for the same account and
+ * scope is already in progress, \p con is added to its waiters and will be
+ * answered (and handed back to the event loop through the worker pool) when
+ * the refresh is done. Otherwise a new refresh is registered and the caller
+ * has to run \f agent_handleToken.
+ * @param con the connection the request was read from
+ * @param request_id the id of the request, echoed in the response; might be
+ * NULL
+ * @param min_valid_period_str the seconds the token has to be valid for this
+ * request; might be NULL
+ * @return 1 if \p con joined a refresh in progress; 0 if the caller starts
+ * the refresh
+ */
+int agent_joinTokenRefresh(struct connection* con, const char* request_id, char* short_name, char* min_valid_period_str, const char* scope) {
+  if(short_name==NULL) {
+    return 0;
+  }
+  time_t min_valid_period = min_valid_period_str!=NULL ? atoi(min_valid_period_str) : 0;
+  return joinTokenFlight(short_name, scope, min_valid_period, con, request_id, NULL);
+}
+
+/** @fn list_t* finishTokenFlight(const char* short_name, const char* scope)
+ * @brief removes a refresh from the table of refreshes in progress
+ * @return the list of connections waiting for the refresh. Has to be freed
+ * using list_destroy. NULL if there were no waiters.
+ */
+static list_t* finishTokenFlight(const char* short_name, const char* scope) {
+  char* key = tokenFlightKey(short_name, scope);
+  list_t* waiters = NULL;
+  pthread_mutex_lock(&flights_mutex);
+  list_node_t* node = flights ? list_find(flights, key) : NULL;
+  if(node!=NULL) {
+    struct token_flight* flight = node->val;
+    waiters = flight->waiters;
+    flight->waiters = list_new();
+    list_remove(flights, node);
+  }
+  pthread_mutex_unlock(&flights_mutex);
+  clearFreeString(key);
+  return waiters;
+}
+
+/** @fn void recordRefreshFailure(struct account_table* loaded, char*
+ * short_name, const char* scope, time_t* retry_after)
+ * @brief remembers that refreshing a token failed with the error in
+ * oidc_errno, so that clients get the error without contacting the OpenID
+ * Provider again. If the provider rejected the grant, no refresh is tried for
+ * any scope until the account is re-added; if it rejected the scope, only
+ * that scope is not tried again. Otherwise the refresh is retried after an
+ * exponential backoff.
+ * @param retry_after is set to the seconds until a refresh is tried again; 0
+ * if the failure is permanent
+ */
+static void recordRefreshFailure(struct account_table* loaded, char* short_name, const char* scope, time_t* retry_after) {
+  int permanent = REFRESH_FAILURE_TRANSIENT;
+  if(oidc_errno==OIDC_EGRANT || oidc_errno==OIDC_ENOREFRSH) {
+    permanent = REFRESH_FAILURE_ACCOUNT;
+  } else if(oidc_errno==OIDC_ESCOPE) {
+    permanent = REFRESH_FAILURE_SCOPE;
+  }
+  *retry_after = 0;
+  pthread_mutex_lock(&loaded_mutex);
+  struct oidc_account* stored = accounttable_findByName(loaded, short_name);
+  if(stored) {
+    if(account_getRefreshFailures(*stored)==NULL) {
+      account_setRefreshFailures(stored, newRefreshFailureList());
+    }
+    *retry_after = refreshfailure_record(account_getRefreshFailures(*stored), scope, oidc_serror(), permanent);
+  }
+  pthread_mutex_unlock(&loaded_mutex);
+  if(permanent==REFRESH_FAILURE_ACCOUNT) {
+    syslog(LOG_AUTHPRIV|LOG_NOTICE, "Refreshing token for '%s' failed permanently. Not trying again until the account is re-added.", short_name);
+  } else if(permanent==REFRESH_FAILURE_SCOPE) {
+    syslog(LOG_AUTHPRIV|LOG_NOTICE, "Refreshing token for '%s' was rejected for the requested scope. Not trying this scope again until the account is re-added.", short_name);
+  } else {
+    syslog(LOG_AUTHPRIV|LOG_NOTICE, "Refreshing token for '%s' failed. Trying again in %lu seconds.", short_name, (unsigned long) *retry_after);
+  }
+}
+
+/** @fn void storeRefreshedToken(struct account_table* loaded, const char*
+ * short_name, const char* scope, struct oidc_account* account)
+ * @brief writes a token refreshed on a copy of a loaded account back to the
+ * loaded account and clears the cached failure
+ * @param account the copy the refresh flow was done on
+ */
+static void storeRefreshedToken(struct account_table* loaded, const char* short_name, const char* scope, struct oidc_account* account) {
+  pthread_mutex_lock(&loaded_mutex);
+  struct oidc_account* stored = accounttable_findByName(loaded, short_name);
+  if(stored==NULL) {
+    pthread_mutex_unlock(&loaded_mutex);
     return;
   }
-  ipc_write(sock, RESPONSE_STATUS_ACCESS, STATUS_SUCCESS, access_token);
   if(isValid(scope)) {
+    refreshfailure_clear(account_getRefreshFailures(*stored), scope);
+    if(account_getScopedTokens(*account)) {
+      if(account_getScopedTokens(*stored)==NULL) {
+        account_setScopedTokens(stored, newTokenCache(MAX_SCOPED_TOKENS));
+      }
+      tokencache_merge(account_getScopedTokens(*stored), account_getScopedTokens(*account));
+    }
+    pthread_mutex_unlock(&loaded_mutex);
+    return;
+  }
+  refreshfailure_clear(account_getRefreshFailures(*stored), NULL);
+  if(account_getTokenExpiresAt(*account) >= account_getTokenExpiresAt(*stored)) {
+    account_setAccessToken(stored, oidc_strcopy(account_getAccessToken(*account)));
+    account_setTokenExpiresAt(stored, account_getTokenExpiresAt(*account));
+    account_getRefreshSchedule(stored)->lifetime = account_getTokenExpiresAt(*account) - time(NULL);
+    scheduleRefreshAhead(loaded, stored);
+  }
+  pthread_mutex_unlock(&loaded_mutex);
+}
+
+typedef void (*token_callback)(const char* access_token, time_t expires_at, const char* error, time_t retry_after, void* arg);
+
+/* a refresh flow done on a copy of a loaded account */
+struct token_refresh {
+  struct account_table* loaded;
+  char* short_name;
+  char* scope;
+  token_callback callback;
+  void* arg;
+};
+
+static void tokenRefreshed(struct oidc_account* account, const char* access_token, void* arg) {
+  struct token_refresh* refresh = arg;
+  time_t retry_after = 0;
+  unsigned long expires_at = 0;
+  char* error = NULL;
+  if(access_token) {
+    storeRefreshedToken(refresh->loaded, refresh->short_name, refresh->scope, account);
+    clearFreeString(getCachedAccessToken(account, 0, refresh->scope, &expires_at));
+  } else {
+    recordRefreshFailure(refresh->loaded, refresh->short_name, refresh->scope, &retry_after);
+    error = oidc_strcopy(oidc_serror());
+  }
+  refresh->callback(access_token, expires_at, error, retry_after, refresh->arg);
+  clearFreeString(error);
+  freeAccount(account);
+  clearFreeString(refresh->short_name);
+  clearFreeString(refresh->scope);
+  clearFree(refresh, sizeof(struct token_refresh));
+}
+
+/** @fn void refreshTokenAsync(struct account_table* loaded, const char*
+ * short_name, time_t min_valid_period, const char* scope, token_callback
+ * callback, void* arg)
+ * @brief gets an access token for a loaded account, using the refresh flow
+ * if needed. The refresh flow is done on a copy of the account by the event
+ * loop without blocking it; see \f refreshFlowAsync. Failed refreshes are
+ * cached; see \f recordRefreshFailure. Has to be called by the thread running
+ * the event loop.
+ * @param callback called exactly once, maybe before this function returns,
+ * with the access token and its expiration time (0 if unknown) or the error
+ * message and the seconds until a failed refresh is tried again (0 if it is
+ * not tried again)
+ * @param arg passed to \p callback
+ */
+static void refreshTokenAsync(struct account_table* loaded, const char* short_name, time_t min_valid_period, const char* scope, token_callback callback, void* arg) {
+  time_t retry_after = 0;
+  pthread_mutex_lock(&loaded_mutex);
+  struct oidc_account* stored = accounttable_findByName(loaded, short_name);
+  if(stored && getRefreshFailure(stored, scope, &retry_after)) {
+    pthread_mutex_unlock(&loaded_mutex);
+    callback(NULL, 0, oidc_serror(), retry_after, arg);
+    return;
+  }
+  struct oidc_account* account = stored ? copyAccount(*stored) : NULL;
+  pthread_mutex_unlock(&loaded_mutex);
+  if(account==NULL) {
+    if(stored==NULL) {
+      oidc_errno = OIDC_EERROR;
+      oidc_seterror("Account not loaded.");
+    }
+    callback(NULL, 0, oidc_serror(), 0, arg);
+    return;
+  }
+  // the token might have been refreshed since the cache was checked
+  unsigned long expires_at = 0;
+  char* access_token = getCachedAccessToken(account, min_valid_period, scope, &expires_at);
+  if(access_token) {
+    callback(access_token, expires_at, NULL, 0, arg);
     clearFreeString(access_token);
+    freeAccount(account);
+    return;
+  }
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "No acces token found that is valid long enough");
+  struct token_refresh* refresh = calloc(sizeof(struct token_refresh), 1);
+  if(refresh==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
   }
+  refresh->loaded = loaded;
+  refresh->short_name = oidc_strcopy(short_name);
+  refresh->scope = oidc_strcopyIfValid(scope);
+  refresh->callback = callback;
+  refresh->arg = arg;
+  if(!isValid(account_getRefreshToken(*account))) {
+    oidc_errno = OIDC_ENOREFRSH;
+    tokenRefreshed(account, NULL, refresh);
+    return;
+  }
+  refreshFlowAsync(account, scope, tokenRefreshed, refresh);
+}
+
+static void clearFreeTokenBatch(struct token_batch* batch) {
+  size_t i;
+  for(i=0; i<batch->count; i++) {
+    clearFreeString(batch->items[i].short_name);
+    clearFreeString(batch->items[i].scope);
+    clearFreeString(batch->items[i].access_token);
+    clearFreeString(batch->items[i].error);
+  }
+  clearFree(batch->items, sizeof(struct token_batch_item) * batch->count);
+  clearFreeString(batch->request_id);
+  pthread_mutex_destroy(&batch->mutex);
+  clearFree(batch, sizeof(struct token_batch));
+}
+
+/** @fn struct connection* releaseTokenBatch(struct token_batch* batch)
+ * @brief marks one item of a batch as finished. When it was the last one the
+ * response is written and the batch is freed.
+ * @return the connection of the batch, if it was answered; NULL otherwise
+ */
+static struct connection* releaseTokenBatch(struct token_batch* batch) {
+  pthread_mutex_lock(&batch->mutex);
+  size_t remaining = --batch->remaining;
+  pthread_mutex_unlock(&batch->mutex);
+  if(remaining>0) {
+    return NULL;
+  }
+  struct connection* con = batch->con;
+  ipc_setResponseContext(con, batch->request_id);
+  struct json_writer w;
+  ipc_beginResponse(&w, STATUS_SUCCESS);
+  jsonwriter_key(&w, "tokens");
+  jsonwriter_beginArray(&w);
+  size_t i;
+  for(i=0; i<batch->count; i++) {
+    struct token_batch_item* item = batch->items + i;
+    jsonwriter_beginObject(&w);
+    jsonwriter_addString(&w, "account", item->short_name ? item->short_name : "");
+    if(item->access_token) {
+      jsonwriter_addString(&w, "access_token", item->access_token);
+      if(item->stale_expires_in>0) {
+        jsonwriter_addUnsigned(&w, "expires_in", (unsigned long) item->stale_expires_in);
+      }
+    } else {
+      jsonwriter_addString(&w, "error", item->error);
+      if(item->retry_after>0) {
+        jsonwriter_addUnsigned(&w, "retry_after", (unsigned long) item->retry_after);
+      }
+    }
+    jsonwriter_endObject(&w);
+  }
+  jsonwriter_endArray(&w);
+  ipc_writeResponse(*(con->msgsock), &w);
+  ipc_setResponseContext(NULL, NULL);
+  clearFreeTokenBatch(batch);
+  return con;
 }
 
-void agent_handleList(int sock, struct oidc_account* loaded_p, size_t loaded_p_count) {
+/** @fn struct connection* finishBatchItem(struct token_batch_item* item,
+ * const char* access_token, const char* error, time_t retry_after)
+ * @brief stores the result of a batch item
+ * @return the connection of the batch, if this was its last item; NULL
+ * otherwise
+ */
+static struct connection* finishBatchItem(struct token_batch_item* item, const char* access_token, const char* error, time_t retry_after) {
+  if(access_token!=NULL) {
+    item->access_token = oidc_strcopy(access_token);
+  } else {
+    item->error = oidc_strcopy(error);
+    item->retry_after = retry_after;
+  }
+  return releaseTokenBatch(item->batch);
+}
+
+/** @fn void retryTokenWaiter(struct account_table* loaded, const char*
+ * short_name, const char* scope, struct token_waiter* waiter)
+ * @brief gets another token for a waiter the refreshed token is not valid
+ * long enough for. The waiter joins a refresh in progress or starts its own.
+ */
+static void retryTokenWaiter(struct account_table* loaded, const char* short_name, const char* scope, struct token_waiter* waiter) {
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Refreshed token for '%s' is not valid for %lu seconds, refreshing again", short_name, (unsigned long) waiter->min_valid_period);
+  if(joinTokenFlight(short_name, scope, waiter->min_valid_period, waiter->con, waiter->request_id, waiter->item)) {
+    return;
+  }
+  if(waiter->item) {
+    refreshTokenAsync(loaded, short_name, waiter->min_valid_period, scope, batchItemRefreshed, waiter->item);
+  } else {
+    requestToken(waiter->con, waiter->request_id, loaded, short_name, waiter->min_valid_period, scope);
+  }
+}
+
+/** @fn void answerTokenWaiters(struct account_table* loaded, const char*
+ * short_name, const char* scope, const char* access_token, time_t
+ * expires_at, const char* error, time_t retry_after)
+ * @brief finishes a refresh registered with \f joinTokenFlight and sends its
+ * result to all requests that joined in the meantime. Connections are handed
+ * back to the event loop through the worker pool. Requests the token is not
+ * valid long enough for are not answered, but get another token; see
+ * \f retryTokenWaiter.
+ * @param access_token the refreshed token or NULL if the refresh failed
+ * @param expires_at the expiration time of \p access_token; 0 if unknown
+ * @param error the error message if the refresh failed. It is passed
+ * explicitly, because a failed write to one of the clients sets oidc_errno.
+ * @param retry_after the seconds until the refresh is tried again, if it
+ * failed
+ */
+static void answerTokenWaiters(struct account_table* loaded, const char* short_name, const char* scope, const char* access_token, time_t expires_at, const char* error, time_t retry_after) {
+  list_t* waiters = finishTokenFlight(short_name, scope);
+  if(waiters==NULL) {
+    return;
+  }
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Answering %u waiting Token requests", waiters->len);
+  list_node_t* node;
+  list_iterator_t* it = list_iterator_new(waiters, LIST_HEAD);
+  while((node = list_iterator_next(it))) {
+    struct token_waiter* waiter = node->val;
+    if(access_token && expires_at>0 && waiter->min_valid_period>0 && expires_at-time(NULL) <= waiter->min_valid_period) {
+      retryTokenWaiter(loaded, short_name, scope, waiter);
+      continue;
+    }
+    if(waiter->item) {
+      struct connection* con = finishBatchItem(waiter->item, access_token, error, retry_after);
+      workerpool_postResult(con);
+      continue;
+    }
+    ipc_setResponseContext(waiter->con, waiter->request_id);
+    if(access_token) {
+      writeTokenResponse(*(waiter->con->msgsock), access_token, 0, 0);
+    } else {
+      writeTokenError(*(waiter->con->msgsock), error, retry_after);
+    }
+    workerpool_postResult(waiter->con);
+  }
+  ipc_setResponseContext(NULL, NULL);
+  list_iterator_destroy(it);
+  list_destroy(waiters);
+}
+
+static void backgroundRefreshDone(const char* access_token, time_t expires_at, const char* error, time_t retry_after, void* arg) {
+  struct background_refresh* job = arg;
+  if(error) {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Could not refresh token for '%s' in the background: %s", job->short_name, error);
+  }
+  answerTokenWaiters(job->loaded, job->short_name, job->scope, access_token, expires_at, error, retry_after);
+  clearFreeBackgroundRefresh(job);
+}
+
+static void refreshInBackground(struct background_refresh* job) {
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Refreshing token for '%s' in the background", job->short_name);
+  refreshTokenAsync(job->loaded, job->short_name, FORCE_NEW_TOKEN, job->scope, backgroundRefreshDone, job);
+}
+
+/** @fn void revalidateToken(struct account_table* loaded, const char*
+ * short_name, const char* scope)
+ * @brief refreshes a token that was served although it was not valid long
+ * enough, unless the token is already being refreshed. Clients asking
+ * meanwhile join it.
+ */
+static void revalidateToken(struct account_table* loaded, const char* short_name, const char* scope) {
+  struct background_refresh* job = newBackgroundRefresh(loaded, short_name, scope);
+  if(job==NULL) {
+    return;
+  }
+  if(joinTokenFlight(short_name, scope, 0, NULL, NULL, NULL)) {
+    clearFreeBackgroundRefresh(job);
+    return;
+  }
+  refreshInBackground(job);
+}
+
+/** @fn void refreshAheadTimer(void* arg)
+ * @brief called by the event loop when a refresh scheduled with
+ * \f scheduleRefreshAhead is due. Starts the refresh, unless the token is already being refreshed or the schedule changed.
+ */
+static void refreshAheadTimer(void* arg) {
+  struct background_refresh* job = arg;
+  pthread_mutex_lock(&loaded_mutex);
+  struct oidc_account* account = accounttable_findByName(job->loaded, job->short_name);
+  struct refresh_schedule* schedule = account ? account_getRefreshSchedule(account) : NULL;
+  int due = schedule && schedule->refresh_at!=0 && schedule->refresh_at<=time(NULL);
+  if(due) {
+    schedule->refresh_at = 0;
+  }
+  pthread_mutex_unlock(&loaded_mutex);
+  // a refresh in progress will schedule the next one when it is done
+  if(!due || joinTokenFlight(job->short_name, NULL, 0, NULL, NULL, NULL)) {
+    clearFreeBackgroundRefresh(job);
+    return;
+  }
+  pthread_mutex_lock(&loaded_mutex);
+  account = accounttable_findByName(job->loaded, job->short_name);
+  if(account) { // only refreshed again if it is used until then
+    account_getRefreshSchedule(account)->in_use = 0;
+    account_getRefreshSchedule(account)->wanted_validity = 0;
+  }
+  pthread_mutex_unlock(&loaded_mutex);
+  refreshInBackground(job);
+}
+
+/* a token request that is answered when its refresh is done */
+struct token_request {
+  struct connection* con;
+  char* request_id;
+  struct account_table* loaded;
+  char* short_name;
+  char* scope;
+};
+
+static void tokenRequestDone(const char* access_token, time_t expires_at, const char* error, time_t retry_after, void* arg) {
+  struct token_request* req = arg;
+  ipc_setResponseContext(req->con, req->request_id);
+  if(access_token) {
+    writeTokenResponse(*(req->con->msgsock), access_token, 0, 0);
+  } else {
+    writeTokenError(*(req->con->msgsock), error, retry_after);
+  }
+  ipc_setResponseContext(NULL, NULL);
+  answerTokenWaiters(req->loaded, req->short_name, req->scope, access_token, expires_at, error, retry_after);
+  workerpool_postResult(req->con);
+  clearFreeString(req->request_id);
+  clearFreeString(req->short_name);
+  clearFreeString(req->scope);
+  clearFree(req, sizeof(struct token_request));
+}
+
+/** @fn void agent_handleToken(struct connection* con, const char* request_id,
+ * struct account_table* loaded, char* short_name, char* min_valid_period_str,
+ * const char* scope)
+ * @brief handles a token request registered with \f agent_joinTokenRefresh
+ * by starting the refresh. Does not block and has to be called from the
+ * thread running the event loop. When the refresh is done, the request and
+ * all requests that joined in the meantime are answered and their
+ * connections are handed back through the worker pool.
+ * @param con the connection the request was read from
+ * @param request_id the id of the request, echoed in the response; might be
+ * NULL
+ */
+void agent_handleToken(struct connection* con, const char* request_id, struct account_table* loaded, char* short_name, char* min_valid_period_str, const char* scope) {
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle Token request");
+  time_t min_valid_period = min_valid_period_str!=NULL ? atoi(min_valid_period_str) : 0;
+  requestToken(con, request_id, loaded, short_name, min_valid_period, scope);
+}
+
+/** @fn void requestToken(struct connection* con, const char* request_id,
+ * struct account_table* loaded, const char* short_name, time_t
+ * min_valid_period, const char* scope)
+ * @brief starts the refresh for a token request; see \f agent_handleToken
+ */
+static void requestToken(struct connection* con, const char* request_id, struct account_table* loaded, const char* short_name, time_t min_valid_period, const char* scope) {
+  struct token_request* req = calloc(sizeof(struct token_request), 1);
+  if(req==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+  req->con = con;
+  req->request_id = oidc_strcopyIfValid(request_id);
+  req->loaded = loaded;
+  req->short_name = oidc_strcopy(short_name);
+  req->scope = oidc_strcopyIfValid(scope);
+  refreshTokenAsync(loaded, short_name, min_valid_period, scope, tokenRequestDone, req);
+}
+
+static void batchItemRefreshed(const char* access_token, time_t expires_at, const char* error, time_t retry_after, void* arg) {
+  struct token_batch_item* item = arg;
+  // this item is not finished yet, so the batch cannot be freed by a waiter
+  answerTokenWaiters(item->batch->loaded, item->short_name, item->scope, access_token, expires_at, error, retry_after);
+  workerpool_postResult(finishBatchItem(item, access_token, error, retry_after));
+}
+
+/** @fn int agent_handleTokenBatch(struct connection* con, const char*
+ * request_id, struct account_table* loaded, const
+ * char* tokens_json)
+ * @brief handles a request for multiple access tokens. Items that can be
+ * answered from the cache are answered immediately, the others are refreshed
+ * concurrently (or join a refresh in progress). Does not block and has to be
+ * called from the thread running the event loop.
+ * @param tokens_json a JSON array of objects containing the account, and
+ * optionally scope and min_valid_period
+ * @return 1 if the request was answered; 0 if it will be answered (and \p con
+ * handed back through the worker pool) when the last refresh is done
+ */
+int agent_handleTokenBatch(struct connection* con, const char* request_id, struct account_table* loaded, const char* tokens_json) {
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle Token batch request");
+  list_t* list = tokens_json ? JSONArrayToList(tokens_json) : NULL;
+  if(list==NULL || list->len==0) {
+    ipc_writeBadRequest(*(con->msgsock), "Required field 'tokens' not present or empty.");
+    if(list) {
+      list_destroy(list);
+    }
+    return 1;
+  }
+  struct token_batch* batch = calloc(sizeof(struct token_batch), 1);
+  struct token_batch_item* items = calloc(sizeof(struct token_batch_item), list->len);
+  if(batch==NULL || items==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+  batch->items = items;
+  batch->con = con;
+  batch->request_id = oidc_strcopyIfValid(request_id);
+  batch->loaded = loaded;
+  batch->count = list->len;
+  batch->remaining = batch->count + 1; // so no item can finish the batch while dispatching
+  pthread_mutex_init(&batch->mutex, NULL);
+  size_t i;
+  for(i=0; i<batch->count; i++) {
+    struct token_batch_item* item = batch->items + i;
+    item->batch = batch;
+    struct key_value pairs[3];
+    pairs[0].key = "account";
+    pairs[1].key = "scope";
+    pairs[2].key = "min_valid_period";
+    static struct json_keyset keyset = JSON_KEYSET_INIT;
+    if(getJSONValuesByKeySet(list_at(list, i)->val, pairs, sizeof(pairs)/sizeof(*pairs), &keyset)<0) {
+      item->error = oidc_strcopy(oidc_serror());
+      continue;
+    }
+    item->short_name = pairs[0].value;
+    item->scope = pairs[1].value;
+    item->min_valid_period = pairs[2].value!=NULL ? atoi(pairs[2].value) : 0;
+    clearFreeString(pairs[2].value);
+    if(item->short_name==NULL) {
+      item->error = oidc_strcopy("Bad request. Required field 'account' not present.");
+    }
+  }
+  list_destroy(list);
+  for(i=0; i<batch->count; i++) {
+    struct token_batch_item* item = batch->items + i;
+    char* access_token = NULL;
+    time_t retry_after = 0;
+    if(item->error) {
+      releaseTokenBatch(batch);
+    } else if(getCachedToken(loaded, item->short_name, item->min_valid_period, item->scope, &access_token, &item->stale_expires_in, &retry_after)) {
+      if(item->stale_expires_in>0) {
+        revalidateToken(loaded, item->short_name, item->scope);
+      }
+      finishBatchItem(item, access_token, oidc_serror(), retry_after);
+      clearFreeString(access_token);
+    } else if(!joinTokenFlight(item->short_name, item->scope, item->min_valid_period, NULL, NULL, item)) {
+      refreshTokenAsync(loaded, item->short_name, item->min_valid_period, item->scope, batchItemRefreshed, item);
+    }
+  }
+  return releaseTokenBatch(batch)!=NULL;
+}
+
+void agent_handleList(int sock, struct account_table* loaded) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle list request");
-  char* accountList = getAccountNameList(loaded_p, loaded_p_count);
-  ipc_write(sock, RESPONSE_STATUS_ACCOUNT, STATUS_SUCCESS, oidc_errno==OIDC_EARGNULL ? "[]" : accountList);
-  clearFreeString(accountList);
+  pthread_mutex_lock(&loaded_mutex);
+  struct json_writer w;
+  ipc_beginResponse(&w, STATUS_SUCCESS);
+  jsonwriter_key(&w, "account_list");
+  accounttable_writeNameList(&w, loaded);
+  pthread_mutex_unlock(&loaded_mutex);
+  ipc_writeResponse(sock, &w);
+}
+
+/** @fn void writeClientResponse(int sock, const char* client_json)
+ * @brief writes a success response containing the registered client as
+ * returned by the OpenID Provider
+ */
+static void writeClientResponse(int sock, const char* client_json) {
+  struct json_writer w;
+  ipc_beginResponse(&w, STATUS_SUCCESS);
+  jsonwriter_addRaw(&w, "client", client_json);
+  ipc_writeResponse(sock, &w);
 }
 
-void agent_handleRegister(int sock, struct oidc_account* loaded_p, size_t loaded_p_count, char* account_json, const char* access_token) {
+void agent_handleRegister(int sock, struct account_table* loaded, char* account_json, const char* access_token) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle Register request");
   struct oidc_account* account = getAccountFromJSON(account_json);
   if(account==NULL) {
     ipc_writeOidcErrno(sock);
     return;
   }
-  if(NULL!=findAccountByName(loaded_p, loaded_p_count, *account)) {
+  pthread_mutex_lock(&loaded_mutex);
+  int isLoaded = NULL!=accounttable_findByName(loaded, account_getName(*account));
+  pthread_mutex_unlock(&loaded_mutex);
+  if(isLoaded) {
     freeAccount(account);
-    ipc_write(sock, RESPONSE_ERROR, "A account with this shortname is already loaded. I will not register a new one.");
+    ipc_writeError(sock, "A account with this shortname is already loaded. I will not register a new one.");
     return;
   }
   if(getIssuerConfig(account)!=OIDC_SUCCESS) {
@@ -224,9 +1170,11 @@ void agent_handleRegister(int sock, struct oidc_account* loaded_p, size_t loaded
     ipc_writeOidcErrno(sock);
   } else {
     if(!isJSONObject(res)) {
-      char* escaped = escapeCharInStr(res, '"');
-      ipc_write(sock, RESPONSE_ERROR_INFO, "Received no JSON formatted response.", escaped);
-      clearFreeString(escaped);
+      struct json_writer w;
+      ipc_beginResponse(&w, STATUS_FAILURE);
+      jsonwriter_addString(&w, "error", "Received no JSON formatted response.");
+      jsonwriter_addString(&w, "info", res);
+      ipc_writeResponse(sock, &w);
     } else {
     if(json_hasKey(res, "error")) { // first failed
       char* res2 = dynamicRegistration(account, 0, access_token);
@@ -238,15 +1186,15 @@ void agent_handleRegister(int sock, struct oidc_account* loaded_p, size_t loaded
           if(error==NULL) {
             error = getJSONValue(res, "error");
           }
-          ipc_write(sock, RESPONSE_ERROR, error); 
+          ipc_writeError(sock, error);
           clearFreeString(error);
         } else { // first failed, second successful
-          ipc_write(sock, RESPONSE_SUCCESS_CLIENT, res2);
+          writeClientResponse(sock, res2);
         }
       }
       clearFreeString(res2);
     } else { // first was successfull
-      ipc_write(sock, RESPONSE_SUCCESS_CLIENT, res);
+      writeClientResponse(sock, res);
     }
   }
   }
@@ -254,7 +1202,7 @@ void agent_handleRegister(int sock, struct oidc_account* loaded_p, size_t loaded
   freeAccount(account);
 }
 
-void agent_handleCodeExchange(int sock, struct oidc_account** loaded_p, size_t* loaded_p_count, char* account_json, char* code, char* redirect_uri, char* state) {
+void agent_handleCodeExchange(int sock, struct account_table* loaded, char* account_json, char* code, char* redirect_uri, char* state) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle codeExchange request");
   struct oidc_account* account = getAccountFromJSON(account_json);
   if(account==NULL) {
@@ -272,20 +1220,18 @@ void agent_handleCodeExchange(int sock, struct oidc_account** loaded_p, size_t*
     return;
   }
   if(isValid(account_getRefreshToken(*account))) {
-    char* json = accountToJSON(*account);
-    ipc_write(sock, RESPONSE_STATUS_CONFIG, STATUS_SUCCESS, json);
-    clearFreeString(json);
+    writeConfigResponse(sock, *account);
     account_setUsedState(account, oidc_sprintf("%s", state));
-    *loaded_p = removeAccount(*loaded_p, loaded_p_count, *account);
-    *loaded_p = addAccount(*loaded_p, loaded_p_count, *account);
-    clearFree(account, sizeof(*account));
+    pthread_mutex_lock(&loaded_mutex);
+    accounttable_add(loaded, account);
+    pthread_mutex_unlock(&loaded_mutex);
   } else {
-    ipc_write(sock, RESPONSE_ERROR, "Could not get a refresh token");   
+    ipc_writeError(sock, "Could not get a refresh token");
     freeAccount(account);
   }
 }
 
-void agent_handleDeviceLookup(int sock, struct oidc_account** loaded_p, size_t* loaded_p_count, char* account_json, char* device_json) {
+void agent_handleDeviceLookup(int sock, struct account_table* loaded, char* account_json, char* device_json) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle deviceLookup request");
   struct oidc_account* account = getAccountFromJSON(account_json);
   if(account==NULL) {
@@ -311,31 +1257,36 @@ void agent_handleDeviceLookup(int sock, struct oidc_account** loaded_p, size_t*
   }
   clearFreeDeviceCode(dc);
   if(isValid(account_getRefreshToken(*account))) {
-    char* json = accountToJSON(*account);
-    ipc_write(sock, RESPONSE_STATUS_CONFIG, STATUS_SUCCESS, json);
-    clearFreeString(json);
-    *loaded_p = removeAccount(*loaded_p, loaded_p_count, *account);
-    *loaded_p = addAccount(*loaded_p, loaded_p_count, *account);
-    clearFree(account, sizeof(*account));
+    writeConfigResponse(sock, *account);
+    pthread_mutex_lock(&loaded_mutex);
+    accounttable_add(loaded, account);
+    pthread_mutex_unlock(&loaded_mutex);
   } else {
-    ipc_write(sock, RESPONSE_ERROR, "Could not get a refresh token");   
+    ipc_writeError(sock, "Could not get a refresh token");
     freeAccount(account);
   }
 }
 
-void agent_handleStateLookUp(int sock, struct oidc_account* loaded_p, size_t loaded_p_count, char* state) {
+void agent_handleStateLookUp(int sock, struct account_table* loaded, char* state) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Handle codeLookUp request");
-  struct oidc_account key = { .usedState = state };
-  struct oidc_account* account = findAccountByState(loaded_p, loaded_p_count, key);
+  pthread_mutex_lock(&loaded_mutex);
+  struct oidc_account* account = accounttable_findByState(loaded, state);
   if(account==NULL) {
+    pthread_mutex_unlock(&loaded_mutex);
     char* info = oidc_sprintf("No loaded account info found for state=%s", state);
-    ipc_write(sock, RESPONSE_STATUS_INFO, STATUS_NOTFOUND, info);
+    struct json_writer w;
+    ipc_beginResponse(&w, STATUS_NOTFOUND);
+    jsonwriter_addString(&w, "info", info);
+    ipc_writeResponse(sock, &w);
     clearFreeString(info);
     return;
   }
-  account_setUsedState(account, NULL);
-  char* config = accountToJSON(*account);
-  ipc_write(sock, RESPONSE_STATUS_CONFIG, STATUS_SUCCESS, config);
-  clearFreeString(config);
+  accounttable_setUsedState(loaded, account, NULL);
+  struct json_writer w;
+  ipc_beginResponse(&w, STATUS_SUCCESS);
+  jsonwriter_key(&w, "config");
+  account_writeJSON(&w, *account);
+  pthread_mutex_unlock(&loaded_mutex);
+  ipc_writeResponse(sock, &w);
   termHttpServer(state);
 }
@@ -2,15 +2,24 @@
 #define AGENT_HANDLER_H
 
 #include "account.h"
+#include "account_table.h"
+#include "ipc.h"
 
-void agent_handleGen(int sock, struct oidc_account** loaded_p, size_t* loaded_p_count, char* account_json, const char* flow) ;
-void agent_handleAdd(int sock, struct oidc_account** loaded_p, size_t* loaded_p_count, char* account_json) ;
-void agent_handleRm(int sock, struct oidc_account** loaded_p, size_t* loaded_p_count, char* account_json, int revoke) ;
-void agent_handleToken(int sock, struct oidc_account* loaded_p, size_t loaded_p_count, char* short_name, char* min_valid_period_str, const char* scope) ;
-void agent_handleList(int sock, struct oidc_account* loaded_p, size_t loaded_p_count) ;
-void agent_handleRegister(int sock, struct oidc_account* loaded_p, size_t loaded_p_count, char* account_json, const char* access_token) ;
-void agent_handleCodeExchange(int sock, struct oidc_account** loaded_p, size_t* loaded_p_count, char* account_json, char* code, char* redirect_uri, char* state) ;
-void agent_handleStateLookUp(int sock, struct oidc_account* loaded_p, size_t loaded_p_count, char* state) ;
-void agent_handleDeviceLookup(int sock, struct oidc_account** loaded_p, size_t* loaded_p_count, char* account_json, char* device_json) ;
+#include <time.h>
+
+void agent_setRefreshAhead(time_t seconds) ;
+void agent_setServeStale(time_t floor) ;
+void agent_handleGen(int sock, struct account_table* loaded, char* account_json, const char* flow) ;
+void agent_handleAdd(int sock, struct account_table* loaded, char* account_json) ;
+void agent_handleRm(int sock, struct account_table* loaded, char* account_json, int revoke) ;
+int agent_handleCachedToken(int sock, struct account_table* loaded, char* short_name, char* min_valid_period_str, const char* scope) ;
+int agent_joinTokenRefresh(struct connection* con, const char* request_id, char* short_name, char* min_valid_period_str, const char* scope) ;
+int agent_handleTokenBatch(struct connection* con, const char* request_id, struct account_table* loaded, const char* tokens_json) ;
+void agent_handleToken(struct connection* con, const char* request_id, struct account_table* loaded, char* short_name, char* min_valid_period_str, const char* scope) ;
+void agent_handleList(int sock, struct account_table* loaded) ;
+void agent_handleRegister(int sock, struct account_table* loaded, char* account_json, const char* access_token) ;
+void agent_handleCodeExchange(int sock, struct account_table* loaded, char* account_json, char* code, char* redirect_uri, char* state) ;
+void agent_handleStateLookUp(int sock, struct account_table* loaded, char* state) ;
+void agent_handleDeviceLookup(int sock, struct account_table* loaded, char* account_json, char* device_json) ;
 
 #endif //AGNET_HANDLER_H
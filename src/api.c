@@ -1,43 +1,196 @@
 #include "api.h"
 #include "ipc.h"
 #include "json.h"
+#include "json_writer.h"
+#include "ipc_tlv.h"
 #include "settings.h"
 #include "oidc_error.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
 
-char* getAccountRequest() {
-  char* fmt = "{\"request\":\"%s\"}";
-  return oidc_sprintf(fmt, REQUEST_VALUE_ACCOUNTLIST);
-}
+/* the connection used by the api functions. It is kept open and reused; the
+ * binary protocol is used, if the agent supports it. */
+static struct connection api_con;
+static int api_connected = 0;
+static int api_negotiate = 1; // 0 if the agent is too old to negotiate a protocol
 
-char* getAccessTokenRequest(const char* accountname, unsigned long min_valid_period, const char* scope) {
-  char* fmt = isValid(scope) ? 
-    "{\"request\":\"%s\", \"account\":\"%s\", \"min_valid_period\":%lu, \"scope\":\"%s\"}" :
-    "{\"request\":\"%s\", \"account\":\"%s\", \"min_valid_period\":%lu}";
-  return oidc_sprintf(fmt, REQUEST_VALUE_ACCESSTOKEN, accountname, min_valid_period, scope);
+/** @fn char* requestToJSON(const struct key_value* request, size_t size, size_t* len)
+ * @brief encodes a request as json object. Pairs without a value are skipped.
+ * @param len is set to the length of the json string
+ * @return a pointer to the json string. Has to be freed after usage.
+ */
+static char* requestToJSON(const struct key_value* request, size_t size, size_t* len) {
+  struct json_writer w;
+  jsonwriter_init(&w);
+  jsonwriter_beginObject(&w);
+  size_t i;
+  for(i=0; i<size; i++) {
+    if(request[i].value==NULL) {
+      continue;
+    }
+    if(tlv_isJSON(request[i].key)) {
+      jsonwriter_addRaw(&w, request[i].key, request[i].value);
+    } else {
+      jsonwriter_addString(&w, request[i].key, request[i].value);
+    }
+  }
+  jsonwriter_endObject(&w);
+  *len = w.len;
+  return jsonwriter_finish(&w);
 }
 
-char* communicate(char* fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
+/** @fn int isBusyResponse(const char* json)
+ * @return 1 if \p json is the answer of an agent that is busy
+ */
+static int isBusyResponse(const char* json) {
+  struct key_value pairs[1];
+  pairs[0].key = "status";
+  if(getJSONValues(json, pairs, sizeof(pairs)/sizeof(*pairs))<0) {
+    return 0;
+  }
+  int busy = pairs[0].value && strcmp(pairs[0].value, STATUS_BUSY)==0;
+  clearFreeString(pairs[0].value);
+  return busy;
+}
 
-  static struct connection con;
-  if(ipc_init(&con, OIDC_SOCK_ENV_NAME, 0)!=OIDC_SUCCESS) { 
-    return NULL; 
+/** @fn int apiConnect(char** busy, size_t* busy_len)
+ * @brief connects the api connection and negotiates the protocol
+ * @param busy set to the json answer if the agent rejected the connection.
+ * Has to be freed after usage.
+ * @param busy_len set to the length of \p busy
+ * @return 0 on success; -1 if the agent cannot be reached; -2 if the agent
+ * did not answer the protocol request; -3 if the agent is busy
+ */
+static int apiConnect(char** busy, size_t* busy_len) {
+  if(ipc_init(&api_con, OIDC_SOCK_ENV_NAME, 0)!=OIDC_SUCCESS) {
+    return -1;
   }
-  if(ipc_connect(con)<0) {
-    return NULL;
+  if(ipc_connect(api_con)<0) {
+    return -1;
   }
-  ipc_vwrite(*(con.sock), fmt, args);
-  char* response = ipc_read(*(con.sock));
-  ipc_close(&con);
-  if(NULL==response) {
-    printError("An unexpected error occured. It seems that oidc-agent has stopped.\n%s\n", oidc_serror());
-    exit(EXIT_FAILURE);
+  api_con.protocol = IPC_PROTOCOL_JSON;
+  if(!api_negotiate) {
+    return 0;
+  }
+  char* reply = NULL;
+  size_t reply_len = 0;
+  api_con.protocol = ipc_requestProtocol(*(api_con.sock), IPC_PROTOCOL_TLV, &reply, &reply_len);
+  if(api_con.protocol==IPC_PROTOCOL_UNSUPPORTED) {
+    // the agent answered with an error and might have closed the connection
+    ipc_close(&api_con);
+    if(isBusyResponse(reply)) {
+      *busy = reply;
+      *busy_len = reply_len;
+      return -3;
+    }
+    clearFree(reply, reply_len);
+    api_negotiate = 0;
+    return apiConnect(busy, busy_len);
+  }
+  if(api_con.protocol<0) {
+    ipc_close(&api_con);
+    return -2;
+  }
+  return 0;
+}
+
+/** @fn int agentRequest(const struct key_value* request, size_t request_size,
+ * struct key_value* response, size_t response_size)
+ * @brief sends a request to the agent and gets the values of the response,
+ * using the protocol negotiated for the api connection. If the agent closed
+ * the connection in the meantime, a new one is established once.
+ * @param request the keys and values of the request; pairs without a value
+ * are not sent
+ * @param response the keys to get from the response; the values have to be
+ * freed after usage
+ * @return the number of response values or -1 on failure
+ */
+static int agentRequest(const struct key_value* request, size_t request_size, struct key_value* response, size_t response_size) {
+  int try;
+  for(try=0; try<2; try++) {
+    if(!api_connected) {
+      char* busy = NULL;
+      size_t busy_len = 0;
+      int e = apiConnect(&busy, &busy_len);
+      if(e==-1) {
+        return -1;
+      }
+      if(e==-3) { // rejected before the request was sent
+        int parsed = getJSONValues(busy, response, response_size);
+        clearFree(busy, busy_len);
+        return parsed;
+      }
+      if(e<0) {
+        continue;
+      }
+      api_connected = 1;
+    }
+    int binary = api_con.protocol==IPC_PROTOCOL_TLV;
+    size_t len = 0;
+    char* msg = binary ? tlv_encode(request, request_size, &len) : requestToJSON(request, request_size, &len);
+    if(msg==NULL) {
+      return -1;
+    }
+    oidc_error_t e = ipc_writeMessage(*(api_con.sock), msg, len);
+    int write_errno = errno;
+    clearFree(msg, len);
+    // a rejected connection was answered with busy and closed already
+    char* res = e==OIDC_SUCCESS || write_errno==EPIPE ? ipc_readMessage(*(api_con.sock), &len) : NULL;
+    if(res!=NULL) {
+      int parsed = binary ? tlv_getValues(res, len, response, response_size) : getJSONValues(res, response, response_size);
+      clearFree(res, len);
+      if(parsed<0) {
+        printError("Read malformed data. Please hand in bug report.\n");
+      }
+      return parsed;
+    }
+    ipc_close(&api_con);
+    api_connected = 0;
+  }
+  printError("An unexpected error occured. It seems that oidc-agent has stopped.\n%s\n", oidc_serror());
+  exit(EXIT_FAILURE);
+}
+
+/** @fn char* communicate(char* fmt, ...)
+ * @brief sends a request to the agent and reads the response. The connection
+ * to the agent is kept open and reused by subsequent calls. If the agent
+ * closed it in the meantime, a new connection is established once.
+ * @param fmt the format string of the request
+ * @return the response. Has to be freed after usage.
+ */
+char* communicate(char* fmt, ...) {
+  static struct connection con;
+  static int connected = 0;
+  int try;
+  for(try=0; try<2; try++) {
+    if(!connected) {
+      if(ipc_init(&con, OIDC_SOCK_ENV_NAME, 0)!=OIDC_SUCCESS) { 
+        return NULL; 
+      }
+      if(ipc_connect(con)<0) {
+        return NULL;
+      }
+      connected = 1;
+    }
+    va_list args;
+    va_start(args, fmt);
+    oidc_error_t e = ipc_vwrite(*(con.sock), fmt, args);
+    int write_errno = errno;
+    va_end(args);
+    // a rejected connection was answered with busy and closed already
+    char* response = e==OIDC_SUCCESS || write_errno==EPIPE ? ipc_read(*(con.sock)) : NULL;
+    if(response!=NULL) {
+      return response;
+    }
+    ipc_close(&con);
+    connected = 0;
   }
-  return response;
+  printError("An unexpected error occured. It seems that oidc-agent has stopped.\n%s\n", oidc_serror());
+  exit(EXIT_FAILURE);
 }
 
 /** @fn char* getAccessToken(const char* accountname, unsigned long min_valid_period) 
@@ -53,22 +206,20 @@ char* communicate(char* fmt, ...) {
  * failure NULL is returned and oidc_errno is set.
  */
 char* getAccessToken(const char* accountname, unsigned long min_valid_period, const char* scope) {
-  char* request = getAccessTokenRequest(accountname, min_valid_period, scope);
-  char* response = communicate(request);
-  clearFreeString(request);
-  if(response==NULL) {
-    return NULL;
-  }
+  char min_valid_period_str[21];
+  snprintf(min_valid_period_str, sizeof(min_valid_period_str), "%lu", min_valid_period);
+  struct key_value request[4];
+  request[0].key = "request"; request[0].value = REQUEST_VALUE_ACCESSTOKEN;
+  request[1].key = "account"; request[1].value = (char*) accountname;
+  request[2].key = "min_valid_period"; request[2].value = min_valid_period_str;
+  request[3].key = "scope"; request[3].value = isValid(scope) ? (char*) scope : NULL;
   struct key_value pairs[3];
   pairs[0].key = "status";
   pairs[1].key = "error";
   pairs[2].key = "access_token";
-  if(getJSONValues(response, pairs, sizeof(pairs)/sizeof(*pairs))<0) {
-    printError("Read malformed data. Please hand in bug report.\n");
-    clearFreeString(response);
+  if(agentRequest(request, sizeof(request)/sizeof(*request), pairs, sizeof(pairs)/sizeof(*pairs))<0) {
     return NULL;
   }
-  clearFreeString(response);
   if(pairs[1].value) { // error
     oidc_errno = OIDC_EERROR;
     oidc_seterror(pairs[1].value);
@@ -83,6 +234,95 @@ char* getAccessToken(const char* accountname, unsigned long min_valid_period, co
   }
 }
 
+/** @fn char* tokenRequestsToJSON(const struct token_request* requests, size_t count)
+ * @brief encodes the token requests of a batch as json array
+ * @return a pointer to the json string. Has to be freed after usage.
+ */
+static char* tokenRequestsToJSON(const struct token_request* requests, size_t count) {
+  struct json_writer w;
+  jsonwriter_init(&w);
+  jsonwriter_beginArray(&w);
+  size_t i;
+  for(i=0; i<count; i++) {
+    jsonwriter_beginObject(&w);
+    jsonwriter_addString(&w, "account", requests[i].accountname);
+    jsonwriter_addUnsigned(&w, "min_valid_period", requests[i].min_valid_period);
+    if(isValid(requests[i].scope)) {
+      jsonwriter_addString(&w, "scope", requests[i].scope);
+    }
+    jsonwriter_endObject(&w);
+  }
+  jsonwriter_endArray(&w);
+  return jsonwriter_finish(&w);
+}
+
+/** @fn int getAccessTokens(struct token_request* requests, size_t count)
+ * @brief gets access tokens for multiple account configs and scopes with a
+ * single request. The agent refreshes the tokens concurrently.
+ * @param requests an array of token requests. For each of them either the
+ * access_token or the error field is set. Both have to be freed after usage.
+ * @param count the number of requests
+ * @return the number of access tokens obtained. If the whole request failed
+ * -1 is returned and oidc_errno is set.
+ */
+int getAccessTokens(struct token_request* requests, size_t count) {
+  if(requests==NULL || count==0) {
+    oidc_setArgNullFuncError(__func__);
+    return -1;
+  }
+  char* tokens_json = tokenRequestsToJSON(requests, count);
+  if(tokens_json==NULL) {
+    return -1;
+  }
+  struct key_value request[2];
+  request[0].key = "request"; request[0].value = REQUEST_VALUE_ACCESSTOKENBATCH;
+  request[1].key = IPC_KEY_TOKENS; request[1].value = tokens_json;
+  struct key_value pairs[3];
+  pairs[0].key = "status";
+  pairs[1].key = "error";
+  pairs[2].key = "tokens";
+  int parsed = agentRequest(request, sizeof(request)/sizeof(*request), pairs, sizeof(pairs)/sizeof(*pairs));
+  clearFreeString(tokens_json);
+  if(parsed<0) {
+    return -1;
+  }
+  list_t* tokens = NULL;
+  if(strequal(pairs[0].value, STATUS_SUCCESS) && pairs[2].value) {
+    tokens = JSONArrayToList(pairs[2].value);
+  }
+  if(tokens==NULL || tokens->len!=count) {
+    oidc_errno = OIDC_EERROR;
+    oidc_seterror(strequal(pairs[0].value, STATUS_SUCCESS) || pairs[1].value==NULL ? "Read malformed data." : pairs[1].value);
+    clearFreeKeyValuePairs(pairs, sizeof(pairs)/sizeof(*pairs));
+    if(tokens) {
+      list_destroy(tokens);
+    }
+    return -1;
+  }
+  clearFreeKeyValuePairs(pairs, sizeof(pairs)/sizeof(*pairs));
+  int obtained = 0;
+  size_t i;
+  for(i=0; i<count; i++) {
+    struct key_value item[2];
+    item[0].key = "access_token";
+    item[1].key = "error";
+    requests[i].access_token = NULL;
+    requests[i].error = NULL;
+    if(getJSONValues(list_at(tokens, i)->val, item, sizeof(item)/sizeof(*item))<0) {
+      requests[i].error = oidc_strcopy(oidc_serror());
+      continue;
+    }
+    requests[i].access_token = item[0].value;
+    requests[i].error = item[1].value;
+    if(item[0].value) {
+      obtained++;
+    }
+  }
+  list_destroy(tokens);
+  oidc_errno = OIDC_SUCCESS;
+  return obtained;
+}
+
 /** @fn char* getLoadedAccount()
  * @brief gets a a list of currently loaded accounts
  * @return a pointer to the JSON Array String containing all the short names 
@@ -90,22 +330,15 @@ char* getAccessToken(const char* accountname, unsigned long min_valid_period, co
  * On failure NULL is returned and oidc_errno is set.
  */
 char* getLoadedAccounts() {
-  char* request = getAccountRequest();
-  char* response = communicate(request);
-  clearFreeString(request);
-  if(response==NULL) {
-    return NULL;
-  }
+  struct key_value request[1];
+  request[0].key = "request"; request[0].value = REQUEST_VALUE_ACCOUNTLIST;
   struct key_value pairs[3];
   pairs[0].key = "status";
   pairs[1].key = "error";
   pairs[2].key = "account_list";
-  if(getJSONValues(response, pairs, sizeof(pairs)/sizeof(*pairs))<0) {
-    printError("Read malformed data. Please hand in bug report.\n");
-    clearFreeString(response);
+  if(agentRequest(request, sizeof(request)/sizeof(*request), pairs, sizeof(pairs)/sizeof(*pairs))<0) {
     return NULL;
   }
-  clearFreeString(response);
   if(pairs[1].value) { // error
     oidc_errno = OIDC_EERROR;
     oidc_seterror(pairs[1].value);
@@ -1,7 +1,18 @@
 #ifndef OIDC_API_H
 #define OIDC_API_H
 
+#include <stddef.h>
+
+struct token_request {
+  const char* accountname;
+  unsigned long min_valid_period;
+  const char* scope; // NULL for the account's default scope
+  char* access_token; // set by getAccessTokens; has to be freed
+  char* error; // set by getAccessTokens if no token could be obtained; has to be freed
+};
+
 char* getAccessToken(const char* accountname, unsigned long min_valid_period, const char* scope) ;
+int getAccessTokens(struct token_request* requests, size_t count) ;
 char* getLoadedAccounts() ;
 char* communicate(char* fmt, ...) ;
 char* oidcagent_serror();
@@ -18,7 +18,8 @@ struct oidc_device_code* getDeviceCodeFromJSON(char* json) {
   pairs[3].key = "verification_uri_complete";
   pairs[4].key = "expires_in";
   pairs[5].key = "interval";
-  if(getJSONValues(json, pairs, sizeof(pairs)/sizeof(pairs[0]))<0) {
+  static struct json_keyset keyset = JSON_KEYSET_INIT;
+  if(getJSONValuesByKeySet(json, pairs, sizeof(pairs)/sizeof(pairs[0]), &keyset)<0) {
     syslog(LOG_AUTHPRIV|LOG_ALERT, "Error while parsing json\n");
     return NULL;
   }
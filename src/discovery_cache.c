@@ -0,0 +1,341 @@
+#include "discovery_cache.h"
+#include "http.h"
+#include "json.h"
+#include "json_writer.h"
+#include "file_io.h"
+#include "settings.h"
+#include "oidc_utilities.h"
+
+#include "../lib/list/src/list.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+
+/* the discovery documents of the OpenID Providers, keyed by their
+ * configuration endpoint. The parsed metadata is kept in memory as one
+ * immutable, reference counted record that is shared by all accounts of the
+ * provider; a changed document replaces the record. The documents are
+ * persisted together with their validators, so that an expired entry is
+ * revalidated with a conditional request. Entries are never removed, there is
+ * one per provider. */
+struct discovery {
+  char* configuration_endpoint;
+  char* document; // as received
+  struct oidc_issuer* metadata; // the parsed document; NULL until fetched. The entry holds one reference
+  struct http_cache http;
+  time_t expires_at;
+  int fetching; // the document is being fetched; other threads wait for it
+};
+
+static list_t* discoveries = NULL;
+static pthread_mutex_t discovery_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t discovery_fetched = PTHREAD_COND_INITIALIZER;
+
+static void clearFreeDiscovery(struct discovery* d) {
+  clearFreeString(d->configuration_endpoint);
+  clearFreeString(d->document);
+  issuer_unref(d->metadata);
+  clearFreeString(d->http.etag);
+  clearFreeString(d->http.last_modified);
+  clearFree(d, sizeof(struct discovery));
+}
+
+static int matchDiscovery(char* configuration_endpoint, struct discovery* d) {
+  return strcmp(d->configuration_endpoint, configuration_endpoint)==0;
+}
+
+/** @fn struct oidc_issuer* parseDiscoveryDocument(const char* document)
+ * @brief extracts the metadata used by the agent from a discovery document
+ * @return a pointer to a new shared record holding one reference. Has to be
+ * released using \f issuer_unref. On failure NULL is returned and oidc_errno
+ * is set.
+ */
+static struct oidc_issuer* parseDiscoveryDocument(const char* document) {
+  struct key_value pairs[8];
+  pairs[0].key = "token_endpoint"; pairs[0].value = NULL;
+  pairs[1].key = "authorization_endpoint"; pairs[1].value = NULL;
+  pairs[2].key = "registration_endpoint"; pairs[2].value = NULL;
+  pairs[3].key = "revocation_endpoint"; pairs[3].value = NULL;
+  pairs[4].key = "device_authorization_endpoint"; pairs[4].value = NULL;
+  pairs[5].key = "scopes_supported"; pairs[5].value = NULL;
+  pairs[6].key = "grant_types_supported"; pairs[6].value = NULL;
+  pairs[7].key = "response_types_supported"; pairs[7].value = NULL;
+  static struct json_keyset keyset = JSON_KEYSET_INIT;
+  if(getJSONValuesByKeySet(document, pairs, sizeof(pairs)/sizeof(*pairs), &keyset)<0) {
+    return NULL;
+  }
+  if(pairs[0].value==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "Could not get token_endpoint");
+    clearFreeKeyValuePairs(pairs, sizeof(pairs)/sizeof(*pairs));
+    oidc_seterror("Could not get token_endpoint from the configuration_endpoint. This could be because of a network issue. But it's more likely that your issuer is not correct.");
+    oidc_errno = OIDC_EERROR;
+    return NULL;
+  }
+  if(pairs[6].value==NULL) {
+    const char* defaultValue = "[\"authorization_code\", \"implicit\"]";
+    pairs[6].value = oidc_sprintf("%s", defaultValue);
+  }
+  char* scopes_supported = JSONArrrayToDelimitedString(pairs[5].value, ' ');
+  clearFreeString(pairs[5].value);
+  pairs[5].value = NULL;
+  struct oidc_issuer* metadata = scopes_supported ? calloc(sizeof(struct oidc_issuer), 1) : NULL;
+  if(metadata==NULL) {
+    if(scopes_supported) {
+      syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+      oidc_errno = OIDC_EALLOC;
+    }
+    clearFreeString(scopes_supported);
+    clearFreeKeyValuePairs(pairs, sizeof(pairs)/sizeof(*pairs));
+    return NULL;
+  }
+  issuer_setTokenEndpoint(metadata, pairs[0].value);
+  issuer_setAuthorizationEndpoint(metadata, pairs[1].value);
+  issuer_setRegistrationEndpoint(metadata, pairs[2].value);
+  issuer_setRevocationEndpoint(metadata, pairs[3].value);
+  issuer_setDeviceAuthorizationEndpoint(metadata, pairs[4].value);
+  issuer_setScopesSupported(metadata, scopes_supported);
+  issuer_setGrantTypesSupported(metadata, pairs[6].value);
+  issuer_setResponseTypesSupported(metadata, pairs[7].value);
+  metadata->refcount = 1;
+  return metadata;
+}
+
+/** @fn time_t discoveryExpiresAt(const struct http_cache* http)
+ * @brief computes when a fetched or revalidated document expires, honouring
+ * the max-age of the response
+ */
+static time_t discoveryExpiresAt(const struct http_cache* http) {
+  long ttl = http->max_age >= 0 ? http->max_age : DISCOVERY_DEFAULT_TTL;
+  if(ttl > DISCOVERY_MAX_TTL) {
+    ttl = DISCOVERY_MAX_TTL;
+  }
+  return time(NULL) + ttl;
+}
+
+static char* discoveryCachePath() {
+  char* oidc_dir = getOidcDir();
+  if(oidc_dir==NULL) {
+    return NULL;
+  }
+  char* path = oidc_strcat(oidc_dir, DISCOVERY_CACHE_FILENAME);
+  clearFreeString(oidc_dir);
+  return path;
+}
+
+/** @fn void loadDiscoveries()
+ * @brief reads the persisted discovery documents. Entries that cannot be
+ * parsed are dropped. Has to be called with the lock held.
+ */
+static void loadDiscoveries() {
+  char* path = discoveryCachePath();
+  char* content = path && fileDoesExist(path) ? readFile(path) : NULL;
+  clearFreeString(path);
+  list_t* entries = content ? JSONArrayToList(content) : NULL;
+  clearFreeString(content);
+  if(entries==NULL) {
+    return;
+  }
+  list_node_t* node;
+  list_iterator_t* it = list_iterator_new(entries, LIST_HEAD);
+  while((node = list_iterator_next(it))) {
+    struct key_value pairs[5];
+    pairs[0].key = "configuration_endpoint";
+    pairs[1].key = "etag";
+    pairs[2].key = "last_modified";
+    pairs[3].key = "expires_at";
+    pairs[4].key = "document";
+    static struct json_keyset keyset = JSON_KEYSET_INIT;
+    if(getJSONValuesByKeySet(node->val, pairs, sizeof(pairs)/sizeof(*pairs), &keyset)<0) {
+      continue;
+    }
+    struct oidc_issuer* metadata = pairs[0].value && pairs[3].value && pairs[4].value ? parseDiscoveryDocument(pairs[4].value) : NULL;
+    struct discovery* d = metadata ? calloc(sizeof(struct discovery), 1) : NULL;
+    if(d==NULL) {
+      issuer_unref(metadata);
+      clearFreeKeyValuePairs(pairs, sizeof(pairs)/sizeof(*pairs));
+      continue;
+    }
+    d->configuration_endpoint = pairs[0].value;
+    d->http.etag = pairs[1].value;
+    d->http.last_modified = pairs[2].value;
+    d->http.max_age = -1;
+    d->expires_at = atol(pairs[3].value);
+    clearFreeString(pairs[3].value);
+    d->document = pairs[4].value;
+    d->metadata = metadata;
+    list_rpush(discoveries, list_node_new(d));
+  }
+  list_iterator_destroy(it);
+  list_destroy(entries);
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Loaded %u cached discovery documents", discoveries->len);
+}
+
+/** @fn void saveDiscoveries()
+ * @brief persists the discovery documents, unless their provider forbids
+ * storing them. The file is replaced atomically. Has to be called with the
+ * lock held.
+ */
+static void saveDiscoveries() {
+  char* path = discoveryCachePath();
+  if(path==NULL) {
+    return;
+  }
+  struct json_writer w;
+  jsonwriter_init(&w);
+  jsonwriter_beginArray(&w);
+  list_node_t* node;
+  list_iterator_t* it = list_iterator_new(discoveries, LIST_HEAD);
+  while((node = list_iterator_next(it))) {
+    struct discovery* d = node->val;
+    if(d->document==NULL || d->http.no_store) {
+      continue;
+    }
+    jsonwriter_beginObject(&w);
+    jsonwriter_addString(&w, "configuration_endpoint", d->configuration_endpoint);
+    jsonwriter_addUnsigned(&w, "expires_at", (unsigned long) d->expires_at);
+    jsonwriter_addRaw(&w, "document", d->document);
+    if(d->http.etag) {
+      jsonwriter_addString(&w, "etag", d->http.etag);
+    }
+    if(d->http.last_modified) {
+      jsonwriter_addString(&w, "last_modified", d->http.last_modified);
+    }
+    jsonwriter_endObject(&w);
+  }
+  list_iterator_destroy(it);
+  jsonwriter_endArray(&w);
+  char* content = jsonwriter_finish(&w);
+  char* tmp_path = oidc_strcat(path, ".tmp");
+  if(content && tmp_path && writeFile(tmp_path, content)==OIDC_SUCCESS && rename(tmp_path, path)!=0) {
+    syslog(LOG_AUTHPRIV|LOG_NOTICE, "Could not save discovery cache: %m");
+  }
+  clearFreeString(content);
+  clearFreeString(tmp_path);
+  clearFreeString(path);
+}
+
+/** @fn struct discovery* getDiscovery(const char* configuration_endpoint)
+ * @brief finds the cache entry for a configuration endpoint, creating it if
+ * needed. The persisted entries are loaded on first use. Has to be called
+ * with the lock held.
+ * @return a pointer to the entry. On failure NULL is returned.
+ */
+static struct discovery* getDiscovery(const char* configuration_endpoint) {
+  if(discoveries==NULL) {
+    discoveries = list_new();
+    discoveries->free = (void(*) (void*)) &clearFreeDiscovery;
+    discoveries->match = (int(*) (void*, void*)) &matchDiscovery;
+    loadDiscoveries();
+  }
+  list_node_t* node = list_find(discoveries, (void*) configuration_endpoint);
+  if(node) {
+    return node->val;
+  }
+  struct discovery* d = calloc(sizeof(struct discovery), 1);
+  if(d==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
+  d->configuration_endpoint = oidc_strcopy(configuration_endpoint);
+  d->http.max_age = -1;
+  list_rpush(discoveries, list_node_new(d));
+  return d;
+}
+
+/** @fn struct oidc_issuer* discovery_current(const char* configuration_endpoint)
+ * @brief gets the metadata of an OpenID Provider as currently cached, without
+ * fetching or revalidating it. Can be called from any thread.
+ * @return a new reference to the shared record. Has to be released using
+ * \f issuer_unref. If the provider was not discovered yet, NULL is returned.
+ */
+struct oidc_issuer* discovery_current(const char* configuration_endpoint) {
+  if(configuration_endpoint==NULL) {
+    return NULL;
+  }
+  struct oidc_issuer* metadata = NULL;
+  pthread_mutex_lock(&discovery_mutex);
+  list_node_t* node = discoveries ? list_find(discoveries, (void*) configuration_endpoint) : NULL;
+  if(node) {
+    metadata = issuer_ref(((struct discovery*) node->val)->metadata);
+  }
+  pthread_mutex_unlock(&discovery_mutex);
+  return metadata;
+}
+
+/** @fn struct oidc_issuer* discovery_get(const char* configuration_endpoint,
+ * const char* cert_path)
+ * @brief gets the metadata of an OpenID Provider. It is served from the cache
+ * as long as it is fresh, otherwise it is revalidated or fetched. Concurrent
+ * callers for the same provider wait for a single request. If the provider
+ * cannot be reached, an expired document is used. Can be called from any
+ * thread.
+ * @return a new reference to the shared record. Has to be released using
+ * \f issuer_unref. On failure NULL is returned and oidc_errno is set.
+ */
+struct oidc_issuer* discovery_get(const char* configuration_endpoint, const char* cert_path) {
+  pthread_mutex_lock(&discovery_mutex);
+  struct discovery* d = getDiscovery(configuration_endpoint);
+  if(d==NULL) {
+    pthread_mutex_unlock(&discovery_mutex);
+    return NULL;
+  }
+  while(d->fetching) {
+    pthread_cond_wait(&discovery_fetched, &discovery_mutex);
+  }
+  if(d->metadata && d->expires_at > time(NULL)) {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Using cached discovery document of %s", configuration_endpoint);
+    struct oidc_issuer* metadata = issuer_ref(d->metadata);
+    pthread_mutex_unlock(&discovery_mutex);
+    return metadata;
+  }
+  d->fetching = 1;
+  struct http_cache http = {
+    .etag = d->metadata ? oidc_strcopyIfValid(d->http.etag) : NULL,
+    .last_modified = d->metadata ? oidc_strcopyIfValid(d->http.last_modified) : NULL,
+    .max_age = -1,
+    .no_store = 0
+  };
+  pthread_mutex_unlock(&discovery_mutex);
+
+  int not_modified = 0;
+  char* document = httpsGETConditional(configuration_endpoint, cert_path, &http, &not_modified);
+  struct oidc_issuer* metadata = document && !not_modified ? parseDiscoveryDocument(document) : NULL;
+
+  pthread_mutex_lock(&discovery_mutex);
+  d->fetching = 0;
+  pthread_cond_broadcast(&discovery_fetched);
+  if(metadata || (not_modified && d->metadata)) {
+    if(metadata) { // accounts still using the old record keep it alive
+      issuer_unref(d->metadata);
+      d->metadata = metadata;
+      clearFreeString(d->document);
+      d->document = document;
+      document = NULL;
+    }
+    clearFreeString(d->http.etag);
+    clearFreeString(d->http.last_modified);
+    d->http = http;
+    http.etag = NULL;
+    http.last_modified = NULL;
+    d->expires_at = discoveryExpiresAt(&d->http);
+    saveDiscoveries();
+  } else if(d->metadata) {
+    syslog(LOG_AUTHPRIV|LOG_NOTICE, "Could not revalidate discovery document of %s: %s. Using the cached one.", configuration_endpoint, oidc_serror());
+  } else {
+    pthread_mutex_unlock(&discovery_mutex);
+    clearFreeString(document);
+    clearFreeString(http.etag);
+    clearFreeString(http.last_modified);
+    return NULL;
+  }
+  metadata = issuer_ref(d->metadata);
+  pthread_mutex_unlock(&discovery_mutex);
+  clearFreeString(document);
+  clearFreeString(http.etag);
+  clearFreeString(http.last_modified);
+  return metadata;
+}
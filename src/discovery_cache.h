@@ -0,0 +1,9 @@
+#ifndef DISCOVERY_CACHE_H
+#define DISCOVERY_CACHE_H
+
+#include "issuer.h"
+
+struct oidc_issuer* discovery_get(const char* configuration_endpoint, const char* cert_path) ;
+struct oidc_issuer* discovery_current(const char* configuration_endpoint) ;
+
+#endif // DISCOVERY_CACHE_H
@@ -1,4 +1,5 @@
 #include "file_io.h"
+#include "settings.h"
 #include "oidc_utilities.h"
 #include "../lib/list/src/list.h"
 
@@ -256,6 +257,9 @@ int isAccountConfigFile(const char* filename, const char* a __attribute__((unuse
   if(strEnds(filename, ".config")) {
     return 0;
   }
+  if(strcmp(filename, DISCOVERY_CACHE_FILENAME)==0 || strcmp(filename, DISCOVERY_CACHE_FILENAME ".tmp")==0) {
+    return 0;
+  }
   return 1;
 }
 
@@ -9,10 +9,47 @@
 #include <string.h>
 #include <syslog.h>
 
+/** @fn char* getCachedAccessToken(struct oidc_account* account, time_t
+ * min_valid_period, const char* scope, unsigned long* expires_at)
+ * @brief gets an access token of an account without contacting the OpenID
+ * Provider
+ * @param scope if valid, the account's cache of tokens for other scopes is
+ * used
+ * @param expires_at if not NULL, it is set to the expiration time of the
+ * returned token
+ * @return a copy of the cached access token if it is valid for more than
+ * \p min_valid_period seconds; NULL otherwise. Has to be freed after usage.
+ */
+char* getCachedAccessToken(struct oidc_account* account, time_t min_valid_period, const char* scope, unsigned long* expires_at) {
+  if(min_valid_period==FORCE_NEW_TOKEN) {
+    return NULL;
+  }
+  char* access_token = NULL;
+  unsigned long token_expires_at = 0;
+  if(isValid(scope)) {
+    struct scoped_token* cached = tokencache_lookup(account_getScopedTokens(*account), scope, min_valid_period);
+    if(cached) {
+      access_token = oidc_strcopy(cached->access_token);
+      token_expires_at = cached->expires_at;
+    }
+  } else if(isValid(account_getAccessToken(*account)) && tokenIsValidForSeconds(*account, min_valid_period)) {
+    access_token = oidc_strcopy(account_getAccessToken(*account));
+    token_expires_at = account_getTokenExpiresAt(*account);
+  }
+  if(access_token && expires_at) {
+    *expires_at = token_expires_at;
+  }
+  return access_token;
+}
+
 char* getAccessTokenUsingRefreshFlow(struct oidc_account* account, time_t min_valid_period, const char* scope) {
   if(scope==NULL && min_valid_period!=FORCE_NEW_TOKEN && isValid(account_getAccessToken(*account)) && tokenIsValidForSeconds(*account, min_valid_period)) {
     return account_getAccessToken(*account);
   }
+  struct scoped_token* cached = min_valid_period!=FORCE_NEW_TOKEN ? tokencache_lookup(account_getScopedTokens(*account), scope, min_valid_period) : NULL;
+  if(cached) { // has to be copied, the caller owns tokens for other scopes
+    return oidc_strcopy(cached->access_token);
+  }
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "No acces token found that is valid long enough");
   return tryRefreshFlow(account, scope);
 }
@@ -65,9 +102,10 @@ list_t* parseFlow(const char* flow) {
   }
   char* tmp = JSONArrrayToDelimitedString(flow, ' ');
   int len = strlen(tmp);
-  char* str = oidc_sprintf("%s", strtok(tmp, " "));
+  char* saveptr = NULL;
+  char* str = oidc_sprintf("%s", strtok_r(tmp, " ", &saveptr));
   list_rpush(flows, list_node_new(str));
-  while((str=strtok(NULL, " "))) {
+  while((str=strtok_r(NULL, " ", &saveptr))) {
     list_rpush(flows, list_node_new(oidc_sprintf("%s", str)));
   }
   clearFree(tmp, len);
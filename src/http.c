@@ -1,11 +1,24 @@
+#define _XOPEN_SOURCE 700
+
 #include "http.h"
+#include "ipc.h"
+#include "settings.h"
 #include "oidc_error.h"
 #include "oidc_utilities.h"
 
+#include "../lib/list/src/list.h"
+
 #include <curl/curl.h>
 
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <syslog.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 
 struct string {
   char* ptr;
@@ -58,7 +71,6 @@ oidc_error_t CURLErrorHandling(int res, CURL* curl) {
     case CURLE_URL_MALFORMAT:
     case CURLE_COULDNT_RESOLVE_HOST:
       syslog(LOG_AUTHPRIV|LOG_ALERT, "%s (%s:%d) HTTPS Request failed: %s Please check the provided URLs.\n", __func__, __FILE__, __LINE__,  curl_easy_strerror(res));
-      curl_easy_cleanup(curl);  
       oidc_errno = OIDC_EURL;
       return OIDC_EURL;
     case CURLE_SSL_CONNECT_ERROR:
@@ -69,34 +81,106 @@ oidc_error_t CURLErrorHandling(int res, CURL* curl) {
     case CURLE_SSL_CRL_BADFILE:
     case CURLE_SSL_ISSUER_ERROR:
       syslog(LOG_AUTHPRIV|LOG_ALERT, "%s (%s:%d) HTTPS Request failed: %s Please check the provided certh_path.\n", __func__, __FILE__, __LINE__,  curl_easy_strerror(res));
-      curl_easy_cleanup(curl);  
       oidc_errno = OIDC_ESSL;
       return OIDC_ESSL;
     default:
       syslog(LOG_AUTHPRIV|LOG_ALERT, "%s (%s:%d) curl_easy_perform() failed: %s\n", __func__, __FILE__, __LINE__,  curl_easy_strerror(res));
-      curl_easy_cleanup(curl);  
+      oidc_seterror((char*) curl_easy_strerror(res));
       oidc_errno = OIDC_EERROR;
       return OIDC_EERROR;
   }
 }
 
+static pthread_once_t curl_global_once = PTHREAD_ONCE_INIT;
+static CURLcode curl_global_res = CURLE_OK;
+
+/* TLS sessions and DNS entries are shared by all easy handles, so a new
+ * connection to a known host skips the lookup and the full handshake.
+ * Connections are not shared: the share is used from multiple threads, and
+ * curl does not support using a shared connection cache concurrently. The
+ * multi handle keeps its own connection cache for asynchronous requests.
+ * curl locks the shared parts through these mutexes. */
+static CURLSH* share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+/* easy handles that are not in use. They keep their connections and the
+ * shared caches, so they are reused instead of being created per request. */
+static CURL* idle_handles[HTTP_MAX_IDLE_HANDLES];
+static size_t idle_count = 0;
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void shareLock(CURL* curl __attribute__((unused)), curl_lock_data data, curl_lock_access access __attribute__((unused)), void* userptr __attribute__((unused))) {
+  pthread_mutex_lock(&share_locks[data]);
+}
+
+static void shareUnlock(CURL* curl __attribute__((unused)), curl_lock_data data, void* userptr __attribute__((unused))) {
+  pthread_mutex_unlock(&share_locks[data]);
+}
+
+/** @fn void globalInit()
+ * @brief initializes curl's global state and the share used by all handles;
+ * curl_global_init is not thread safe and must only run once per process, so
+ * it is guarded by pthread_once. If the share cannot be created, requests
+ * work without it.
+ */
+static void globalInit() {
+  curl_global_res = curl_global_init(CURL_GLOBAL_ALL);
+  if(curl_global_res!=CURLE_OK) {
+    return;
+  }
+  share = curl_share_init();
+  if(share==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s (%s:%d) Couldn't init curl share", __func__, __FILE__, __LINE__);
+    return;
+  }
+  int i;
+  for(i=0; i<CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init(&share_locks[i], NULL);
+  }
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, shareLock);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, shareUnlock);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
 /** @fn CURL* init()
- * @brief initializes curl
- * @return a CURL pointer
+ * @brief gets a curl handle for a request; an idle one is reused if possible
+ * @return a CURL pointer. Has to be given back using \f cleanup.
  */
 CURL* init() {
-  CURLcode res = curl_global_init(CURL_GLOBAL_ALL);
+  pthread_once(&curl_global_once, globalInit);
+  CURLcode res = curl_global_res;
   if(CURLErrorHandling(res, NULL)!=OIDC_SUCCESS) {
     return NULL;
   }
 
-  CURL* curl =  curl_easy_init();
+  CURL* curl = NULL;
+  pthread_mutex_lock(&idle_mutex);
+  if(idle_count>0) {
+    curl = idle_handles[--idle_count];
+  }
+  pthread_mutex_unlock(&idle_mutex);
+  if(curl==NULL) {
+    curl = curl_easy_init();
+  }
   if(!curl) {
-    curl_global_cleanup();
     syslog(LOG_AUTHPRIV|LOG_ALERT, "%s (%s:%d) Couldn't init curl. %s\n", __func__, __FILE__, __LINE__,  curl_easy_strerror(res));
     oidc_errno = OIDC_ECURLI;
     return NULL;
   }
+  if(share) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  }
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // handles are used by multiple threads
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  // a provider that does not answer must not keep a request (and everyone
+  // waiting for its token) open forever
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long) HTTP_CONNECT_TIMEOUT);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long) HTTP_TIMEOUT);
+  // concurrent requests to the same provider share one connection if it
+  // speaks HTTP/2; new requests wait for a connection in progress to find out
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
   return curl;
 }
 
@@ -183,12 +267,23 @@ oidc_error_t perform(CURL* curl) {
 }
 
 /** @fn void cleanup(CURL* curl)
- * @brief does a easy and global cleanup
+ * @brief gives back a handle obtained by \f init. Its options are reset, so
+ * it does not keep pointers to request data, and it is kept for reuse if
+ * there are not already enough idle handles. The global curl state lives as
+ * long as the process, because other threads might still use it.
  * @param curl the curl instance
  */
 void cleanup(CURL* curl) {
-  curl_easy_cleanup(curl);  
-  curl_global_cleanup();
+  curl_easy_reset(curl);
+  pthread_mutex_lock(&idle_mutex);
+  if(idle_count<HTTP_MAX_IDLE_HANDLES) {
+    idle_handles[idle_count++] = curl;
+    curl = NULL;
+  }
+  pthread_mutex_unlock(&idle_mutex);
+  if(curl) {
+    curl_easy_cleanup(curl);
+  }
 }
 
 /** @fn char* httpsGET(const char* url, const char* cert_path)
@@ -201,9 +296,13 @@ void cleanup(CURL* curl) {
 char* httpsGET(const char* url, struct curl_slist* headers, const char* cert_path) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Https GET to: %s",url);
   CURL* curl = init();
+  if(curl==NULL) {
+    return NULL;
+  }
   setUrl(curl, url);
   struct string s;
   if(setWriteFunction(curl, &s)!=OIDC_SUCCESS) {
+    cleanup(curl);
     return NULL;
   }
   setSSLOpts(curl, cert_path);
@@ -214,6 +313,7 @@ char* httpsGET(const char* url, struct curl_slist* headers, const char* cert_pat
       pass; 
     } else {
       clearFreeString(s.ptr);
+      cleanup(curl);
       return NULL;
     }
   }
@@ -223,6 +323,123 @@ char* httpsGET(const char* url, struct curl_slist* headers, const char* cert_pat
 }
 
 
+/** @fn char* headerValue(const char* line, size_t len, const char* name)
+ * @brief gets the value of a response header line, if it is the header
+ * \p name
+ * @return a pointer to the trimmed value. Has to be freed after usage. NULL if
+ * \p line is not the header \p name.
+ */
+static char* headerValue(const char* line, size_t len, const char* name) {
+  size_t name_len = strlen(name);
+  if(len<=name_len || strncasecmp(line, name, name_len)!=0 || line[name_len]!=':') {
+    return NULL;
+  }
+  const char* value = line + name_len + 1;
+  const char* end = line + len;
+  while(value<end && isspace(*value)) {
+    value++;
+  }
+  while(end>value && isspace(*(end-1))) {
+    end--;
+  }
+  return oidc_sprintf("%.*s", (int)(end-value), value);
+}
+
+static size_t header_callback(char* buffer, size_t size, size_t nitems, void* userdata) {
+  struct http_cache* cache = userdata;
+  size_t len = size*nitems;
+  char* value;
+  if((value = headerValue(buffer, len, "ETag"))) {
+    clearFreeString(cache->etag);
+    cache->etag = value;
+  } else if((value = headerValue(buffer, len, "Last-Modified"))) {
+    clearFreeString(cache->last_modified);
+    cache->last_modified = value;
+  } else if((value = headerValue(buffer, len, "Cache-Control"))) {
+    char* c;
+    for(c=value; *c; c++) {
+      *c = tolower(*c);
+    }
+    char* max_age = strstr(value, "max-age=");
+    if(max_age) {
+      cache->max_age = atol(max_age + strlen("max-age="));
+    }
+    if(strstr(value, "no-cache")) {
+      cache->max_age = 0;
+    }
+    if(strstr(value, "no-store")) {
+      cache->max_age = 0;
+      cache->no_store = 1;
+    }
+    clearFreeString(value);
+  }
+  return len;
+}
+
+/** @fn char* httpsGETConditional(const char* url, const char* cert_path,
+ * struct http_cache* cache, int* not_modified)
+ * @brief does a https GET request for a resource that is cached by the
+ * caller. The validators of the cached version are sent, so the server can
+ * answer with 304 Not Modified.
+ * @param cache the validators of the cached version; might be empty. They are
+ * updated from the response headers, as are the caching directives.
+ * @param not_modified set to 1 if the cached version is still valid; then the
+ * response is empty
+ * @return a pointer to the response. Has to be freed after usage. If the Https
+ * call failed, NULL is returned.
+ */
+char* httpsGETConditional(const char* url, const char* cert_path, struct http_cache* cache, int* not_modified) {
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Https GET to: %s",url);
+  *not_modified = 0;
+  CURL* curl = init();
+  if(curl==NULL) {
+    return NULL;
+  }
+  setUrl(curl, url);
+  struct string s;
+  if(setWriteFunction(curl, &s)!=OIDC_SUCCESS) {
+    cleanup(curl);
+    return NULL;
+  }
+  setSSLOpts(curl, cert_path);
+  struct curl_slist* headers = NULL;
+  if(cache->etag) {
+    char* header = oidc_sprintf("If-None-Match: %s", cache->etag);
+    headers = curl_slist_append(headers, header);
+    clearFreeString(header);
+  }
+  if(cache->last_modified) {
+    char* header = oidc_sprintf("If-Modified-Since: %s", cache->last_modified);
+    headers = curl_slist_append(headers, header);
+    clearFreeString(header);
+  }
+  setHeaders(curl, headers);
+  cache->max_age = -1;
+  cache->no_store = 0;
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, cache);
+  oidc_error_t err = perform(curl);
+  long http_code = 0;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+  cleanup(curl);
+  curl_slist_free_all(headers);
+  if(err!=OIDC_SUCCESS) {
+    if(err>=200 && err < 600 && isValid(s.ptr)) {
+      pass; 
+    } else {
+      clearFreeString(s.ptr);
+      return NULL;
+    }
+  }
+  if(http_code==304) {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Not modified");
+    *not_modified = 1;
+  } else {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Response: %s\n",s.ptr);
+  }
+  return s.ptr;
+}
+
 /** @fn char* httpsPOST(const char* url, const char* data, const char* cert_path)
  * @brief does a https POST request
  * @param url the request url
@@ -234,10 +451,14 @@ char* httpsGET(const char* url, struct curl_slist* headers, const char* cert_pat
 char* httpsPOST(const char* url, const char* data, struct curl_slist* headers, const char* cert_path, const char* username, const char* password) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Https POST to: %s",url);
   CURL* curl = init();
+  if(curl==NULL) {
+    return NULL;
+  }
   setUrl(curl, url);
   curl_easy_setopt(curl, CURLOPT_POST, 1L);
   struct string s;
   if(setWriteFunction(curl, &s)!=OIDC_SUCCESS) {
+    cleanup(curl);
     return NULL;
   }
   setPostData(curl, data);
@@ -261,3 +482,330 @@ char* httpsPOST(const char* url, const char* data, struct curl_slist* headers, c
   return s.ptr;
 }
 
+
+/* the multi handle doing asynchronous requests. It is driven by the event
+ * loop: curl tells through callbacks which sockets to watch and when it has
+ * to be called on a timeout, so requests to the OpenID Providers do not block
+ * a thread while waiting for the network. Only used by the thread running the
+ * event loop. */
+static CURLM* multi = NULL;
+static int multi_timer_fd = -1;
+
+/* asynchronous requests to one host. They are multiplexed over one HTTP/2
+ * connection; at most max_streams of them run concurrently, further ones wait
+ * in a queue, so a burst of refreshes does not exceed what the provider
+ * allows per connection. */
+struct host_streams {
+  char* host; // scheme, host and port
+  size_t running;
+  list_t* waiting; // struct async_request*
+};
+static list_t* hosts = NULL; // struct host_streams*
+static size_t max_streams = 0;
+
+struct async_request {
+  CURL* curl;
+  struct string response;
+  char* data; // the posted data; curl does not copy it
+  http_callback callback;
+  void* arg;
+  struct host_streams* host;
+};
+
+static void clearFreeAsyncRequest(struct async_request* request) {
+  if(request->curl) {
+    cleanup(request->curl);
+  }
+  clearFreeString(request->response.ptr);
+  clearFreeString(request->data);
+  clearFree(request, sizeof(struct async_request));
+}
+
+static int matchHostStreams(char* host, struct host_streams* streams) {
+  return strcmp(streams->host, host)==0;
+}
+
+/** @fn char* urlHost(const char* url)
+ * @brief extracts the part of an url identifying the server, i.e. scheme,
+ * host and port
+ * @return a pointer to the extracted string. Has to be freed after usage.
+ */
+static char* urlHost(const char* url) {
+  const char* start = strstr(url, "://");
+  start = start ? start + 3 : url;
+  size_t len = strcspn(start, "/?#");
+  char* host = oidc_sprintf("%.*s", (int)(start - url + len), url);
+  return host;
+}
+
+/** @fn struct host_streams* getHostStreams(const char* url)
+ * @brief finds the stream accounting for the host of \p url, creating it if
+ * needed
+ */
+static struct host_streams* getHostStreams(const char* url) {
+  char* host = urlHost(url);
+  if(host==NULL) {
+    return NULL;
+  }
+  if(hosts==NULL) {
+    hosts = list_new();
+    hosts->match = (int(*) (void*, void*)) &matchHostStreams;
+  }
+  list_node_t* node = list_find(hosts, host);
+  if(node) {
+    clearFreeString(host);
+    return node->val;
+  }
+  struct host_streams* streams = calloc(sizeof(struct host_streams), 1);
+  if(streams==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    clearFreeString(host);
+    return NULL;
+  }
+  streams->host = host;
+  streams->waiting = list_new();
+  list_rpush(hosts, list_node_new(streams));
+  return streams;
+}
+
+/** @fn oidc_error_t startAsyncRequest(struct async_request* request)
+ * @brief hands a request to the multi handle
+ * @return 0 on success; otherwise an error code
+ */
+static oidc_error_t startAsyncRequest(struct async_request* request) {
+  CURLMcode res = curl_multi_add_handle(multi, request->curl);
+  if(res!=CURLM_OK) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s (%s:%d) curl_multi_add_handle() failed: %s\n", __func__, __FILE__, __LINE__, curl_multi_strerror(res));
+    oidc_seterror((char*) curl_multi_strerror(res));
+    oidc_errno = OIDC_EERROR;
+    return oidc_errno;
+  }
+  request->host->running++;
+  return OIDC_SUCCESS;
+}
+
+/** @fn void startWaitingRequests(struct host_streams* streams)
+ * @brief starts queued requests to a host while it has free streams. Requests
+ * that cannot be started are failed.
+ */
+static void startWaitingRequests(struct host_streams* streams) {
+  while(streams->running < max_streams && streams->waiting->len > 0) {
+    list_node_t* node = list_lpop(streams->waiting);
+    struct async_request* request = node->val;
+    LIST_FREE(node);
+    if(startAsyncRequest(request)!=OIDC_SUCCESS) {
+      http_callback callback = request->callback;
+      void* arg = request->arg;
+      clearFreeAsyncRequest(request);
+      callback(NULL, arg);
+    }
+  }
+}
+
+/** @fn void finishAsyncRequest(struct async_request* request, CURLcode res)
+ * @brief checks the result of a finished asynchronous request, gives back its
+ * handle and calls its callback
+ */
+static void finishAsyncRequest(struct async_request* request, CURLcode res) {
+  oidc_error_t err = CURLErrorHandling(res, request->curl);
+  char* response = request->response.ptr;
+  if(err!=OIDC_SUCCESS && !(err>=200 && err < 600 && isValid(response))) {
+    clearFreeString(response);
+    response = NULL;
+  } else {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Response: %s\n", response);
+  }
+  request->response.ptr = NULL; // passed to the callback
+  struct host_streams* streams = request->host;
+  http_callback callback = request->callback;
+  void* arg = request->arg;
+  clearFreeAsyncRequest(request);
+  streams->running--;
+  callback(response, arg);
+  startWaitingRequests(streams);
+}
+
+/** @fn void checkMultiInfo()
+ * @brief finishes all asynchronous requests curl reports as done
+ */
+static void checkMultiInfo() {
+  CURLMsg* msg;
+  int left;
+  while((msg = curl_multi_info_read(multi, &left))) {
+    if(msg->msg!=CURLMSG_DONE) {
+      continue;
+    }
+    // msg is invalid after the handle was removed
+    CURL* curl = msg->easy_handle;
+    CURLcode res = msg->data.result;
+    struct async_request* request = NULL;
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**) &request);
+    curl_multi_remove_handle(multi, curl);
+    finishAsyncRequest(request, res);
+  }
+}
+
+static void multiSocketReady(int fd, void* arg __attribute__((unused))) {
+  int running;
+  // curl checks itself for which events the socket is ready
+  curl_multi_socket_action(multi, fd, 0, &running);
+  checkMultiInfo();
+}
+
+static void multiTimeout(int fd, void* arg __attribute__((unused))) {
+  uint64_t expirations;
+  if(read(fd, &expirations, sizeof(expirations))<0 && errno!=EAGAIN) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "reading timerfd: %m");
+  }
+  int running;
+  curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+  checkMultiInfo();
+}
+
+/** @fn int multiSocketCallback(CURL* curl, curl_socket_t s, int what, void*
+ * userp, void* socketp)
+ * @brief called by curl when the events it waits for on a socket change. The
+ * socket is watched by the event loop; the watch is stored as curl's socket
+ * data.
+ */
+static int multiSocketCallback(CURL* curl __attribute__((unused)), curl_socket_t s, int what, void* userp __attribute__((unused)), void* socketp) {
+  struct ipc_watch* watch = socketp;
+  if(what==CURL_POLL_REMOVE) {
+    ipc_removeWatch(watch);
+    return 0;
+  }
+  if(watch==NULL) {
+    watch = ipc_addWatch(s, multiSocketReady, NULL);
+    if(watch==NULL) {
+      return -1;
+    }
+    curl_multi_assign(multi, s, watch);
+  }
+  if(ipc_setWatchEvents(watch, what & CURL_POLL_IN, what & CURL_POLL_OUT)!=OIDC_SUCCESS) {
+    return -1;
+  }
+  return 0;
+}
+
+/** @fn int multiTimerCallback(CURLM* m, long timeout_ms, void* userp)
+ * @brief called by curl when it wants to be called after \p timeout_ms
+ * milliseconds; -1 removes the timeout
+ */
+static int multiTimerCallback(CURLM* m __attribute__((unused)), long timeout_ms, void* userp __attribute__((unused))) {
+  struct itimerspec spec = { .it_interval = {0, 0}, .it_value = {0, 0} };
+  if(timeout_ms>=0) {
+    spec.it_value.tv_sec = timeout_ms / 1000;
+    spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+    if(timeout_ms==0) {
+      spec.it_value.tv_nsec = 1; // a value of 0 would disarm the timer
+    }
+  }
+  if(timerfd_settime(multi_timer_fd, 0, &spec, NULL)!=0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "timerfd_settime: %m");
+    return -1;
+  }
+  return 0;
+}
+
+/** @fn oidc_error_t httpAsyncInit(size_t streams_per_host)
+ * @brief creates the multi handle for asynchronous requests and registers it
+ * with the event loop. Has to be called by the thread running the event loop.
+ * @param streams_per_host the maximum number of concurrent requests to one
+ * host; further requests are queued
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t httpAsyncInit(size_t streams_per_host) {
+  pthread_once(&curl_global_once, globalInit);
+  if(CURLErrorHandling(curl_global_res, NULL)!=OIDC_SUCCESS) {
+    return oidc_errno;
+  }
+  multi_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(multi_timer_fd<0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "timerfd_create: %m");
+    oidc_setErrnoError();
+    return oidc_errno;
+  }
+  if(ipc_addWatch(multi_timer_fd, multiTimeout, NULL)==NULL) {
+    return oidc_errno;
+  }
+  multi = curl_multi_init();
+  if(multi==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s (%s:%d) Couldn't init curl multi", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_ECURLI;
+    return oidc_errno;
+  }
+  curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, multiSocketCallback);
+  curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, multiTimerCallback);
+  curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long) streams_per_host);
+  max_streams = streams_per_host > 0 ? streams_per_host : 1;
+  return OIDC_SUCCESS;
+}
+
+/** @fn oidc_error_t httpsPOSTAsync(const char* url, const char* data, struct
+ * curl_slist* headers, const char* cert_path, const char* username, const
+ * char* password, http_callback callback, void* arg)
+ * @brief starts a https POST request without waiting for it; it might be
+ * queued behind other requests to the same host. Has to be called by the
+ * thread running the event loop after \f httpAsyncInit.
+ * @param headers have to stay valid until \p callback is called
+ * @param callback called by the event loop when the request is done. It gets
+ * the response (has to be freed after usage) or NULL if the request failed;
+ * then oidc_errno is set.
+ * @param arg passed to \p callback
+ * @return 0 if the request was started; otherwise an error code and
+ * \p callback is never called
+ */
+oidc_error_t httpsPOSTAsync(const char* url, const char* data, struct curl_slist* headers, const char* cert_path, const char* username, const char* password, http_callback callback, void* arg) {
+  if(multi==NULL) {
+    oidc_seterror("Asynchronous requests are not initialized");
+    oidc_errno = OIDC_EERROR;
+    return oidc_errno;
+  }
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Async https POST to: %s",url);
+  struct async_request* request = calloc(sizeof(struct async_request), 1);
+  if(request==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return oidc_errno;
+  }
+  CURL* curl = init();
+  if(curl==NULL) {
+    clearFree(request, sizeof(struct async_request));
+    return oidc_errno;
+  }
+  if(setWriteFunction(curl, &request->response)!=OIDC_SUCCESS) {
+    cleanup(curl);
+    clearFree(request, sizeof(struct async_request));
+    return oidc_errno;
+  }
+  request->curl = curl;
+  request->data = oidc_strcopy(data);
+  request->callback = callback;
+  request->arg = arg;
+  setUrl(curl, url);
+  curl_easy_setopt(curl, CURLOPT_POST, 1L);
+  setPostData(curl, request->data);
+  setSSLOpts(curl, cert_path);
+  setHeaders(curl, headers);
+  if(username && password) {
+    setBasicAuth(curl, username, password);
+  }
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, request);
+  request->host = getHostStreams(url);
+  if(request->host==NULL) {
+    clearFreeAsyncRequest(request);
+    return oidc_errno;
+  }
+  if(request->host->running >= max_streams) {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "%lu requests running to %s, queueing request", (unsigned long) request->host->running, request->host->host);
+    list_rpush(request->host->waiting, list_node_new(request));
+    return OIDC_SUCCESS;
+  }
+  if(startAsyncRequest(request)!=OIDC_SUCCESS) {
+    clearFreeAsyncRequest(request);
+    return oidc_errno;
+  }
+  return OIDC_SUCCESS;
+}
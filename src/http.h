@@ -1,9 +1,26 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include "oidc_error.h"
+
 #include <curl/curl.h>
+#include <stddef.h>
+
+typedef void (*http_callback)(char* response, void* arg);
+
+/* what is known about a cached response; see httpsGETConditional */
+struct http_cache {
+  char* etag;
+  char* last_modified;
+  long max_age; // from Cache-Control; -1 if not given
+  int no_store;
+};
 
 char* httpsGET(const char* url, struct curl_slist *list, const char* cert_path) ;
+char* httpsGETConditional(const char* url, const char* cert_path, struct http_cache* cache, int* not_modified) ;
 char* httpsPOST(const char* url, const char* data, struct curl_slist* headers, const char* cert_path, const char* username, const char* password) ;
 
+oidc_error_t httpAsyncInit(size_t streams_per_host) ;
+oidc_error_t httpsPOSTAsync(const char* url, const char* data, struct curl_slist* headers, const char* cert_path, const char* username, const char* password, http_callback callback, void* arg) ;
+
 #endif
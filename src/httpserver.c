@@ -4,15 +4,14 @@
 #include "ipc.h"
 #include "parse_oidp.h"
 #include "oidc_utilities.h"
+#include "timer.h"
 
 #include <stdio.h>
-#include <fcntl.h>
 #include <stdlib.h>
 #include <syslog.h>
-#include <signal.h>
 #include <unistd.h>
 #include <strings.h>
-#include <sys/prctl.h>
+#include <pthread.h>
 
 const char* const HTML_SUCCESS =  
 #include "static/success.html" 
@@ -33,25 +32,34 @@ const char* const HTML_ERROR =
 #include "static/error.html"
 ;
 
+// the delay before a server is stopped, so the browser gets the response
+#define HTTPSERVER_STOP_DELAY 5 // seconds
 
+void termHttpServer(char* state) ;
+
+/** @fn char* communicateWithPath(char* fmt, ...)
+ * @brief sends a request to the agent the server runs in and reads the
+ * response. The server runs on its own threads, so the agent handles the
+ * request like the one of any other client.
+ * @return a pointer to the response. Has to be freed after usage. On failure
+ * NULL is returned.
+ */
 char* communicateWithPath(char* fmt, ...) {
   va_list args;
   va_start(args, fmt);
 
-  static struct connection con;
-  if(ipc_initWithPath(&con)!=OIDC_SUCCESS) { 
-    return NULL; 
-  }
-  if(ipc_connect(con)<0) {
+  struct connection con = {0, 0, 0, 0};
+  if(ipc_initWithPath(&con)!=OIDC_SUCCESS || ipc_connect(con)<0) {
+    va_end(args);
+    ipc_close(&con);
     return NULL;
   }
   ipc_vwrite(*(con.sock), fmt, args);
+  va_end(args);
   char* response = ipc_read(*(con.sock));
   ipc_close(&con);
   if(NULL==response) {
-    printError("An unexpected error occured. It seems that oidc-agent has stopped.\n%s\n", oidc_serror());
-    syslog(LOG_AUTHPRIV|LOG_ERR, "An unexpected error occured. It seems that oidc-agent has stopped.\n%s\n", oidc_serror());
-    exit(EXIT_FAILURE);
+    syslog(LOG_AUTHPRIV|LOG_ERR, "HttpServer: no response from the agent: %s", oidc_serror());
   }
   return response;
 }
@@ -89,7 +97,7 @@ static int ahc_echo(void* cls,
   if(code) {
     syslog(LOG_AUTHPRIV|LOG_DEBUG, "HttpServer: Code is %s", code);
     char** cr = (char**) cls;
-    if(strcmp(cr[2], state)==0) {
+    if(state && strcmp(cr[2], state)==0) {
       res = communicateWithPath(REQUEST_CODEEXCHANGE, cr[0], cr[1], code, state);
       char* oidcgen_call = oidc_sprintf(REQUEST_CODEEXCHANGE, cr[0], cr[1], code, state);
       if(res==NULL) {
@@ -108,11 +116,6 @@ static int ahc_echo(void* cls,
         response = MHD_create_response_from_buffer (strlen(res), (void*) res, MHD_RESPMEM_MUST_FREE); // Note that MHD just frees the data and does not use clearFree
         ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
       }
-      clearFreeString(cr[0]);
-      clearFreeString(cr[1]);
-      clearFreeString(cr[2]);
-      clearFree(cr, sizeof(char*)*3);
-      *ptr = "shutdown";
       clearFreeString(oidcgen_call);
     } else {
       response = MHD_create_response_from_buffer(strlen(HTML_WRONG_STATE), (void*) HTML_WRONG_STATE, MHD_RESPMEM_PERSISTENT);
@@ -127,7 +130,7 @@ static int ahc_echo(void* cls,
       char* res = oidc_sprintf(HTML_ERROR, err);
       clearFreeString(err);
       response = MHD_create_response_from_buffer(strlen(res), (void*) res, MHD_RESPMEM_MUST_FREE);
-      kill(getpid(), SIGTERM);
+      termHttpServer(((char**) cls)[2]);
     } else {
       response = MHD_create_response_from_buffer(strlen(HTML_NO_CODE), (void*) HTML_NO_CODE, MHD_RESPMEM_PERSISTENT);
     }
@@ -137,23 +140,31 @@ static int ahc_echo(void* cls,
   return ret;
 }
 
-void stopHttpServer(struct MHD_Daemon** d_ptr) {
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "HttpServer: Stopping HttpServer");
-  MHD_stop_daemon(*d_ptr);
-  clearFree(d_ptr, sizeof(struct MHD_Daemon*));
+static void clearFreeServerArgs(char** cls) {
+  clearFreeString(cls[0]);
+  clearFreeString(cls[1]);
+  clearFreeString(cls[2]);
+  clearFree(cls, sizeof(char*)*3);
 }
 
 /**
  * @param config a pointer to a json account config.
+ * @param cls set to the arguments of the request handler. They have to be
+ * freed after the server is stopped.
  * */
-struct MHD_Daemon** startHttpServer(unsigned short port, char* config, char* state) {
+struct MHD_Daemon* startHttpServer(unsigned short port, char* config, char* state, char*** cls_ptr) {
   // MHD_set_panic_func(&panicCallback, NULL);
-  struct MHD_Daemon** d_ptr = calloc(sizeof(struct MHD_Daemon*),1);
   char** cls = calloc(sizeof(char*), 3);
+  if(cls==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
   cls[0] = oidc_sprintf("%s", config);
   cls[1] = portToUri(port);
   cls[2] = oidc_sprintf("%s", state);
-  *d_ptr = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
+  // the daemon polls and handles connections on its own threads
+  struct MHD_Daemon* d = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
       port,
       NULL,
       NULL,
@@ -161,41 +172,26 @@ struct MHD_Daemon** startHttpServer(unsigned short port, char* config, char* sta
       cls,
       // MHD_OPTION_NOTIFY_COMPLETED, &requestCompletedCallback, d_ptr,
       MHD_OPTION_END);
-  if(*d_ptr == NULL) {
+  if(d == NULL) {
     syslog(LOG_AUTHPRIV|LOG_ERR, "Error starting the HttpServer on port %d", port);
     oidc_errno = OIDC_EHTTPD;
-    clearFree(d_ptr, sizeof(struct MHD_Daemon*));
-    clearFreeString(cls[0]);
-    clearFreeString(cls[1]);
-    clearFreeString(cls[2]);
-    clearFree(cls, sizeof(char*)*3);
+    clearFreeServerArgs(cls);
     return NULL;
   }
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "HttpServer: Started HttpServer on port %d", port);
-  return d_ptr;
+  *cls_ptr = cls;
+  return d;
 }
 
-
-struct MHD_Daemon** d_ptr = NULL;
 list_t* servers = NULL;
+static pthread_mutex_t servers_mutex = PTHREAD_MUTEX_INITIALIZER; // the agent handles requests on multiple threads
 
 struct running_server {
-  pid_t pid;
+  struct MHD_Daemon* daemon;
+  char** cls;
   char* state;
 };
 
-void http_sig_handler(int signo) {
-  switch(signo) {
-    case SIGTERM:
-      sleep(5);
-      stopHttpServer(d_ptr);
-      break;
-    default: 
-      syslog(LOG_AUTHPRIV|LOG_EMERG, "HttpServer caught Signal %d", signo);
-  }
-  exit(signo);
-}
-
 void clearFreeRunningServer(struct running_server* s) {
   clearFreeString(s->state);
   clearFree(s, sizeof(struct running_server));
@@ -205,84 +201,82 @@ int matchRunningServer(char* state, struct running_server* s) {
   return strcmp(s->state, state) == 0 ? 1 : 0;
 }
 
+/** @fn void stopHttpServer(void* arg)
+ * @brief stops a server and frees it. Must not be called from the threads of
+ * the server itself.
+ * @param arg the running_server, which is no longer in the list of servers
+ */
+static void stopHttpServer(void* arg) {
+  struct running_server* s = arg;
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "HttpServer: Stopping HttpServer");
+  MHD_stop_daemon(s->daemon);
+  clearFreeServerArgs(s->cls);
+  clearFreeRunningServer(s);
+}
+
+/** @fn oidc_error_t fireHttpServer(unsigned short* port, size_t size, char*
+ * config, char* state)
+ * @brief starts a server for the redirect of an authorization code flow on
+ * the first of the ports that is available. The server runs in the agent on
+ * its own threads until it is stopped with \f termHttpServer.
+ * @return the port used or a negative error code
+ */
 oidc_error_t fireHttpServer(unsigned short* port, size_t size, char* config, char* state) {
-  int fd[2];
-  if(pipe2(fd, O_DIRECT)!=0) {
-    oidc_setErrnoError();
+  struct MHD_Daemon* d = NULL;
+  char** cls = NULL;
+  size_t i;
+  for(i=0; i<size && d==NULL; i++) {
+    d = startHttpServer(port[i], config, state, &cls);
+  }
+  if(d==NULL) {
+    oidc_errno = OIDC_EHTTPPORTS;
     return oidc_errno;
   }
-  pid_t pid = fork();
-  if(pid == -1) {
-    syslog(LOG_AUTHPRIV|LOG_ALERT, "fork %m");
-    oidc_setErrnoError();
+  struct running_server* running_server = calloc(sizeof(struct running_server), 1);
+  if(running_server==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    MHD_stop_daemon(d);
+    clearFreeServerArgs(cls);
+    oidc_errno = OIDC_EALLOC;
     return oidc_errno;
   }
-  if(pid == 0) {
-    prctl(PR_SET_PDEATHSIG, SIGTERM);
-    close(fd[0]);
-    size_t i;
-    for(i=0; i<size && d_ptr==NULL; i++) {
-      d_ptr = startHttpServer(port[i], config, state);
-    }
-    if(d_ptr==NULL) {
-      ipc_write(fd[1], "%d", OIDC_EHTTPPORTS);
-      close(fd[1]);
-      exit(EXIT_FAILURE);
-    }
-    ipc_write(fd[1], "%hu", port[i-1]);
-    close(fd[1]);
-    signal(SIGTERM, http_sig_handler);
-    sigset_t sigset;
-    sigemptyset(&sigset);
-    sigaddset(&sigset, SIGTERM);
-    sigsuspend(&sigset); 
-    return OIDC_ENOPE;
-  } else {
-    close(fd[1]);
-    char* e = ipc_read(fd[0]);
-    if(e==NULL) {
-      return oidc_errno;
-    }
-    char** endptr = calloc(sizeof(char*), 1);
-    long int port = strtol(e, endptr, 10);
-    if(**endptr!='\0') {
-      clearFree(endptr, sizeof(char*));
-      clearFreeString(e);
-      oidc_errno = OIDC_EERROR;
-      oidc_seterror("Internal error. Could not convert pipe communication.");
-      return oidc_errno;
-    }
-    clearFree(endptr, sizeof(char*));
-    clearFreeString(e);
-    if(port<0) {
-      oidc_errno = port;
-      return oidc_errno;
-    }
-    if(servers == NULL) {
-      servers = list_new();
-      servers->free = (void(*) (void*)) &clearFreeRunningServer;
-      servers->match = (int(*) (void*, void*)) &matchRunningServer;
-    }
-    struct running_server*  running_server= calloc(sizeof(struct running_server), 1);
-    running_server->pid = pid;
-    running_server->state = oidc_strcopy(state);
-    list_rpush(servers, list_node_new(running_server));
-
-    return port;
+  running_server->daemon = d;
+  running_server->cls = cls;
+  running_server->state = oidc_strcopy(state);
+  pthread_mutex_lock(&servers_mutex);
+  if(servers == NULL) {
+    servers = list_new();
+    servers->match = (int(*) (void*, void*)) &matchRunningServer;
   }
+  list_rpush(servers, list_node_new(running_server));
+  pthread_mutex_unlock(&servers_mutex);
+  return port[i-1];
 }
 
+/** @fn void termHttpServer(char* state)
+ * @brief stops the server started for \p state after a short delay, so it
+ * can still answer the browser. Can be called from any thread, including the
+ * threads of the server.
+ */
 void termHttpServer(char* state) {
   if(state==NULL) {
     return;
   }
+  pthread_mutex_lock(&servers_mutex);
   if(servers==NULL) {
+    pthread_mutex_unlock(&servers_mutex);
     return;
   }
   list_node_t* n = list_find(servers, state);  
   if(n==NULL) {
+    pthread_mutex_unlock(&servers_mutex);
     return;
   }
-  kill(((struct running_server*)n->val)->pid, SIGTERM);
-  list_remove(servers, n);
+  struct running_server* s = n->val;
+  list_remove(servers, n); // the list does not free its values
+  pthread_mutex_unlock(&servers_mutex);
+  // stopped on the event loop, which never runs the request handler
+  if(timer_add(time(NULL) + HTTPSERVER_STOP_DELAY, stopHttpServer, s)!=OIDC_SUCCESS) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "HttpServer: cannot schedule stopping the server: %s", oidc_serror());
+  }
 }
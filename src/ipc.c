@@ -1,25 +1,68 @@
 #define _XOPEN_SOURCE 700
+#define _GNU_SOURCE // struct ucred
 
 #include "ipc.h"
-#include "oidc_array.h"
+#include "settings.h"
 #include "oidc_utilities.h"
+#include "json_writer.h"
+#include "ipc_tlv.h"
+#include "timer.h"
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <syslog.h>
+#include <arpa/inet.h>
 
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/fcntl.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 
 #define SOCKET_DIR "/tmp/oidc-XXXXXX"
+#define IPC_MAX_EVENTS 64
+#define IPC_MAX_FRAGMENTS 16
+#define IPC_MIN_BUFFER 1024
+#define IPC_MAX_OUTPUT (1 << 20) // bytes of responses queued for a client that does not read them
+#define IPC_ACCEPT_PAUSE 1 // seconds accepting pauses when no file descriptor is left
 
 char* dir = NULL;
 
+/* a response that could not be sent yet, because the client did not read
+ * the previous ones */
+struct ipc_output {
+  struct ipc_output* next;
+  size_t len;
+  char data[];
+};
+
+static __thread struct connection* response_con = NULL;
+static __thread const char* response_id = NULL;
+static __thread int response_protocol = IPC_PROTOCOL_JSON;
+
+static int epoll_fd = -1;
+static struct epoll_event ready_events[IPC_MAX_EVENTS];
+static int ready_count = 0;
+static int ready_next = 0;
+static struct timespec ready_since; // when the current events were reported
+
+static list_t* timeout_cons = NULL;
+static time_t read_timeout = 0;
+static time_t idle_timeout = 0;
+static size_t max_connections = 0;
+static int spare_fd = -1; // reserved to take connections off the listen queue when no descriptor is left
+static int listen_paused = 0;
+static struct ipc_stats stats;
+
+int matchConnection(struct connection* key, struct connection* con) ;
+
 /** @fn char* init_socket_path(const char* env_var_name)
  * @brief generates the socket path and prints commands for setting env vars
  * @param env_var_name the name of the environment variable which will be set.
@@ -133,6 +176,37 @@ oidc_error_t ipc_initWithPath(struct connection* con) {
   return OIDC_SUCCESS;
 }
 
+/** @fn int ipc_getEpoll()
+ * @brief returns the epoll instance used by \f ipc_async and creates it on
+ * first use
+ * @return the epoll file descriptor or a negative error code
+ */
+static int ipc_getEpoll() {
+  if(epoll_fd < 0) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0) {
+      syslog(LOG_AUTHPRIV|LOG_ALERT, "epoll_create1: %m");
+      oidc_errno = OIDC_EEPOLL;
+      return oidc_errno;
+    }
+  }
+  return epoll_fd;
+}
+
+/** @fn void ipc_dropPendingEvents(struct ipc_watch* watch)
+ * @brief removes all events for \p watch that were reported by the last
+ * epoll_wait but not yet handled
+ * @param watch the watch whose events should be dropped
+ */
+static void ipc_dropPendingEvents(struct ipc_watch* watch) {
+  int i;
+  for(i=ready_next; i<ready_count; i++) {
+    if(ready_events[i].data.ptr == watch) {
+      ready_events[i].data.ptr = NULL;
+    }
+  }
+}
+
 /** @fn int ipc_bind(struct connection con)
  * @brief binds the server socket,  listen and starts accepting a connection
  * @deprecated server should use async ipc. Use \f ipc_bindAndListen instead.
@@ -155,12 +229,14 @@ int ipc_bind(struct connection* con) {
   return *(con->msgsock);
 }
 
-/** @fn int ipc_bindAndListen(struct connection con)
- * @brief binds the server socket and listen 
+/** @fn int ipc_bindAndListen(struct connection con, int backlog)
+ * @brief binds the server socket, listen and registers it with the epoll
+ * instance used by \f ipc_async
  * @param con, the connection struct
+ * @param backlog the maximum length of the queue of pending connections
  * @return 0 on success or errorcode on failure
  */
-int ipc_bindAndListen(struct connection* con) {
+int ipc_bindAndListen(struct connection* con, int backlog) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "binding ipc\n");
   unlink(con->server->sun_path);
   if(bind(*(con->sock), (struct sockaddr *) con->server, sizeof(struct sockaddr_un))) {
@@ -174,77 +250,610 @@ int ipc_bindAndListen(struct connection* con) {
     flags = 0;
   fcntl(*(con->sock), F_SETFL, flags | O_NONBLOCK);
 
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "listen ipc\n");
-  return listen(*(con->sock), 5);
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "listen ipc with backlog %d\n", backlog);
+  if(listen(*(con->sock), backlog) < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "listen: %m");
+    oidc_setErrnoError();
+    return oidc_errno;
+  }
+  if(ipc_getEpoll() < 0) {
+    return oidc_errno;
+  }
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, *(con->sock), &ev) < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "epoll_ctl on listen socket: %m");
+    oidc_errno = OIDC_EEPOLL;
+    return oidc_errno;
+  }
+  if(spare_fd < 0) {
+    spare_fd = open("/dev/null", O_RDONLY);
+  }
+  return OIDC_SUCCESS;
+}
+
+/** @fn void ipc_rejectConnection(int msgsock)
+ * @brief answers a new client with busy and closes the connection. The client
+ * reads the answer when it sends its first request.
+ */
+static void ipc_rejectConnection(int msgsock) {
+  stats.rejected_connections++;
+  ipc_writeBusy(msgsock, BUSY_RETRY_AFTER);
+  close(msgsock);
+}
+
+/** @fn void ipc_resumeListening(void* arg)
+ * @brief registers the listen socket \p arg with the epoll instance again
+ * after accepting was paused. Runs as timer on the event loop.
+ */
+static void ipc_resumeListening(void* arg) {
+  int listen_sock = (int) (intptr_t) arg;
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "epoll_ctl on listen socket: %m");
+    return;
+  }
+  listen_paused = 0;
+  if(spare_fd < 0) {
+    spare_fd = open("/dev/null", O_RDONLY);
+  }
+}
+
+/** @fn int ipc_shedConnection(int listen_sock)
+ * @brief called when a connection cannot be accepted because no file
+ * descriptor is left. The pending connection would be reported by epoll
+ * again and again, so it is accepted using the reserved descriptor and
+ * answered with busy. If there is no reserved descriptor, accepting is
+ * paused for IPC_ACCEPT_PAUSE seconds.
+ * @return 1 if a connection was taken off the listen queue; 0 if accepting
+ * was paused
+ */
+static int ipc_shedConnection(int listen_sock) {
+  if(spare_fd >= 0) {
+    close(spare_fd);
+    int msgsock = accept(listen_sock, 0, 0);
+    if(msgsock >= 0) {
+      ipc_rejectConnection(msgsock);
+    }
+    spare_fd = open("/dev/null", O_RDONLY);
+    if(msgsock >= 0) {
+      syslog(LOG_AUTHPRIV|(stats.rejected_connections==1 ? LOG_NOTICE : LOG_DEBUG), "No file descriptor left, rejecting a connection");
+      return 1;
+    }
+  }
+  syslog(LOG_AUTHPRIV|LOG_NOTICE, "No file descriptor left, pausing accepting connections for %d seconds", IPC_ACCEPT_PAUSE);
+  if(timer_add(time(NULL) + IPC_ACCEPT_PAUSE, ipc_resumeListening, (void*) (intptr_t) listen_sock)!=OIDC_SUCCESS) {
+    return 0; // cannot resume later, so the listen socket stays registered
+  }
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_sock, NULL);
+  listen_paused = 1;
+  return 0;
+}
+
+/** @fn void ipc_acceptAll(struct connection listencon, list_t* clientcons)
+ * @brief accepts all pending connections on the non-blocking listen socket
+ * and registers them with the epoll instance
+ * @param listencon the connection struct for the socket accepting new client
+ * connections
+ * @param clientcons the list of client connections. New clients are appended.
+ */
+static void ipc_acceptAll(struct connection listencon, list_t* clientcons) {
+  while(!listen_paused) {
+    int msgsock = accept(*(listencon.sock), 0, 0);
+    if(msgsock < 0) {
+      if(errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if(errno == EMFILE || errno == ENFILE) {
+        if(ipc_shedConnection(*(listencon.sock))) {
+          continue;
+        }
+        return;
+      }
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        syslog(LOG_AUTHPRIV|LOG_ERR, "accept: %m");
+      }
+      return;
+    }
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "accepted new client sock: %d", msgsock);
+    if(max_connections>0 && clientcons->len >= max_connections) {
+      ipc_rejectConnection(msgsock);
+      syslog(LOG_AUTHPRIV|(stats.rejected_connections==1 ? LOG_NOTICE : LOG_DEBUG), "Connection limit of %lu reached, rejecting sock %d", (unsigned long) max_connections, msgsock);
+      continue;
+    }
+    struct connection newClient = {0, 0, 0, 0};
+    newClient.msgsock = calloc(sizeof(int), 1);
+    if(newClient.msgsock == NULL) {
+      syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+      close(msgsock);
+      return;
+    }
+    *(newClient.msgsock) = msgsock;
+    struct connection* client = addConnection(clientcons, newClient);
+    if(client == NULL) {
+      close(msgsock);
+      clearFree(newClient.msgsock, sizeof(int));
+      return;
+    }
+    client->watch.fd = msgsock;
+    client->last_active = time(NULL);
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if(getsockopt(msgsock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0) {
+      client->uid = cred.uid;
+    } else {
+      syslog(LOG_AUTHPRIV|LOG_ERR, "getsockopt SO_PEERCRED: %m");
+      client->uid = (uid_t) -1;
+    }
+    client->watch.callback = NULL;
+    client->watch.arg = client;
+    if(ipc_resumeConnection(client)!=OIDC_SUCCESS) {
+      removeConnection(clientcons, client);
+    }
+  }
+}
+
+/** @fn void updateConnectionEvents(struct connection* con)
+ * @brief lets epoll report a client connection as writable as long as
+ * responses are queued. Has to be called with the output queue locked.
+ */
+static void updateConnectionEvents(struct connection* con) {
+  if(con->paused || con->broken) {
+    return;
+  }
+  struct epoll_event ev = { .events = EPOLLIN | (con->output ? EPOLLOUT : 0), .data.ptr = &con->watch };
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, *(con->msgsock), &ev) < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "epoll_ctl on client socket: %m");
+  }
+}
+
+/** @fn void clearOutput(struct connection* con)
+ * @brief drops all queued responses. Has to be called with the output queue
+ * locked.
+ */
+static void clearOutput(struct connection* con) {
+  while(con->output) {
+    struct ipc_output* out = con->output;
+    con->output = out->next;
+    clearFree(out, sizeof(struct ipc_output) + out->len);
+  }
+  con->output_tail = NULL;
+  con->output_len = 0;
+}
+
+/** @fn void breakConnection(struct connection* con)
+ * @brief gives up on a client that does not read its responses. The socket
+ * is shut down, so the event loop sees the connection as disconnected and
+ * closes it as soon as no request is pending anymore. Has to be called with
+ * the output queue locked.
+ */
+static void breakConnection(struct connection* con) {
+  __sync_fetch_and_add(&stats.slow_clients, 1);
+  syslog(LOG_AUTHPRIV|LOG_NOTICE, "Closing client connection on socket %d: the client does not read its responses", *(con->msgsock));
+  clearOutput(con);
+  con->broken = 1;
+  shutdown(*(con->msgsock), SHUT_RDWR);
+}
+
+/** @fn oidc_error_t ipc_writeConnection(struct connection* con, const struct
+ * iovec* iov, int iovcnt, size_t len)
+ * @brief writes a message to a client without blocking. If the client does
+ * not read fast enough, the message is queued and sent by the event loop
+ * when the socket becomes writable. If more than IPC_MAX_OUTPUT bytes are
+ * queued, the connection is closed.
+ * @param len the total length of the fragments
+ * @return 0 on success; otherwise an error code
+ */
+static oidc_error_t ipc_writeConnection(struct connection* con, const struct iovec* iov, int iovcnt, size_t len) {
+  int _sock = *(con->msgsock);
+  pthread_mutex_lock(&con->output_mutex);
+  if(con->broken) {
+    pthread_mutex_unlock(&con->output_mutex);
+    oidc_errno = OIDC_EWRITE;
+    return oidc_errno;
+  }
+  if(con->output==NULL) { // otherwise the message has to wait for the queued ones
+    struct msghdr msg = { .msg_iov = (struct iovec*) iov, .msg_iovlen = iovcnt };
+    ssize_t written;
+    do {
+      // MSG_NOSIGNAL: a client that went away must not kill the writer
+      written = sendmsg(_sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while(written < 0 && errno == EINTR);
+    if(written >= 0) {
+      pthread_mutex_unlock(&con->output_mutex);
+      return OIDC_SUCCESS;
+    }
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      syslog(LOG_AUTHPRIV|LOG_ERR, "writing on client socket %d: %m", _sock);
+      pthread_mutex_unlock(&con->output_mutex);
+      oidc_errno = OIDC_EWRITE;
+      return oidc_errno;
+    }
+  }
+  struct ipc_output* out = NULL;
+  if(con->output_len + len <= IPC_MAX_OUTPUT) {
+    out = malloc(sizeof(struct ipc_output) + len);
+    if(out==NULL) {
+      syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    }
+  }
+  if(out==NULL) {
+    breakConnection(con);
+    pthread_mutex_unlock(&con->output_mutex);
+    oidc_errno = OIDC_EWRITE;
+    return oidc_errno;
+  }
+  out->next = NULL;
+  out->len = 0;
+  int i;
+  for(i=0; i<iovcnt; i++) {
+    memcpy(out->data + out->len, iov[i].iov_base, iov[i].iov_len);
+    out->len += iov[i].iov_len;
+  }
+  if(con->output_tail) {
+    con->output_tail->next = out;
+  } else {
+    con->output = out;
+    updateConnectionEvents(con);
+  }
+  con->output_tail = out;
+  con->output_len += out->len;
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Queued %lu bytes for socket %d, %lu bytes queued", (unsigned long) out->len, _sock, (unsigned long) con->output_len);
+  pthread_mutex_unlock(&con->output_mutex);
+  return OIDC_SUCCESS;
+}
+
+/** @fn void ipc_flushConnection(struct connection* con)
+ * @brief sends queued responses to a client that became writable
+ */
+static void ipc_flushConnection(struct connection* con) {
+  pthread_mutex_lock(&con->output_mutex);
+  while(con->output) {
+    struct ipc_output* out = con->output;
+    ssize_t written = send(*(con->msgsock), out->data, out->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(written < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        break;
+      }
+      syslog(LOG_AUTHPRIV|LOG_ERR, "writing on client socket %d: %m", *(con->msgsock));
+      clearOutput(con);
+      break;
+    }
+    con->output = out->next;
+    con->output_len -= out->len;
+    if(con->output==NULL) {
+      con->output_tail = NULL;
+    }
+    clearFree(out, sizeof(struct ipc_output) + out->len);
+  }
+  updateConnectionEvents(con);
+  pthread_mutex_unlock(&con->output_mutex);
+}
+
+/** @fn void recordQueueDelay()
+ * @brief updates the maximum time a client waited between epoll reporting
+ * it as readable and being served. The delay is measured from the return of
+ * epoll_wait, not from when the client sent its request; time spent in the
+ * socket buffer before epoll_wait returned is not included.
+ */
+static void recordQueueDelay() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  unsigned long delay = (now.tv_sec - ready_since.tv_sec) * 1000000 + (now.tv_nsec - ready_since.tv_nsec) / 1000;
+  if(delay > stats.max_queue_delay) {
+    stats.max_queue_delay = delay;
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "New maximum queueing delay of a client: %lu us", delay);
+  }
 }
 
-/** @fn struct connection* ipc_async(struct connection listencon, struct
- * connection** clientcons_addr, size_t* size)
+/** @fn struct connection* ipc_async(struct connection listencon, list_t*
+ * clientcons)
  * @brief handles asynchronous communication
  *
- * listens for incoming connections on the listencon and for incoming messages
- * on multiple client sockets. If a new client connects it is added to the list
- * of current client connections.  If on any client socket is a message
- * available for reading, a pointer to this connection is returned.
+ * waits for incoming connections on the listencon and for incoming messages
+ * on all client sockets using epoll. Sockets are registered once, when they
+ * are accepted. All events reported by one wakeup are drained before waiting
+ * again: new clients are accepted until the listen queue is empty and every
+ * client that became readable is returned by successive calls, without
+ * polling again in between. Callbacks of watches registered with
+ * \f ipc_addWatch are called in the same loop.
+ *
+ * Clients are served in the order epoll reports them, which is the order
+ * they became readable. Only one message is read per report; a client that
+ * still has messages queued is reported again behind all others, so clients
+ * are served round-robin and one busy client cannot starve the rest. The
+ * longest time a client waited since epoll_wait reported it is kept as
+ * max_queue_delay in \f ipc_getStats.
  * @param listencon the connection struct for the socket accepting new client
- * connections. The list is updated if a new client connects.
- * @param clientcons_addr a pointer to an array of client connections
- * @param size a pointer to the number of client connections. The number is
- * updated if a new client connects.
+ * connections.
+ * @param clientcons the list of client connections. The list is updated if a
+ * new client connects.
  * @return A pointer to a client connection. On this connection is either a
  * message avaible for reading or the client disconnected.
  */
-struct connection* ipc_async(struct connection listencon, struct connection** clientcons_addr, size_t* size) {
-  while(1){
-    int maxSock = -1;
-    fd_set readSockSet;
-    FD_ZERO(&readSockSet);
-    FD_SET(*(listencon.sock), &readSockSet);  
-    if(*(listencon.sock) > maxSock) {
-      maxSock = *(listencon.sock);
+struct connection* ipc_async(struct connection listencon, list_t* clientcons) {
+  if(epoll_fd < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "ipc_async called before ipc_bindAndListen");
+    oidc_errno = OIDC_EEPOLL;
+    return NULL;
+  }
+  while(1) {
+    while(ready_next < ready_count) {
+      uint32_t events = ready_events[ready_next].events;
+      struct ipc_watch* watch = ready_events[ready_next++].data.ptr;
+      if(watch == NULL) {
+        continue;
+      }
+      if(watch->callback != NULL) {
+        watch->callback(watch->fd, watch->arg);
+        continue;
+      }
+      struct connection* con = watch->arg;
+      if(events & EPOLLOUT) {
+        ipc_flushConnection(con);
+      }
+      if(!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        continue;
+      }
+      syslog(LOG_AUTHPRIV|LOG_DEBUG, "New message for read av on sock %d", *(con->msgsock));
+      recordQueueDelay();
+      return con;
     }
-
-    unsigned int i;
-    for (i=0; i<*size; i++) {
-      FD_SET(*((*clientcons_addr+i)->msgsock), &readSockSet);
-      if(*((*clientcons_addr+i)->msgsock) > maxSock) {
-        maxSock = *((*clientcons_addr+i)->msgsock);
+    ready_next = ready_count = 0;
+    int ret = epoll_wait(epoll_fd, ready_events, IPC_MAX_EVENTS, -1);
+    if(ret < 0) {
+      if(errno != EINTR) {
+        syslog(LOG_AUTHPRIV|LOG_ERR, "epoll_wait: %m");
       }
+      continue;
     }
-
-    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Selecting maxSock is %d", maxSock);
-    int ret = select(maxSock+1, &readSockSet, NULL, NULL, NULL);
-    if(ret >= 0) {
-      if(FD_ISSET(*(listencon.sock), &readSockSet)) {
-        syslog(LOG_AUTHPRIV|LOG_DEBUG, "New incoming client");
-        struct connection newClient = {0, 0, 0};
-        newClient.msgsock = calloc(sizeof(int), 1);
-        *(newClient.msgsock) = accept(*(listencon.sock), 0, 0);
-        if(*(newClient.msgsock) >= 0) {
-          syslog(LOG_AUTHPRIV|LOG_DEBUG, "accepted new client sock: %d", *(newClient.msgsock));
-
-          *clientcons_addr = addConnection(*clientcons_addr, size, newClient);
-          syslog(LOG_AUTHPRIV|LOG_DEBUG, "updated client list");
-        }
-        else {
-          syslog(LOG_AUTHPRIV|LOG_ERR, "%m");
-        }
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "epoll reported %d ready sockets", ret);
+    clock_gettime(CLOCK_MONOTONIC, &ready_since);
+    ready_count = ret;
+    int i;
+    for(i=0; i<ready_count; i++) {
+      if(ready_events[i].data.ptr == NULL) { // listen socket
+        ipc_acceptAll(listencon, clientcons);
       }
+    }
+  }
+  return NULL;
+}
 
-      int j;
-      for (j=*size-1; j>=0; j--) {
-        syslog(LOG_AUTHPRIV|LOG_DEBUG, "Checking client %d", *((*clientcons_addr+j)->msgsock));
-        if(FD_ISSET(*((*clientcons_addr+j)->msgsock), &readSockSet)) {
-          syslog(LOG_AUTHPRIV|LOG_DEBUG, "New message for read av");
-          return *clientcons_addr+j;           
-        }
+/** @fn struct ipc_watch* ipc_addWatch(int fd, void (*callback)(int fd, void*
+ * arg), void* arg)
+ * @brief registers an additional file descriptor with the event loop of
+ * \f ipc_async. \p callback is called from within \f ipc_async whenever
+ * \p fd becomes readable.
+ * @param fd the file descriptor to watch
+ * @param callback the function to be called
+ * @param arg passed to \p callback
+ * @return a pointer to the watch. Has to be freed using \f ipc_removeWatch.
+ * On failure NULL is returned.
+ */
+struct ipc_watch* ipc_addWatch(int fd, void (*callback)(int fd, void* arg), void* arg) {
+  if(callback==NULL) {
+    oidc_setArgNullFuncError(__func__);
+    return NULL;
+  }
+  if(ipc_getEpoll() < 0) {
+    return NULL;
+  }
+  struct ipc_watch* watch = calloc(sizeof(struct ipc_watch), 1);
+  if(watch==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
+  watch->fd = fd;
+  watch->callback = callback;
+  watch->arg = arg;
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = watch };
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "epoll_ctl on fd %d: %m", fd);
+    clearFree(watch, sizeof(struct ipc_watch));
+    oidc_errno = OIDC_EEPOLL;
+    return NULL;
+  }
+  return watch;
+}
+
+/** @fn void ipc_removeWatch(struct ipc_watch* watch)
+ * @brief removes a watch from the event loop and frees it. The file
+ * descriptor is not closed.
+ * @param watch the watch as returned by \f ipc_addWatch
+ */
+void ipc_removeWatch(struct ipc_watch* watch) {
+  if(watch==NULL) {
+    return;
+  }
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+  ipc_dropPendingEvents(watch);
+  clearFree(watch, sizeof(struct ipc_watch));
+}
+
+/** @fn oidc_error_t ipc_setWatchEvents(struct ipc_watch* watch, int readable,
+ * int writable)
+ * @brief changes the events a watch is reported for. Watches are added for
+ * readability only.
+ * @param watch the watch as returned by \f ipc_addWatch
+ * @param readable if the callback is called when the fd becomes readable
+ * @param writable if the callback is called when the fd becomes writable
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t ipc_setWatchEvents(struct ipc_watch* watch, int readable, int writable) {
+  struct epoll_event ev = { .events = (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0), .data.ptr = watch };
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, watch->fd, &ev) < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "epoll_ctl on fd %d: %m", watch->fd);
+    oidc_errno = OIDC_EEPOLL;
+    return oidc_errno;
+  }
+  return OIDC_SUCCESS;
+}
+
+/** @fn oidc_error_t ipc_pauseConnection(struct connection* con)
+ * @brief stops \f ipc_async from reporting a client connection, e.g. while
+ * a request on it is handled by another thread
+ * @param con the client connection
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t ipc_pauseConnection(struct connection* con) {
+  ipc_dropPendingEvents(&con->watch);
+  pthread_mutex_lock(&con->output_mutex);
+  con->paused = 1;
+  int e = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *(con->msgsock), NULL);
+  pthread_mutex_unlock(&con->output_mutex);
+  if(e < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "epoll_ctl on client socket: %m");
+    oidc_errno = OIDC_EEPOLL;
+    return oidc_errno;
+  }
+  return OIDC_SUCCESS;
+}
+
+/** @fn oidc_error_t ipc_resumeConnection(struct connection* con)
+ * @brief (re)registers a client connection with the event loop of
+ * \f ipc_async
+ * @param con the client connection
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t ipc_resumeConnection(struct connection* con) {
+  pthread_mutex_lock(&con->output_mutex);
+  struct epoll_event ev = { .events = EPOLLIN | (con->output ? EPOLLOUT : 0), .data.ptr = &con->watch };
+  int e = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, *(con->msgsock), &ev);
+  if(e == 0) {
+    con->paused = 0;
+  }
+  pthread_mutex_unlock(&con->output_mutex);
+  if(e < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "epoll_ctl on client socket: %m");
+    oidc_errno = OIDC_EEPOLL;
+    return oidc_errno;
+  }
+  return OIDC_SUCCESS;
+}
+
+/** @fn time_t connectionDeadline(const struct connection* con)
+ * @return the time \p con is closed if the client does not send a request
+ * until then; 0 if it is not closed
+ */
+static time_t connectionDeadline(const struct connection* con) {
+  if(con->pending>0 || con->closing) { // waits for the agent, not the client
+    return 0;
+  }
+  time_t timeout = con->messages==0 ? read_timeout : idle_timeout;
+  return timeout>0 ? con->last_active + timeout : 0;
+}
+
+/** @fn void ipc_expireConnections(void* arg)
+ * @brief closes all client connections whose deadline passed and schedules
+ * itself for the next deadline. Runs as timer on the event loop.
+ */
+static void ipc_expireConnections(void* arg __attribute__((unused))) {
+  time_t now = time(NULL);
+  // a connection accepted or answered later has a later deadline
+  time_t next = now + (read_timeout>0 && (idle_timeout==0 || read_timeout<idle_timeout) ? read_timeout : idle_timeout);
+  list_node_t* node = timeout_cons->head;
+  while(node) {
+    list_node_t* following = node->next;
+    struct connection* con = node->val;
+    time_t deadline = connectionDeadline(con);
+    if(deadline>0 && deadline<=now) {
+      int unused = con->messages==0;
+      if(unused) {
+        stats.read_timeouts++;
+      } else {
+        stats.idle_timeouts++;
       }
+      syslog(LOG_AUTHPRIV|LOG_NOTICE, "Closing client connection on socket %d: %s for %lu seconds (%lu read timeouts, %lu idle timeouts so far)", *(con->msgsock), unused ? "no request" : "idle", (unsigned long) (now - con->last_active), stats.read_timeouts, stats.idle_timeouts);
+      removeConnection(timeout_cons, con);
+    } else if(deadline>0 && deadline<next) {
+      next = deadline;
     }
-    else {
-      syslog(LOG_AUTHPRIV|LOG_ERR, "%m");
-    }
+    node = following;
   }
-  return NULL;
+  if(timer_add(next, ipc_expireConnections, NULL)!=OIDC_SUCCESS) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "Cannot schedule closing idle connections: %s", oidc_serror());
+  }
+}
+
+/** @fn oidc_error_t ipc_setTimeouts(list_t* clientcons, time_t
+ * _read_timeout, time_t _idle_timeout)
+ * @brief closes client connections that are not used. The connections are
+ * checked by a timer, so timers have to be initialized.
+ * @param clientcons the list of client connections of \f ipc_async
+ * @param _read_timeout the seconds a client has to send its first request
+ * after connecting; 0 for no limit
+ * @param _idle_timeout the seconds a client may keep a connection open
+ * without sending a request, after the previous request was answered; 0 for
+ * no limit
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t ipc_setTimeouts(list_t* clientcons, time_t _read_timeout, time_t _idle_timeout) {
+  timeout_cons = clientcons;
+  read_timeout = _read_timeout;
+  idle_timeout = _idle_timeout;
+  if(read_timeout==0 && idle_timeout==0) {
+    return OIDC_SUCCESS;
+  }
+  return timer_add(time(NULL) + 1, ipc_expireConnections, NULL);
+}
+
+/** @fn void ipc_setConnectionLimit(size_t max_connections)
+ * @brief limits the number of client connections. Connections beyond the
+ * limit are answered with \f ipc_writeBusy and closed right away.
+ * @param max_connections the maximum number of connections; 0 for no limit
+ */
+void ipc_setConnectionLimit(size_t _max_connections) {
+  max_connections = _max_connections;
+}
+
+/** @fn struct ipc_stats ipc_getStats()
+ * @return the number of connections closed and requests rejected by the
+ * agent and the maximum queueing delay of clients
+ */
+struct ipc_stats ipc_getStats() {
+  return stats;
+}
+
+/** @fn unsigned long ipc_countRejectedRequest()
+ * @brief counts a request that was answered with busy, because too many
+ * requests were queued. Has to be called on the event loop.
+ * @return the number of rejected requests including this one
+ */
+unsigned long ipc_countRejectedRequest() {
+  return ++stats.rejected_requests;
+}
+
+/** @fn void ipc_logStats(void* arg)
+ * @brief logs the counters of \f ipc_getStats, if they changed since they
+ * were logged last, and schedules itself again. Runs as timer on the event
+ * loop.
+ * @param arg the seconds between two runs
+ */
+static void ipc_logStats(void* arg) {
+  static struct ipc_stats logged;
+  struct ipc_stats current = stats;
+  if(memcmp(&current, &logged, sizeof(struct ipc_stats))!=0) {
+    logged = current;
+    syslog(LOG_AUTHPRIV|LOG_NOTICE, "Connection statistics: maximum queueing delay %lu us, %lu read timeouts, %lu idle timeouts, %lu rejected connections, %lu slow clients, %lu rejected requests", current.max_queue_delay, current.read_timeouts, current.idle_timeouts, current.rejected_connections, current.slow_clients, current.rejected_requests);
+  }
+  time_t interval = (time_t) (intptr_t) arg;
+  if(timer_add(time(NULL) + interval, ipc_logStats, arg)!=OIDC_SUCCESS) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "Cannot schedule logging connection statistics: %s", oidc_serror());
+  }
+}
+
+/** @fn oidc_error_t ipc_logStatsPeriodically(time_t interval)
+ * @brief logs the counters of \f ipc_getStats at LOG_NOTICE every \p interval
+ * seconds, if they changed. Timers have to be initialized.
+ * @param interval the seconds between two log messages; 0 to never log them
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t ipc_logStatsPeriodically(time_t interval) {
+  if(interval==0) {
+    return OIDC_SUCCESS;
+  }
+  return timer_add(time(NULL) + interval, ipc_logStats, (void*) (intptr_t) interval);
 }
 
 /** @fn int ipc_connect(struct connection con)
@@ -270,44 +879,215 @@ int ipc_connect(struct connection con) {
  * is returned, it's most likely that the other party disconnected.
  */
 char* ipc_read(int _sock) {
+  return ipc_readMessage(_sock, NULL);
+}
+
+/** @fn ssize_t ipc_peekLength(int _sock)
+ * @brief waits for the next message on a socket and gets its length without
+ * reading it
+ * @return the length of the message; 0 if the other party disconnected; -1
+ * on failure, then errno is set
+ */
+static ssize_t ipc_peekLength(int _sock) {
+  ssize_t len;
+  do {
+    // MSG_TRUNC: the real length of the message is returned
+    len = recv(_sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+  } while(len < 0 && errno == EINTR);
+  return len;
+}
+
+/** @fn char* ipc_readPipe(int _sock, size_t* msg_len)
+ * @brief reads whatever is available from a pipe, waiting until something is
+ */
+static char* ipc_readPipe(int _sock, size_t* msg_len) {
+  int len = 0;
+  int rv;
+  fd_set set;
+  FD_ZERO(&set);
+  FD_SET(_sock, &set);
+  rv = select(_sock + 1, &set, NULL, NULL, NULL);
+  if(rv < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "error select in ipc_read: %m");
+    oidc_errno = OIDC_ESELECT;
+    return NULL;
+  }
+  if(ioctl(_sock, FIONREAD, &len)!=0) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "ioctl: %m");
+    oidc_errno = OIDC_EIOCTL;
+    return NULL;
+  }
+  if(len <= 0) {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Client disconnected");
+    oidc_errno = OIDC_EIPCDIS;
+    return NULL;
+  }
+  char* buf = calloc(sizeof(char), len+1);
+  if(buf==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
+  len = read(_sock, buf, len);
+  if(msg_len) {
+    *msg_len = len>0 ? len : 0;
+  }
+  return buf;
+}
+
+/** @fn char* ipc_readMessage(int _sock, size_t* msg_len)
+ * @brief reads a message, which might be binary, from a socket
+ * @param msg_len if not NULL, it is set to the length of the message
+ * @return see \f ipc_read; the message is always 0 terminated
+ */
+char* ipc_readMessage(int _sock, size_t* msg_len) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "ipc reading from socket %d\n",_sock);
   if(_sock < 0) {
     syslog(LOG_AUTHPRIV|LOG_ERR, "invalid socket in ipc_read");
     oidc_errno = OIDC_ESOCKINV;
     return NULL;
-  } else {
-    int len = 0;
-    int rv;
-    fd_set set;
-    FD_ZERO(&set); 
-    FD_SET(_sock, &set); 
-    rv = select(_sock + 1, &set, NULL, NULL, NULL);
-    if(rv > 0) {
-      if(ioctl(_sock, FIONREAD, &len)!=0) {
-        syslog(LOG_AUTHPRIV|LOG_ERR, "ioctl: %m");
-        oidc_errno = OIDC_EIOCTL;
-        return NULL;
-      }
-      if(len > 0) {
-        char* buf = calloc(sizeof(char), len+1);
-        len = read(_sock, buf, len);
-        syslog(LOG_AUTHPRIV|LOG_DEBUG, "ipc read %s\n",buf);
-        return buf;
-      } else {
-        syslog(LOG_AUTHPRIV|LOG_DEBUG, "Client disconnected");
-        oidc_errno = OIDC_EIPCDIS;
-        return NULL;
-      }
-    } else if (rv == -1) {
-      syslog(LOG_AUTHPRIV|LOG_ALERT, "error select in ipc_read: %m");
-      oidc_errno = OIDC_ESELECT;
+  }
+  ssize_t len = ipc_peekLength(_sock);
+  if(len < 0 && errno == ENOTSOCK) {
+    return ipc_readPipe(_sock, msg_len);
+  }
+  if(len < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "recv: %m");
+    oidc_errno = OIDC_EIPCDIS;
+    return NULL;
+  }
+  if(len == 0) {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Client disconnected");
+    oidc_errno = OIDC_EIPCDIS;
+    return NULL;
+  }
+  char* buf = calloc(sizeof(char), len+1);
+  if(buf==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
+  len = recv(_sock, buf, len, 0);
+  if(msg_len) {
+    *msg_len = len>0 ? len : 0;
+  }
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "ipc read %s\n",buf);
+  return buf;
+}
+
+/** @fn char* ipc_receive(struct connection* con, size_t* msg_len)
+ * @brief reads the next message of a client connection into the receive
+ * buffer of the connection. Has to be called only when the connection is
+ * readable, e.g. when returned by \f ipc_async. The buffer is reused for all
+ * messages and doubled when a message does not fit, so reading does not
+ * allocate once the buffer has grown to the size of the messages.
+ * @param msg_len set to the length of the message
+ * @return a pointer to the 0 terminated message. It is valid until the next
+ * call and must not be freed, but should be cleared after usage. If NULL is
+ * returned, it's most likely that the other party disconnected.
+ */
+char* ipc_receive(struct connection* con, size_t* msg_len) {
+  int _sock = *(con->msgsock);
+  if(con->broken) {
+    oidc_errno = OIDC_EIPCDIS;
+    return NULL;
+  }
+  ssize_t len = ipc_peekLength(_sock);
+  if(len <= 0) {
+    if(len < 0) {
+      syslog(LOG_AUTHPRIV|LOG_ERR, "recv: %m");
+    } else {
+      syslog(LOG_AUTHPRIV|LOG_DEBUG, "Client disconnected");
+    }
+    oidc_errno = OIDC_EIPCDIS;
+    return NULL;
+  }
+  if((size_t) len >= con->buf_size) {
+    size_t size = con->buf_size ? con->buf_size : IPC_MIN_BUFFER;
+    while((size_t) len >= size) {
+      size *= 2;
+    }
+    char* buf = malloc(size);
+    if(buf==NULL) {
+      syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+      oidc_errno = OIDC_EALLOC;
       return NULL;
-    } else if (rv == 0) {
-      // timeout can not happen with infinite timeout
     }
-    oidc_errno = OIDC_EERROR;
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "receive buffer of socket %d grown to %lu bytes", _sock, (unsigned long) size);
+    clearFree(con->buf, con->buf_size);
+    con->buf = buf;
+    con->buf_size = size;
+  }
+  do {
+    len = recv(_sock, con->buf, con->buf_size - 1, 0);
+  } while(len < 0 && errno == EINTR);
+  if(len <= 0) {
+    oidc_errno = OIDC_EIPCDIS;
     return NULL;
   }
+  con->buf[len] = '\0';
+  *msg_len = len;
+  con->messages++;
+  con->last_active = time(NULL);
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "ipc read %lu bytes from socket %d", (unsigned long) len, _sock);
+  return con->buf;
+}
+
+/** @fn void ipc_setResponseContext(struct connection* con, const char* id)
+ * @brief sets the request the calling thread answers, until it is reset with
+ * NULL. Its id is echoed in all json objects written and responses are
+ * written in the protocol of its connection, without blocking if the
+ * client does not read them.
+ * @param con the connection the request was read from
+ * @param id the request id as read from the request. For json it is the json
+ * token of the id, e.g. a number or a string with its quotes, and echoed
+ * unchanged; see \f json_viewToken. For the binary protocol it is the value.
+ * The pointer is not copied and has to stay valid until it is reset.
+ */
+void ipc_setResponseContext(struct connection* con, const char* id) {
+  response_con = con;
+  response_id = id;
+  response_protocol = con ? con->protocol : IPC_PROTOCOL_JSON;
+}
+
+/** @fn oidc_error_t ipc_writeVector(int _sock, const struct iovec* iov, int iovcnt)
+ * @brief writes a message given as fragments to a socket or pipe. The
+ * fragments are sent at once, so they form a single message and do not have
+ * to be copied into one buffer first.
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t ipc_writeVector(int _sock, const struct iovec* iov, int iovcnt) {
+  size_t len = 0;
+  int i;
+  for(i=0; i<iovcnt; i++) {
+    len += iov[i].iov_len;
+  }
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "ipc writing %lu bytes in %d fragments to socket %d\n", (unsigned long) len, iovcnt, _sock);
+  if(response_con && response_con->msgsock && *(response_con->msgsock) == _sock) {
+    return ipc_writeConnection(response_con, iov, iovcnt, len);
+  }
+  struct msghdr msg = { .msg_iov = (struct iovec*) iov, .msg_iovlen = iovcnt };
+  // MSG_NOSIGNAL: a client that went away must not kill the writer
+  ssize_t written = sendmsg(_sock, &msg, MSG_NOSIGNAL);
+  if(written < 0 && errno == ENOTSOCK) { // pipes
+    written = writev(_sock, iov, iovcnt);
+  }
+  if(written < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "writing on stream socket: %m");
+    oidc_errno = OIDC_EWRITE;
+    return oidc_errno;
+  }
+  return OIDC_SUCCESS;
+}
+
+/** @fn oidc_error_t ipc_writeMessage(int _sock, const char* msg, size_t len)
+ * @brief writes a complete message to a socket or pipe
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t ipc_writeMessage(int _sock, const char* msg, size_t len) {
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "ipc write %s\n",msg);
+  struct iovec iov = { .iov_base = (void*) msg, .iov_len = len };
+  return ipc_writeVector(_sock, &iov, 1);
 }
 
 /** @fn int ipc_write(int _sock, char* msg)
@@ -317,42 +1097,258 @@ char* ipc_read(int _sock) {
  * @return 0 on success; -1 on failure
  */
 oidc_error_t ipc_write(int _sock, char* fmt, ...) {
-  va_list args, original;
-  va_start(original, fmt);
+  va_list args;
   va_start(args, fmt);
-  char* msg = calloc(sizeof(char), vsnprintf(NULL, 0, fmt, args)+1);
-  vsprintf(msg, fmt, original);
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "ipc writing to socket %d\n",_sock);
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "ipc write %s\n",msg);
-  if(write(_sock, msg, strlen(msg)) < 0) {
-    syslog(LOG_AUTHPRIV|LOG_ALERT, "writing on stream socket: %m");
-    clearFreeString(msg);
-    oidc_errno = OIDC_EWRITE;
-    return oidc_errno;
-  }
-  clearFreeString(msg);
-  return OIDC_SUCCESS;
+  oidc_error_t e = ipc_vwrite(_sock, fmt, args);
+  va_end(args);
+  return e;
 }
 
 oidc_error_t ipc_vwrite(int _sock, char* fmt, va_list args) {
+  // short messages are formatted once on the stack and written from there;
+  // only longer ones are formatted a second time into a buffer of the right
+  // size
+  char buf[1024];
   va_list original;
   va_copy(original, args);
-  char* msg = calloc(sizeof(char), vsnprintf(NULL, 0, fmt, args)+1);
-  vsprintf(msg, fmt, original);
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "ipc writing to socket %d\n",_sock);
+  int len = vsnprintf(buf, sizeof(buf), fmt, args);
+  if(len<0) {
+    va_end(original);
+    oidc_errno = OIDC_EERROR;
+    return oidc_errno;
+  }
+  char* msg = buf;
+  if((size_t) len >= sizeof(buf)) {
+    msg = calloc(sizeof(char), len+1);
+    if(msg==NULL) {
+      va_end(original);
+      syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+      oidc_errno = OIDC_EALLOC;
+      return oidc_errno;
+    }
+    vsnprintf(msg, len+1, fmt, original);
+  }
+  va_end(original);
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "ipc write %s\n",msg);
-  if(write(_sock, msg, strlen(msg)) < 0) {
-    syslog(LOG_AUTHPRIV|LOG_ALERT, "writing on stream socket: %m");
-    clearFreeString(msg);
-    oidc_errno = OIDC_EWRITE;
+  // the response id is inserted as first member of a json object
+  struct iovec iov[5];
+  int n = 0;
+  if(isValid(response_id) && msg[0]=='{') {
+    iov[n++] = (struct iovec) { "{\n\"" IPC_KEY_REQUESTID "\":", strlen("{\n\"" IPC_KEY_REQUESTID "\":") };
+    iov[n++] = (struct iovec) { (void*) response_id, strlen(response_id) };
+    iov[n++] = (struct iovec) { ",", 1 };
+    iov[n++] = (struct iovec) { msg+1, len-1 };
+  } else {
+    iov[n++] = (struct iovec) { msg, len };
+  }
+  oidc_error_t e = ipc_writeVector(_sock, iov, n);
+  if(msg==buf) {
+    memset(buf, 0, sizeof(buf));
+  } else {
+    clearFree(msg, len);
+  }
+  return e;
+}
+
+/** @fn void ipc_beginResponse(struct json_writer* w, const char* status)
+ * @brief starts a response object with the current response id and the
+ * status; see \f ipc_setResponseContext
+ * @param w an uninitialized writer; the members of the response are added to
+ * it and it is passed to \f ipc_writeResponse
+ */
+void ipc_beginResponse(struct json_writer* w, const char* status) {
+  if(response_protocol==IPC_PROTOCOL_TLV) {
+    jsonwriter_initBinary(w, tlv_fieldId);
+  } else {
+    jsonwriter_init(w);
+  }
+  jsonwriter_beginObject(w);
+  if(isValid(response_id)) {
+    jsonwriter_key(w, IPC_KEY_REQUESTID);
+    if(response_protocol==IPC_PROTOCOL_TLV) {
+      jsonwriter_string(w, response_id);
+    } else {
+      jsonwriter_raw(w, response_id); // the json token of the request
+    }
+  }
+  jsonwriter_addString(w, "status", status);
+}
+
+/** @fn oidc_error_t ipc_writeResponse(int _sock, struct json_writer* w)
+ * @brief closes a response started with \f ipc_beginResponse and writes it
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t ipc_writeResponse(int _sock, struct json_writer* w) {
+  jsonwriter_endObject(w);
+  size_t len = w->len;
+  char* msg = jsonwriter_finish(w);
+  if(msg==NULL) {
     return oidc_errno;
   }
+  oidc_error_t e = ipc_writeMessage(_sock, msg, len);
+  clearFree(msg, len);
+  return e;
+}
+
+oidc_error_t ipc_writeStatus(int sock, const char* status) {
+  struct json_writer w;
+  ipc_beginResponse(&w, status);
+  return ipc_writeResponse(sock, &w);
+}
+
+oidc_error_t ipc_writeError(int sock, const char* error) {
+  struct json_writer w;
+  ipc_beginResponse(&w, STATUS_FAILURE);
+  jsonwriter_addString(&w, "error", error);
+  return ipc_writeResponse(sock, &w);
+}
+
+oidc_error_t ipc_writeBadRequest(int sock, const char* error) {
+  char* msg = oidc_sprintf("Bad Request: %s", error);
+  oidc_error_t e = ipc_writeError(sock, msg);
   clearFreeString(msg);
-  return OIDC_SUCCESS;
+  return e;
+}
+
+/** @fn oidc_error_t ipc_writeBusy(int sock, time_t retry_after)
+ * @brief answers a request the agent does not accept because of its load
+ * @param retry_after the seconds the client should wait before trying again
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t ipc_writeBusy(int sock, time_t retry_after) {
+  struct json_writer w;
+  ipc_beginResponse(&w, STATUS_BUSY);
+  jsonwriter_addString(&w, "error", "The agent is busy. Please try again later.");
+  jsonwriter_addUnsigned(&w, "retry_after", (unsigned long) retry_after);
+  return ipc_writeResponse(sock, &w);
 }
 
 oidc_error_t ipc_writeOidcErrno(int sock) {
-  return ipc_write(sock, RESPONSE_ERROR, oidc_serror());
+  return ipc_writeError(sock, oidc_serror());
+}
+
+/** @fn int needsEscaping(const char* str)
+ * @return 1 if \p str cannot be put between quotes in json as it is
+ */
+static int needsEscaping(const char* str) {
+  const char* c;
+  for(c=str; *c; c++) {
+    if(*c=='"' || *c=='\\' || (unsigned char) *c < 0x20) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** @fn void addField(struct iovec* iov, int* n, char* header, const char* key, const char* value, size_t len)
+ * @brief adds a binary field to a message given as fragments
+ * @param header room for the header of the field
+ */
+static void addField(struct iovec* iov, int* n, char* header, const char* key, const char* value, size_t len) {
+  uint32_t nlen = htonl(len);
+  header[0] = tlv_fieldId(key);
+  memcpy(header+1, &nlen, sizeof(nlen));
+  iov[(*n)++] = (struct iovec) { header, TLV_HEADER_LEN };
+  iov[(*n)++] = (struct iovec) { (void*) value, len };
+}
+
+/** @fn oidc_error_t ipc_writeToken(int sock, const char* access_token)
+ * @brief writes the success response to a token request. This is the most
+ * frequent response, so it is written from constant fragments and the
+ * token itself without building the message in a buffer.
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t ipc_writeToken(int sock, const char* access_token) {
+  struct iovec iov[IPC_MAX_FRAGMENTS];
+  int n = 0;
+  int hasId = isValid(response_id);
+  if(response_protocol==IPC_PROTOCOL_TLV) {
+    char headers[3][TLV_HEADER_LEN];
+    if(hasId) {
+      addField(iov, &n, headers[0], IPC_KEY_REQUESTID, response_id, strlen(response_id));
+    }
+    addField(iov, &n, headers[1], "status", STATUS_SUCCESS, strlen(STATUS_SUCCESS));
+    addField(iov, &n, headers[2], "access_token", access_token, strlen(access_token));
+    return ipc_writeVector(sock, iov, n);
+  }
+  if(needsEscaping(access_token)) {
+    struct json_writer w;
+    ipc_beginResponse(&w, STATUS_SUCCESS);
+    jsonwriter_addString(&w, "access_token", access_token);
+    return ipc_writeResponse(sock, &w);
+  }
+  static const char id_key[] = "{\"" IPC_KEY_REQUESTID "\":";
+  static const char status[] = "\"status\":\"" STATUS_SUCCESS "\",\"access_token\":\"";
+  static const char end[] = "\"}";
+  if(hasId) {
+    iov[n++] = (struct iovec) { (void*) id_key, strlen(id_key) };
+    iov[n++] = (struct iovec) { (void*) response_id, strlen(response_id) };
+    iov[n++] = (struct iovec) { ",", 1 };
+  } else {
+    iov[n++] = (struct iovec) { "{", 1 };
+  }
+  iov[n++] = (struct iovec) { (void*) status, strlen(status) };
+  iov[n++] = (struct iovec) { (void*) access_token, strlen(access_token) };
+  iov[n++] = (struct iovec) { (void*) end, strlen(end) };
+  return ipc_writeVector(sock, iov, n);
+}
+
+/** @fn int ipc_negotiate(struct connection* con, const char* msg, size_t len)
+ * @brief answers a protocol request of a client, i.e. a message consisting
+ * of the single byte protocol version the client wants to use. The highest
+ * version supported by both is used for all further messages on \p con.
+ * @return 1 if \p msg was a protocol request; 0 if it is a normal request
+ */
+int ipc_negotiate(struct connection* con, const char* msg, size_t len) {
+  if(len!=1 || msg[0]=='{') {
+    return 0;
+  }
+  unsigned char version = msg[0];
+  con->protocol = version>=IPC_PROTOCOL_TLV ? IPC_PROTOCOL_TLV : IPC_PROTOCOL_JSON;
+  char answer = con->protocol;
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Using protocol %d for socket %d", con->protocol, *(con->msgsock));
+  struct iovec iov = { .iov_base = &answer, .iov_len = 1 };
+  ipc_writeConnection(con, &iov, 1, 1);
+  return 1;
+}
+
+/** @fn int ipc_requestProtocol(int _sock, int protocol, char** reply,
+ * size_t* reply_len)
+ * @brief asks the agent to use a binary protocol on a connection. Agents
+ * that do not know protocol requests answer with a json error and might
+ * close the connection, so it must not be used any further in that case.
+ * The same applies if the agent rejected the connection as busy.
+ * @param protocol the highest protocol version the client supports
+ * @param reply if not NULL and the agent did not answer with a protocol, set
+ * to its json answer. Has to be freed after usage.
+ * @param reply_len set to the length of \p reply
+ * @return the protocol to be used, IPC_PROTOCOL_UNSUPPORTED if the agent
+ * does not know protocol requests or -1 if the agent did not answer
+ */
+int ipc_requestProtocol(int _sock, int protocol, char** reply, size_t* reply_len) {
+  char version = protocol;
+  // a rejected connection is answered with busy and closed by the agent
+  // right away, so the answer is read even if the request cannot be written
+  if(ipc_writeMessage(_sock, &version, 1)!=OIDC_SUCCESS && errno!=EPIPE) {
+    return -1;
+  }
+  size_t len = 0;
+  char* answer = ipc_readMessage(_sock, &len);
+  if(answer==NULL) {
+    return -1;
+  }
+  if(len!=1) {
+    if(reply) {
+      *reply = answer;
+      *reply_len = len;
+    } else {
+      clearFree(answer, len);
+    }
+    return IPC_PROTOCOL_UNSUPPORTED;
+  }
+  int agreed = answer[0]<=protocol ? answer[0] : IPC_PROTOCOL_JSON;
+  clearFree(answer, len);
+  return agreed;
 }
 
 /** @fn int ipc_close(struct connection con)
@@ -371,6 +1367,7 @@ oidc_error_t ipc_close(struct connection* con) {
   clearFree(con->server, sizeof(*(con->server))); con->server = NULL;
   clearFree(con->sock, sizeof(*(con->sock))); con->sock = NULL;
   clearFree(con->msgsock, sizeof(*(con->msgsock))); con->msgsock = NULL;
+  clearFree(con->buf, con->buf_size); con->buf = NULL; con->buf_size = 0;
   return OIDC_SUCCESS;
 }
 
@@ -388,108 +1385,94 @@ oidc_error_t ipc_closeAndUnlink(struct connection* con) {
 
 
 
-/** @fn struct connection* addConnection(struct connection* cons, size_t* size,
- * struct connection client)
- * @brief adds a connection to an array of connections
- * @param cons a pointer to the start of an array of connections
- * @param size a pointer to the number of elements in the array
+/** @fn list_t* newConnectionList()
+ * @brief creates an empty list for client connections
+ * @return a pointer to the new list. Has to be freed after usage using
+ * list_destroy, which also closes all connections.
+ */
+list_t* newConnectionList() {
+  list_t* cons = list_new();
+  cons->free = (void(*) (void*)) &clearFreeConnection;
+  cons->match = (int(*) (void*, void*)) &matchConnection;
+  return cons;
+}
+
+/** @fn struct connection* addConnection(list_t* cons, struct connection
+ * client)
+ * @brief adds a connection to a list of connections
+ * @param cons the list of connections
  * @param client the connection to be added
- * @return a pointer to the new array
+ * @return a pointer to the added connection. The pointer stays valid until
+ * the connection is removed.
  */
-struct connection* addConnection(struct connection* cons, size_t* size, struct connection client) {
-  void* tmp = realloc(cons, sizeof(struct connection) * (*size + 1));
-  if(tmp==NULL) {
-    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) realloc() failed: %m\n", __func__, __FILE__, __LINE__);
+struct connection* addConnection(list_t* cons, struct connection client) {
+  struct connection* con = calloc(sizeof(struct connection), 1);
+  if(con==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
     oidc_errno = OIDC_EALLOC;
     return NULL;
   }
-  cons = tmp;
-  memcpy(cons + *size, &client, sizeof(struct connection));
-  (*size)++;
-  // For some reason using the following function insted of the above same
-  // statements doesn't work.
-  // p= arr_addElement(p, size, sizeof(struct oidc_account), &account);    
-  return cons;    
-}
-
-/** @fn int connection_comparator(const void* v1, const void* v2)
- * @brief compares two connections by their msgsock. Can be used for sorting.
- * @param v1 pointer to the first element
- * @param v2 pointer to the second element
- * @return -1 if v1<v2; 1 if v1>v2; 0 if v1=v2
- */
-int connection_comparator(const void *v1, const void *v2) {
-  const struct connection *c1 = (struct connection *)v1;
-  const struct connection *c2 = (struct connection *)v2;
-  if(c1->msgsock == NULL && c2->msgsock == NULL) {
-    return 0;
-  }
-  if(c1->msgsock == NULL && c2->msgsock !=NULL) {
-    return -1;
-  }
-  if(c1->msgsock != NULL && c2->msgsock ==NULL) {
-    return 1;
-  }
-  if(*(c1->msgsock) == *(c2->msgsock)) {
-    return 0;
-  }
-  if(*(c1->msgsock) <= *(c2->msgsock)) {
-    return -1;
-  }
-  if(*(c1->msgsock) >= *(c2->msgsock)) {
-    return 1;
-  }
-  return -2;
+  memcpy(con, &client, sizeof(struct connection));
+  pthread_mutex_init(&con->output_mutex, NULL);
+  con->node = list_rpush(cons, list_node_new(con));
+  return con;    
 }
 
-/** @fn struct connection* sortConnections()
- * @brief sorts connections  using \f connection_comparator
- * @param cons the array to be sorted
- * @param size the nubmer of elements in cons
- * @return the sorted array
+/** @fn int matchConnection(struct connection* key, struct connection* con)
+ * @brief compares two connections by their msgsock. Can be used as match
+ * function of a list.
+ * @param key pointer to the first element
+ * @param con pointer to the second element
+ * @return 1 if both connections use the same msgsock; 0 if not
  */
-struct connection* sortConnections(struct connection* cons, size_t size) {
-  return arr_sort(cons, size, sizeof(struct connection), connection_comparator);
+int matchConnection(struct connection* key, struct connection* con) {
+  if(key->msgsock == NULL || con->msgsock == NULL) {
+    return key->msgsock == con->msgsock;
+  }
+  return *(key->msgsock) == *(con->msgsock);
 }
 
-/** @fn struct connection* findConnection(struct connection* cons, size_t size,
- * struct connection key)
+/** @fn struct connection* findConnection(list_t* cons, struct connection key)
  * @brief finds a connection socket.
- * @param cons the connection array that should be searched
- * @param size the number of connections in cons
+ * @param cons the connection list that should be searched
  * @param key the connection to be find. only the msgsock will be compared.
  * @return a pointer to the found connection. If no connection could be found
  * NULL is returned.
  */
-struct connection* findConnection(struct connection* cons, size_t size, struct connection key) {
-  return arr_find(cons, size, sizeof(struct connection), &key, connection_comparator);
+struct connection* findConnection(list_t* cons, struct connection key) {
+  list_node_t* node = list_find(cons, &key);
+  return node ? node->val : NULL;
 }
 
-/** @fn struct connection* removeConnection(struct connection* cons, size_t*
- * size, struct connection* key)
- * @brief removes a connection from an array of connections, and closes the
+/** @fn void removeConnection(list_t* cons, struct connection* key)
+ * @brief removes a connection from a list of connections, and closes the
  * connection
- * @param cons a pointer to the start of an array of connections
- * @param size a pointer to the number of elements in the array
- * @param key the connection to be removed
- * @return a pointer to the new array
+ * @param cons the list of connections
+ * @param key the connection to be removed, as returned by \f addConnection
+ * or \f ipc_async
  */
-struct connection* removeConnection(struct connection* cons, size_t* size, struct connection* key) {
+void removeConnection(list_t* cons, struct connection* key) {
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "key sock is %d", *(key->msgsock));
-  struct connection* pos = findConnection(cons, *size, *key);
-  if(NULL==pos) {
-    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Did not find key");
-    return cons;
-  }
-  ipc_close(key);
-  memmove(pos, cons + *size - 1, sizeof(struct connection));
-  (*size)--;
-  void* tmp = realloc(cons, sizeof(struct connection) * (*size));
-  if(tmp==NULL && *size>0) {
-    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) realloc() failed: %m\n", __func__, __FILE__, __LINE__);
-    oidc_errno = OIDC_EALLOC;
-    return NULL;
+  // closing the socket does not remove it from epoll if another process,
+  // e.g. the httpserver, still has a copy of it; paused connections are not
+  // registered
+  if(epoll_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *(key->msgsock), NULL) < 0 && errno != ENOENT) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "epoll_ctl on client socket: %m");
   }
-  cons = tmp;
-  return cons;
+  ipc_dropPendingEvents(&key->watch);
+  list_remove(cons, key->node); // closes the socket
+}
+
+/** @fn void clearFreeConnection(struct connection* con)
+ * @brief closes a client connection and frees it
+ * @param con the connection to be freed
+ */
+void clearFreeConnection(struct connection* con) {
+  if(con==NULL) {
+    return;
+  }
+  ipc_close(con);
+  clearOutput(con);
+  pthread_mutex_destroy(&con->output_mutex);
+  clearFree(con, sizeof(struct connection));
 }
@@ -3,31 +3,97 @@
 
 #include "oidc_error.h"
 #include "ipc_values.h"
+#include "json_writer.h"
 
+#include "../lib/list/src/list.h"
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include <stdarg.h>
+#include <sys/uio.h>
+
+struct ipc_watch {
+  int fd;
+  void (*callback)(int fd, void* arg); // NULL for client connections
+  void* arg;
+};
+
+struct ipc_output;
 
 struct connection {
   int* sock;
   int* msgsock;
   struct sockaddr_un* server;
+  list_node_t* node; // position in the agent's client list; only used by the server
+  struct ipc_watch watch; // epoll registration; only used by the server
+  unsigned int pending; // requests handled by other threads; only used by the server
+  int closing; // the client disconnected, close when pending reaches 0; only used by the server
+  int protocol; // IPC_PROTOCOL_JSON or the negotiated IPC_PROTOCOL_TLV
+  char* buf; // receive buffer; only used by the server
+  size_t buf_size;
+  time_t last_active; // when the client connected or its last request was answered; only used by the server
+  unsigned long messages; // number of messages read; only used by the server
+  uid_t uid; // of the client process; only used by the server
+  pthread_mutex_t output_mutex; // for the following members; only used by the server
+  struct ipc_output* output; // responses the client did not read yet, oldest first; only used by the server
+  struct ipc_output* output_tail;
+  size_t output_len; // bytes in the output queue
+  int paused; // not registered with epoll; only used by the server
+  int broken; // the client did not read its responses and the connection is shut down; only used by the server
+};
+
+struct ipc_stats {
+  unsigned long read_timeouts; // connections closed because the client did not send a request
+  unsigned long idle_timeouts; // connections closed because the client did not use them anymore
+  unsigned long max_queue_delay; // longest time in microseconds a readable client waited to be served
+  unsigned long rejected_connections; // connections answered with busy and closed right away
+  unsigned long slow_clients; // connections closed because the client did not read its responses
+  unsigned long rejected_requests; // requests answered with busy because too many were queued
 };
 
 char* init_socket_path(const char* env_var_name) ;
 oidc_error_t ipc_init(struct connection* con, const char* env_var_name, int isServer) ;
 oidc_error_t ipc_initWithPath(struct connection* con) ;
-int ipc_bindAndListen(struct connection* con) ;
-struct connection* ipc_async(struct connection listencon, struct connection** clientcons_addr, size_t* size) ;
+int ipc_bindAndListen(struct connection* con, int backlog) ;
+struct connection* ipc_async(struct connection listencon, list_t* clientcons) ;
+struct ipc_watch* ipc_addWatch(int fd, void (*callback)(int fd, void* arg), void* arg) ;
+void ipc_removeWatch(struct ipc_watch* watch) ;
+oidc_error_t ipc_setWatchEvents(struct ipc_watch* watch, int readable, int writable) ;
+oidc_error_t ipc_pauseConnection(struct connection* con) ;
+oidc_error_t ipc_resumeConnection(struct connection* con) ;
+oidc_error_t ipc_setTimeouts(list_t* clientcons, time_t read_timeout, time_t idle_timeout) ;
+void ipc_setConnectionLimit(size_t max_connections) ;
+struct ipc_stats ipc_getStats() ;
+unsigned long ipc_countRejectedRequest() ;
+oidc_error_t ipc_logStatsPeriodically(time_t interval) ;
 int ipc_connect(struct connection con) ;
 char* ipc_read(int _sock);
+char* ipc_readMessage(int _sock, size_t* msg_len) ;
+char* ipc_receive(struct connection* con, size_t* msg_len) ;
+void ipc_setResponseContext(struct connection* con, const char* id) ;
 oidc_error_t ipc_write(int _sock, char* msg, ...);
 oidc_error_t ipc_vwrite(int _sock, char* msg, va_list args);
+oidc_error_t ipc_writeMessage(int _sock, const char* msg, size_t len) ;
+oidc_error_t ipc_writeVector(int _sock, const struct iovec* iov, int iovcnt) ;
 oidc_error_t ipc_writeOidcErrno(int sock) ;
+oidc_error_t ipc_writeToken(int sock, const char* access_token) ;
+void ipc_beginResponse(struct json_writer* w, const char* status) ;
+oidc_error_t ipc_writeResponse(int _sock, struct json_writer* w) ;
+oidc_error_t ipc_writeStatus(int sock, const char* status) ;
+oidc_error_t ipc_writeError(int sock, const char* error) ;
+oidc_error_t ipc_writeBadRequest(int sock, const char* error) ;
+oidc_error_t ipc_writeBusy(int sock, time_t retry_after) ;
+int ipc_negotiate(struct connection* con, const char* msg, size_t len) ;
+int ipc_requestProtocol(int _sock, int protocol, char** reply, size_t* reply_len) ;
 oidc_error_t ipc_close(struct connection* con);
 oidc_error_t ipc_closeAndUnlink(struct connection* con);
 
-struct connection* addConnection(struct connection* cons, size_t* size, struct connection client) ;
-struct connection* findConnection(struct connection* cons, size_t size, struct connection key) ;
-struct connection* removeConnection(struct connection* cons, size_t* size, struct connection* key) ;
+list_t* newConnectionList() ;
+struct connection* addConnection(list_t* cons, struct connection client) ;
+struct connection* findConnection(list_t* cons, struct connection key) ;
+void removeConnection(list_t* cons, struct connection* key) ;
+void clearFreeConnection(struct connection* con) ;
 
 static char* server_socket_path = NULL;
 
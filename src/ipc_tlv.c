@@ -0,0 +1,195 @@
+#include "ipc_tlv.h"
+#include "ipc_values.h"
+#include "oidc_error.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+
+struct tlv_field {
+  const char* name;
+  int json; // the value is json encoded, not a string
+};
+
+/* indexed by field id - 1. Ids are part of the protocol, so new fields are
+ * only appended. */
+static const struct tlv_field fields[] = {
+  {"request", 0},
+  {"account", 0},
+  {"min_valid_period", 1},
+  {"scope", 0},
+  {IPC_KEY_REQUESTID, 0},
+  {IPC_KEY_TOKENS, 1},
+  {"config", 1},
+  {"flow", 1},
+  {"code", 0},
+  {"redirect_uri", 0},
+  {"state", 0},
+  {"authorization", 0},
+  {"oidc_device", 1},
+  {"status", 0},
+  {"error", 0},
+  {"info", 0},
+  {"access_token", 0},
+  {"expires_in", 1},
+  {"retry_after", 1},
+  {"account_list", 1},
+  {"uri", 0},
+  {"client", 1},
+};
+
+#define TLV_FIELD_COUNT (sizeof(fields)/sizeof(*fields))
+
+/** @fn int tlv_fieldId(const char* key)
+ * @return the field id of a key or -1 if there is none
+ */
+int tlv_fieldId(const char* key) {
+  size_t i;
+  for(i=0; i<TLV_FIELD_COUNT; i++) {
+    if(strcmp(fields[i].name, key)==0) {
+      return i+1;
+    }
+  }
+  return -1;
+}
+
+/** @fn const char* tlv_fieldName(unsigned char id)
+ * @return the key of a field id or NULL if the id is unknown
+ */
+const char* tlv_fieldName(unsigned char id) {
+  return id>0 && id<=TLV_FIELD_COUNT ? fields[id-1].name : NULL;
+}
+
+/** @fn int tlv_isJSON(const char* key)
+ * @return 1 if the value of \p key is json encoded; 0 if it is a string
+ */
+int tlv_isJSON(const char* key) {
+  int id = tlv_fieldId(key);
+  return id>0 && fields[id-1].json;
+}
+
+/** @fn char* tlv_encode(const struct key_value* pairs, size_t size, size_t* len)
+ * @brief encodes key value pairs as binary message. Pairs without a value
+ * are skipped.
+ * @param len is set to the length of the message
+ * @return a pointer to the message. Has to be freed after usage. On failure
+ * NULL is returned and oidc_errno is set.
+ */
+char* tlv_encode(const struct key_value* pairs, size_t size, size_t* len) {
+  size_t total = 0;
+  size_t i;
+  for(i=0; i<size; i++) {
+    if(pairs[i].value==NULL) {
+      continue;
+    }
+    if(tlv_fieldId(pairs[i].key)<0) {
+      syslog(LOG_AUTHPRIV|LOG_ERR, "%s: no field id for key '%s'", __func__, pairs[i].key);
+      oidc_errno = OIDC_ETLV;
+      return NULL;
+    }
+    total += TLV_HEADER_LEN + strlen(pairs[i].value);
+  }
+  char* msg = calloc(sizeof(char), total+1);
+  if(msg==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
+  char* pos = msg;
+  for(i=0; i<size; i++) {
+    if(pairs[i].value==NULL) {
+      continue;
+    }
+    uint32_t vlen = strlen(pairs[i].value);
+    uint32_t nlen = htonl(vlen);
+    *pos = tlv_fieldId(pairs[i].key);
+    memcpy(pos+1, &nlen, sizeof(nlen));
+    memcpy(pos+TLV_HEADER_LEN, pairs[i].value, vlen);
+    pos += TLV_HEADER_LEN + vlen;
+  }
+  *len = total;
+  return msg;
+}
+
+/** @fn int tlv_getViews(const char* msg, size_t len, struct key_view* pairs, size_t size)
+ * @brief gets multiple values from a binary message without copying them,
+ * the counterpart of \f getJSONViews. Keys that are not in the message get
+ * a view without data; unknown fields are ignored and if a field occurs more
+ * than once, the first one is used.
+ * @return the number of requested values or -1 on failure
+ */
+int tlv_getViews(const char* msg, size_t len, struct key_view* pairs, size_t size) {
+  if(msg==NULL || pairs==NULL) {
+    oidc_setArgNullFuncError(__func__);
+    return oidc_errno;
+  }
+  size_t i;
+  for(i=0; i<size; i++) {
+    pairs[i].value.data = NULL;
+    pairs[i].value.len = 0;
+    pairs[i].value.string = 0; // values are not escaped
+  }
+  size_t pos = 0;
+  while(pos < len) {
+    uint32_t nlen;
+    if(len - pos < TLV_HEADER_LEN) {
+      break;
+    }
+    memcpy(&nlen, msg+pos+1, sizeof(nlen));
+    size_t vlen = ntohl(nlen);
+    if(len - pos - TLV_HEADER_LEN < vlen) {
+      break;
+    }
+    const char* name = tlv_fieldName(msg[pos]);
+    const char* value = msg + pos + TLV_HEADER_LEN;
+    pos += TLV_HEADER_LEN + vlen;
+    if(name==NULL || memchr(value, '\0', vlen)) {
+      continue;
+    }
+    for(i=0; i<size; i++) {
+      if(pairs[i].value.data==NULL && strcmp(pairs[i].key, name)==0) {
+        pairs[i].value.data = value;
+        pairs[i].value.len = vlen;
+        break;
+      }
+    }
+  }
+  if(pos != len) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "%s: message truncated", __func__);
+    oidc_errno = OIDC_ETLV;
+    return oidc_errno;
+  }
+  return size;
+}
+
+/** @fn int tlv_getValues(const char* msg, size_t len, struct key_value* pairs, size_t size)
+ * @brief gets multiple values from a binary message, the counterpart of
+ * \f getJSONValues
+ * @return the number of requested values or -1 on failure
+ */
+int tlv_getValues(const char* msg, size_t len, struct key_value* pairs, size_t size) {
+  if(pairs==NULL) {
+    oidc_setArgNullFuncError(__func__);
+    return oidc_errno;
+  }
+  struct key_view views[JSON_MAX_KEYS];
+  if(size > JSON_MAX_KEYS) {
+    oidc_seterror("Too many keys requested");
+    oidc_errno = OIDC_EERROR;
+    return oidc_errno;
+  }
+  size_t i;
+  for(i=0; i<size; i++) {
+    views[i].key = pairs[i].key;
+  }
+  int e = tlv_getViews(msg, len, views, size);
+  if(e<0) {
+    return e;
+  }
+  for(i=0; i<size; i++) {
+    pairs[i].value = json_viewCopy(views[i].value);
+  }
+  return size;
+}
@@ -0,0 +1,24 @@
+#ifndef IPC_TLV_H
+#define IPC_TLV_H
+
+#include "json.h"
+
+#include <stddef.h>
+
+/* The binary framing of the ipc protocol. A message is a sequence of fields,
+ * each consisting of a one byte field id, the length of the value as 4 byte
+ * unsigned integer in network byte order and the value itself. Field ids
+ * correspond to the top level keys of the json messages; string values are
+ * sent as they are, all others json encoded. Field ids are below '{', so a
+ * message can always be told apart from a json object. */
+
+#define TLV_HEADER_LEN 5
+
+int tlv_fieldId(const char* key) ;
+const char* tlv_fieldName(unsigned char id) ;
+int tlv_isJSON(const char* key) ;
+char* tlv_encode(const struct key_value* pairs, size_t size, size_t* len) ;
+int tlv_getViews(const char* msg, size_t len, struct key_view* pairs, size_t size) ;
+int tlv_getValues(const char* msg, size_t len, struct key_value* pairs, size_t size) ;
+
+#endif // IPC_TLV_H
@@ -6,6 +6,17 @@
 #define STATUS_FAILURE "failure"
 #define STATUS_ACCEPTED "accepted"
 #define STATUS_NOTFOUND "NotFound"
+#define STATUS_BUSY "busy"
+
+//KEYS
+#define IPC_KEY_REQUESTID "request_id"
+#define IPC_KEY_TOKENS "tokens"
+
+//PROTOCOLS; a client requests the binary protocol by sending its version as
+//single byte message, the agent answers with the version it uses
+#define IPC_PROTOCOL_JSON 0
+#define IPC_PROTOCOL_TLV 1
+#define IPC_PROTOCOL_UNSUPPORTED -2 // the agent does not know protocol requests
 
 //REQUEST VALUES
 #define REQUEST_VALUE_ADD "add"
@@ -17,6 +28,7 @@
 #define REQUEST_VALUE_STATELOOKUP "state_lookup"
 #define REQUEST_VALUE_DEVICELOOKUP "device"
 #define REQUEST_VALUE_ACCESSTOKEN "access_token"
+#define REQUEST_VALUE_ACCESSTOKENBATCH "access_token_batch"
 #define REQUEST_VALUE_ACCOUNTLIST "account_list"
 
 //FLOW VALUES
@@ -25,22 +37,6 @@
 #define FLOW_VALUE_DEVICE "device"
 #define FLOW_VALUE_REFRESH "refresh"
 
-//RESPONSE TEMPLATES
-#define RESPONSE_SUCCESS_CLIENT "{\n\"status\":\""STATUS_SUCCESS"\",\n\"client\":%s\n}"
-#define RESPONSE_ERROR_CLIENT_INFO "{\n\"status\":\""STATUS_FAILURE"\",\n\"error\":\"%s\",\n\"client\":%s,\n\"info\":\"%s\"\n}"
-#define RESPONSE_STATUS_SUCCESS "{\n\"status\":\""STATUS_SUCCESS"\"\n}"
-#define RESPONSE_STATUS_CONFIG "{\n\"status\":\"%s\",\n\"config\":%s\n}"
-#define RESPONSE_STATUS_ACCESS "{\n\"status\":\"%s\",\n\"access_token\":\"%s\"\n}"
-#define RESPONSE_STATUS_ACCOUNT "{\n\"status\":\"%s\",\n\"account_list\":%s\n}"
-#define RESPONSE_STATUS_REGISTER "{\n\"status\":\"%s\",\n\"response\":%s\n}"
-#define RESPONSE_STATUS_CODEURI "{\n\"status\":\"%s\",\n\"uri\":\"%s\",\n\"state\":\"%s\"\n}"
-#define RESPONSE_STATUS_CODEURI_INFO "{\n\"status\":\"%s\",\n\"uri\":\"%s\",\n\"state\":\"%s\",\n\"info\":\"%s\"\n}"
-#define RESPONSE_ERROR "{\n\"status\":\""STATUS_FAILURE"\",\n\"error\":\"%s\"\n}"
-#define RESPONSE_ERROR_INFO "{\n\"status\":\""STATUS_FAILURE"\",\n\"error\":\"%s\",\n\"info\":\"%s\"\n}"
-#define RESPONSE_BADREQUEST "{\n\"status\":\""STATUS_FAILURE"\",\n\"error\":\"Bad Request: %s\"\n}"
-#define RESPONSE_STATUS_INFO "{\n\"status\":\"%s\",\n\"info\":\"%s\"\n}"
-#define RESPONSE_ACCEPTED_DEVICE "{\n\"status\":\""STATUS_ACCEPTED"\",\n\"oidc_device\":%s,\n\"config\":%s\n}"
-
 //REQUEST TEMPLATES
 #define REQUEST "{\n\"request\":\"%s\",\n%s\n}"
 #define REQUEST_CONFIG "{\n\"request\":\"%s\",\n\"config\":%s\n}"
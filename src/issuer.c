@@ -5,6 +5,9 @@
 #include "oidc_utilities.h"
 
 #include <syslog.h>
+#include <pthread.h>
+
+static pthread_mutex_t refcount_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void clearFreeIssuer(struct oidc_issuer* iss) {
   if(!iss) {
@@ -23,3 +26,64 @@ void clearFreeIssuer(struct oidc_issuer* iss) {
   clearFree(iss, sizeof(struct oidc_issuer));
   iss = NULL;
 }
+
+/** @fn struct oidc_issuer* copyIssuer(const struct oidc_issuer* iss)
+ * @brief creates a deep copy of an issuer
+ * @param iss the issuer to be copied
+ * @return a pointer to the copy. Has to be freed using \f clearFreeIssuer.
+ * If \p iss is NULL, NULL is returned.
+ */
+struct oidc_issuer* copyIssuer(const struct oidc_issuer* iss) {
+  if(iss==NULL) {
+    return NULL;
+  }
+  struct oidc_issuer* copy = calloc(sizeof(struct oidc_issuer), 1);
+  if(copy==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
+  issuer_setIssuerUrl(copy, oidc_strcopyIfValid(iss->issuer_url));
+  issuer_setConfigurationEndpoint(copy, oidc_strcopyIfValid(iss->configuration_endpoint));
+  issuer_setTokenEndpoint(copy, oidc_strcopyIfValid(iss->token_endpoint));
+  issuer_setAuthorizationEndpoint(copy, oidc_strcopyIfValid(iss->authorization_endpoint));
+  issuer_setRevocationEndpoint(copy, oidc_strcopyIfValid(iss->revocation_endpoint));
+  issuer_setRegistrationEndpoint(copy, oidc_strcopyIfValid(iss->registration_endpoint));
+  issuer_setDeviceAuthorizationEndpoint(copy, oidc_strcopyIfValid(iss->device_authorization_endpoint));
+  issuer_setScopesSupported(copy, oidc_strcopyIfValid(iss->scopes_supported));
+  issuer_setGrantTypesSupported(copy, oidc_strcopyIfValid(iss->grant_types_supported));
+  issuer_setResponseTypesSupported(copy, oidc_strcopyIfValid(iss->response_types_supported));
+  return copy;
+}
+
+/** @fn struct oidc_issuer* issuer_ref(struct oidc_issuer* iss)
+ * @brief takes a reference to a shared issuer record. Shared records are
+ * immutable; they are freed when the last reference is released using
+ * \f issuer_unref. Can be called from any thread.
+ * @return \p iss
+ */
+struct oidc_issuer* issuer_ref(struct oidc_issuer* iss) {
+  if(iss==NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&refcount_mutex);
+  iss->refcount++;
+  pthread_mutex_unlock(&refcount_mutex);
+  return iss;
+}
+
+/** @fn void issuer_unref(struct oidc_issuer* iss)
+ * @brief releases a reference taken with \f issuer_ref or returned by a
+ * function creating a shared record
+ */
+void issuer_unref(struct oidc_issuer* iss) {
+  if(iss==NULL) {
+    return;
+  }
+  pthread_mutex_lock(&refcount_mutex);
+  unsigned int refcount = --iss->refcount;
+  pthread_mutex_unlock(&refcount_mutex);
+  if(refcount==0) {
+    clearFreeIssuer(iss);
+  }
+}
@@ -16,9 +16,14 @@ struct oidc_issuer {
   char* scopes_supported; // space delimited
   char* grant_types_supported; // as json array
   char* response_types_supported; // as json array
+
+  unsigned int refcount; // only used for shared metadata, see issuer_ref
 };
 
 void clearFreeIssuer(struct oidc_issuer* iss) ;
+struct oidc_issuer* copyIssuer(const struct oidc_issuer* iss) ;
+struct oidc_issuer* issuer_ref(struct oidc_issuer* iss) ;
+void issuer_unref(struct oidc_issuer* iss) ;
 inline static char* issuer_getIssuerUrl(struct oidc_issuer iss) { return iss.issuer_url; };
 inline static char* issuer_getConfigEndpoint(struct oidc_issuer iss) { return iss.configuration_endpoint; };
 inline static char* issuer_getTokenEndpoint(struct oidc_issuer iss) { return iss.token_endpoint; };
@@ -1,25 +1,359 @@
 #include "json.h"
 
+#include <ctype.h>
 #include <syslog.h>
+#include <pthread.h>
 
-int JSONArrrayToArray(const char* json, char** arr) {
-  if(NULL==json) {
-    oidc_setArgNullFuncError(__func__);
-    return oidc_errno;
+/* the number of tokens the token buffer of a thread starts with */
+#define JSON_INITIAL_TOKENS 64
+
+static pthread_mutex_t keyset_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* every thread parses into its own token buffer, which is reused for all
+ * documents and grows up to JSON_MAX_TOKENS. It is freed when the thread
+ * exits. */
+static __thread jsmntok_t* token_buffer = NULL;
+static __thread size_t token_buffer_size = 0;
+static __thread struct json_stats stats = { 0, 0 };
+static pthread_key_t token_buffer_key;
+static pthread_once_t token_buffer_key_once = PTHREAD_ONCE_INIT;
+
+static void createTokenBufferKey() {
+  pthread_key_create(&token_buffer_key, free);
+}
+
+/** @fn int growTokenBuffer()
+ * @brief doubles the token buffer of the calling thread, the tokens are kept
+ * @return 0 on success; -1 if the buffer is already at its limit or the
+ * allocation failed
+ */
+static int growTokenBuffer() {
+  size_t size = token_buffer_size ? token_buffer_size * 2 : JSON_INITIAL_TOKENS;
+  if(size > JSON_MAX_TOKENS) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "JSON has more than %d tokens", JSON_MAX_TOKENS);
+    return -1;
   }
-  int r;
+  jsmntok_t* tmp = realloc(token_buffer, sizeof(jsmntok_t) * size);
+  if(tmp==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) realloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    return -1;
+  }
+  stats.allocations++;
+  pthread_once(&token_buffer_key_once, createTokenBufferKey);
+  pthread_setspecific(token_buffer_key, tmp);
+  token_buffer = tmp;
+  token_buffer_size = size;
+  return 0;
+}
+
+/** @fn int tokenize(const char* json, jsmntok_t** tokens)
+ * @brief parses \p json in a single pass into the token buffer of the calling
+ * thread. If the tokens do not fit, the buffer grows and jsmn continues where
+ * it stopped.
+ * @param tokens is set to the token buffer. It is valid until the next call
+ * on the same thread.
+ * @return the number of tokens or a negative jsmn error
+ */
+static int tokenize(const char* json, jsmntok_t** tokens) {
+  static jsmntok_t none;
+  *tokens = &none; // so the callers can always look at the first token
+  if(token_buffer==NULL && growTokenBuffer()!=0) {
+    return JSMN_ERROR_NOMEM;
+  }
+  stats.parses++;
   jsmn_parser p;
   jsmn_init(&p);
-  int token_needed = jsmn_parse(&p, json, strlen(json), NULL, 0);
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Token needed for parsing: %d",token_needed);
-  if(token_needed < 0) {
-    oidc_errno = OIDC_EJSONPARS;
-    return oidc_errno;
+  size_t len = strlen(json);
+  int r;
+  while((r = jsmn_parse(&p, json, len, token_buffer, token_buffer_size))==JSMN_ERROR_NOMEM) {
+    if(growTokenBuffer()!=0) {
+      return r;
+    }
   }
-  jsmntok_t t[token_needed]; 
-  jsmn_init(&p);
-  r = jsmn_parse(&p, json, strlen(json), t, sizeof(t)/sizeof(t[0]));
+  *tokens = token_buffer;
+  return r;
+}
+
+/** @fn struct json_stats json_getStats()
+ * @brief gets the counters of the calling thread. The difference of two
+ * calls gives the parses and allocations in between.
+ */
+struct json_stats json_getStats() {
+  return stats;
+}
+
+#define PAIR_KEY(pairs, stride, i) (*(const char* const*) ((const char*) (pairs) + (i) * (stride)))
 
+/** @fn unsigned int keyHash(unsigned int seed, const char* key, size_t len)
+ * @brief FNV-1a over \p len bytes of \p key
+ */
+static unsigned int keyHash(unsigned int seed, const char* key, size_t len) {
+  unsigned int h = 2166136261u ^ seed;
+  size_t i;
+  for(i=0; i<len; i++) {
+    h ^= (unsigned char) key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/** @fn void buildKeySet(struct json_keyset* keyset, const void* pairs, size_t
+ * stride, size_t size)
+ * @brief searches a seed for which all keys hash to distinct slots. If there
+ * is none, the last tried seed is used and colliding keys are probed
+ * linearly.
+ * @param pairs an array of structs starting with the key
+ */
+static void buildKeySet(struct json_keyset* keyset, const void* pairs, size_t stride, size_t size) {
+  unsigned int seed;
+  for(seed=0; seed<JSON_KEYSET_SEEDS; seed++) {
+    memset(keyset->slots, 0, sizeof(keyset->slots));
+    int collisions = 0;
+    size_t i;
+    for(i=0; i<size; i++) {
+      const char* key = PAIR_KEY(pairs, stride, i);
+      unsigned int h = keyHash(seed, key, strlen(key)) % JSON_KEYSET_SLOTS;
+      if(keyset->slots[h]) {
+        collisions++;
+      }
+      while(keyset->slots[h]) {
+        h = (h + 1) % JSON_KEYSET_SLOTS;
+      }
+      keyset->slots[h] = i + 1;
+    }
+    if(collisions==0) {
+      break;
+    }
+  }
+  keyset->seed = seed<JSON_KEYSET_SEEDS ? seed : JSON_KEYSET_SEEDS - 1;
+  keyset->size = size;
+}
+
+/** @fn struct json_keyset* prepareKeySet(struct json_keyset* keyset, const
+ * void* pairs, size_t stride, size_t size)
+ * @brief builds \p keyset on first use
+ * @return \p keyset or NULL if the keys have to be compared one by one
+ */
+static struct json_keyset* prepareKeySet(struct json_keyset* keyset, const void* pairs, size_t stride, size_t size) {
+  if(keyset==NULL || size > JSON_KEYSET_SLOTS / 2) {
+    return NULL;
+  }
+  if(!__atomic_load_n(&keyset->ready, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&keyset_mutex);
+    if(!keyset->ready) {
+      buildKeySet(keyset, pairs, stride, size);
+      __atomic_store_n(&keyset->ready, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&keyset_mutex);
+  }
+  if(keyset->size!=size) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "%s: keyset was built for other keys", __func__);
+    return NULL;
+  }
+  return keyset;
+}
+
+/** @fn int findKey(const struct json_keyset* keyset, const void* pairs,
+ * size_t stride, size_t size, const char* json, jsmntok_t* tok)
+ * @return the index of the key \p tok in \p pairs or -1 if it is not
+ * requested
+ */
+static int findKey(const struct json_keyset* keyset, const void* pairs, size_t stride, size_t size, const char* json, jsmntok_t* tok) {
+  size_t i;
+  if(keyset==NULL) {
+    for(i=0; i<size; i++) {
+      if(jsoneq(json, tok, PAIR_KEY(pairs, stride, i))==0) {
+        return i;
+      }
+    }
+    return -1;
+  }
+  const char* key = json + tok->start;
+  size_t len = tok->end - tok->start;
+  unsigned int h = keyHash(keyset->seed, key, len) % JSON_KEYSET_SLOTS;
+  while(keyset->slots[h]) {
+    i = keyset->slots[h] - 1;
+    const char* candidate = PAIR_KEY(pairs, stride, i);
+    if(strncmp(candidate, key, len)==0 && candidate[len]=='\0') {
+      return i;
+    }
+    h = (h + 1) % JSON_KEYSET_SLOTS;
+  }
+  return -1;
+}
+
+/** @fn int hexValue(const char* hex)
+ * @return the value of 4 hex digits or -1 if they are not valid
+ */
+static int hexValue(const char* hex) {
+  int value = 0;
+  int i;
+  for(i=0; i<4; i++) {
+    char c = hex[i];
+    value <<= 4;
+    if(c>='0' && c<='9') { value |= c - '0'; }
+    else if(c>='a' && c<='f') { value |= c - 'a' + 10; }
+    else if(c>='A' && c<='F') { value |= c - 'A' + 10; }
+    else { return -1; }
+  }
+  return value;
+}
+
+/** @fn size_t unescape(const char* src, size_t len, char* dst)
+ * @brief resolves the escape sequences of a json string; \\u escapes are
+ * encoded as UTF-8. Invalid sequences are copied unchanged. The result is
+ * never longer than the input.
+ * @return the length of the result
+ */
+static size_t unescape(const char* src, size_t len, char* dst) {
+  size_t i = 0, j = 0;
+  while(i<len) {
+    if(src[i]!='\\' || i+1>=len) {
+      dst[j++] = src[i++];
+      continue;
+    }
+    char c = src[i+1];
+    static const char escaped[] = "\"\\/bfnrt";
+    static const char unescaped[] = "\"\\/\b\f\n\r\t";
+    const char* simple = strchr(escaped, c);
+    if(c!='\0' && simple) {
+      dst[j++] = unescaped[simple - escaped];
+      i += 2;
+      continue;
+    }
+    long cp = c=='u' && i+6<=len ? hexValue(src+i+2) : -1;
+    if(cp<0) {
+      dst[j++] = src[i++];
+      continue;
+    }
+    i += 6;
+    if(cp>=0xD800 && cp<=0xDBFF && i+6<=len && src[i]=='\\' && src[i+1]=='u') {
+      long low = hexValue(src+i+2);
+      if(low>=0xDC00 && low<=0xDFFF) {
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        i += 6;
+      }
+    }
+    if(cp<0x80) {
+      dst[j++] = cp;
+    } else if(cp<0x800) {
+      dst[j++] = 0xC0 | (cp >> 6);
+      dst[j++] = 0x80 | (cp & 0x3F);
+    } else if(cp<0x10000) {
+      dst[j++] = 0xE0 | (cp >> 12);
+      dst[j++] = 0x80 | ((cp >> 6) & 0x3F);
+      dst[j++] = 0x80 | (cp & 0x3F);
+    } else {
+      dst[j++] = 0xF0 | (cp >> 18);
+      dst[j++] = 0x80 | ((cp >> 12) & 0x3F);
+      dst[j++] = 0x80 | ((cp >> 6) & 0x3F);
+      dst[j++] = 0x80 | (cp & 0x3F);
+    }
+  }
+  return j;
+}
+
+/** @fn char* json_viewCopy(struct json_view view)
+ * @brief copies a value, so it can be kept after the json is freed. Strings
+ * are unescaped; objects, arrays and primitives are copied as they are.
+ * @return a pointer to the copy. Has to be freed after usage. If the value
+ * was not present, NULL is returned.
+ */
+char* json_viewCopy(struct json_view view) {
+  if(view.data==NULL) {
+    return NULL;
+  }
+  char* value = calloc(sizeof(char), view.len+1);
+  if(value==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
+  stats.allocations++;
+  if(view.string) {
+    unescape(view.data, view.len, value);
+  } else {
+    memcpy(value, view.data, view.len);
+  }
+  return value;
+}
+
+/** @fn char* json_viewToken(struct json_view view)
+ * @brief copies a value as it appears in the json, so it can be written into
+ * other json unchanged. Strings keep their quotes and escapes.
+ * @return a pointer to the copy. Has to be freed after usage. If the value
+ * was not present, NULL is returned.
+ */
+char* json_viewToken(struct json_view view) {
+  if(view.data!=NULL && view.string) { // the view starts behind the quote
+    view.data--;
+    view.len += 2;
+    view.string = 0;
+  }
+  return json_viewCopy(view);
+}
+
+/** @fn int json_viewEquals(struct json_view view, const char* str)
+ * @return 1 if the value is present and equal to \p str; 0 otherwise
+ */
+int json_viewEquals(struct json_view view, const char* str) {
+  return view.data!=NULL && str!=NULL && strlen(str)==view.len && strncmp(view.data, str, view.len)==0;
+}
+
+/** @fn long json_viewToLong(struct json_view view)
+ * @return the numeric value; 0 if the value is not present or not numeric
+ */
+long json_viewToLong(struct json_view view) {
+  long value = 0;
+  size_t i = 0;
+  int negative = view.len>0 && view.data[0]=='-';
+  for(i=negative; i<view.len && isdigit(view.data[i]); i++) {
+    value = value * 10 + (view.data[i] - '0');
+  }
+  return negative ? -value : value;
+}
+
+/** @fn int extractViews(const char* json, jsmntok_t t[], int r, struct
+ * key_view* pairs, size_t size, const struct json_keyset* keyset)
+ * @brief sets the views of the requested keys in one sweep over the members
+ * of the root object. Nested objects and arrays are skipped. If a key is
+ * present multiple times, the first value is used.
+ * @param keyset used to look up the keys; if NULL they are compared one by
+ * one
+ * @return the number of set values
+ */
+static int extractViews(const char* json, jsmntok_t t[], int r, struct key_view* pairs, size_t size, const struct json_keyset* keyset) {
+  size_t i;
+  for(i=0; i<size; i++) {
+    pairs[i].value.data = NULL;
+    pairs[i].value.len = 0;
+    pairs[i].value.string = 0;
+  }
+  int found = 0;
+  int k = 1; // the key of the next member
+  int members;
+  for(members=t[0].size; members>0 && k+1<r; members--) {
+    jsmntok_t* key = &t[k];
+    jsmntok_t* value = &t[k+1];
+    int idx = key->type==JSMN_STRING ? findKey(keyset, pairs, sizeof(*pairs), size, json, key) : -1;
+    if(idx>=0 && pairs[idx].value.data==NULL) {
+      pairs[idx].value.data = json + value->start;
+      pairs[idx].value.len = value->end - value->start;
+      pairs[idx].value.string = value->type==JSMN_STRING;
+      found++;
+    }
+    for(k+=2; k<r && t[k].start < value->end; k++); // skip nested objects and arrays
+  }
+  return found;
+}
+
+int JSONArrrayToArray(const char* json, char** arr) {
+  if(NULL==json) {
+    oidc_setArgNullFuncError(__func__);
+    return oidc_errno;
+  }
+  jsmntok_t* t;
+  int r = tokenize(json, &t);
   if(checkArrayParseResult(r, t[0])!=OIDC_SUCCESS) {
     return oidc_errno;
   }
@@ -30,6 +364,7 @@ int JSONArrrayToArray(const char* json, char** arr) {
   for (j = 0; j < t[0].size; j++) {
     jsmntok_t *g = &t[j+1];
     arr[j] = oidc_sprintf("%.*s", g->end - g->start, json + g->start);
+    stats.allocations++;
   }
   return j;
 }
@@ -39,29 +374,20 @@ list_t* JSONArrayToList(const char* json) {
     oidc_setArgNullFuncError(__func__);
     return NULL;
   }
-  int r;
-  jsmn_parser p;
-  jsmn_init(&p);
-  int token_needed = jsmn_parse(&p, json, strlen(json), NULL, 0);
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Token needed for parsing: %d",token_needed);
-  if(token_needed < 0) {
-    oidc_errno = OIDC_EJSONPARS;
-    return NULL;
-  }
-  jsmntok_t t[token_needed]; 
-  jsmn_init(&p);
-  r = jsmn_parse(&p, json, strlen(json), t, sizeof(t)/sizeof(t[0]));
-
+  jsmntok_t* t;
+  int r = tokenize(json, &t);
   if(checkArrayParseResult(r, t[0])!=OIDC_SUCCESS) {
     return NULL;
   }
-  int j;
+  int i = 1, j;
   list_t* l = list_new();
   l->free = (void(*) (void*)) &clearFreeString;
   l->match = (int(*) (void*, void*)) &strequal;
   for (j = 0; j < t[0].size; j++) {
-    jsmntok_t *g = &t[j+1];
+    jsmntok_t *g = &t[i];
     list_rpush(l, list_node_new(oidc_sprintf("%.*s", g->end - g->start, json + g->start)));
+    stats.allocations++;
+    for(i++; i < r && t[i].start < g->end; i++); // skip nested objects and arrays
   }
   return l;
 
@@ -72,32 +398,29 @@ char* JSONArrrayToDelimitedString(const char* json, char delim) {
     oidc_setArgNullFuncError(__func__);
     return NULL;
   }
-  int r;
-  jsmn_parser p;
-  jsmn_init(&p);
-  int token_needed = jsmn_parse(&p, json, strlen(json), NULL, 0);
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Token needed for parsing: %d",token_needed);
-  if(token_needed < 0) {
-    oidc_errno = OIDC_EJSONPARS;
+  jsmntok_t* t;
+  int r = tokenize(json, &t);
+  if(checkArrayParseResult(r, t[0])!=OIDC_SUCCESS) {
     return NULL;
   }
-  jsmntok_t t[token_needed]; 
-  jsmn_init(&p);
-  r = jsmn_parse(&p, json, strlen(json), t, sizeof(t)/sizeof(t[0]));
-
-  if(checkArrayParseResult(r, t[0])!=OIDC_SUCCESS) {
+  size_t len = 1;
+  int j;
+  for (j = 0; j < t[0].size; j++) {
+    len += 1 + t[j+1].end - t[j+1].start;
+  }
+  char* str = calloc(sizeof(char), len);
+  if(str==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
     return NULL;
   }
-  char* str = oidc_sprintf(""); 
-  int j; char* tmp = NULL;
+  stats.allocations++;
+  char* end = str;
   for (j = 0; j < t[0].size; j++) {
     jsmntok_t *g = &t[j+1];
-    tmp = oidc_sprintf("%s%c%.*s", str, delim, g->end - g->start, json + g->start);
-    clearFreeString(str);
-    if(tmp==NULL) {
-      return NULL;
-    }
-    str = tmp;
+    *end++ = delim;
+    memcpy(end, json + g->start, g->end - g->start);
+    end += g->end - g->start;
   }
   return str;
 }
@@ -114,32 +437,19 @@ char* getJSONValue(const char* json, const char* key) {
     oidc_setArgNullFuncError(__func__);
     return NULL;
   }
-  int r;
-  jsmn_parser p;
-  jsmn_init(&p);
-  int token_needed = jsmn_parse(&p, json, strlen(json), NULL, 0);
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Token needed for parsing: %d",token_needed);
-  if(token_needed < 0) {
-    oidc_errno = OIDC_EJSONPARS;
+  struct key_value pair = { .key = key, .value = NULL };
+  if(getJSONValues(json, &pair, 1)<0) {
     return NULL;
   }
-  jsmntok_t t[token_needed]; 
-  jsmn_init(&p);
-  r = jsmn_parse(&p, json, strlen(json), t, sizeof(t)/sizeof(t[0]));
-
-  if(checkParseResult(r, t[0])!=OIDC_SUCCESS)	{
-    return NULL;
-  }
-  char* value = NULL;
-  if((value = getValuefromTokens(t, r, key, json))==NULL) {
+  if(pair.value==NULL) {
     oidc_errno = OIDC_EJSONNOFOUND;
-    return NULL;
   }
-  return value;
+  return pair.value;
 }
 
 /** @fn int getJSONValues(const char* json, struct key_value* pairs, size_t size)
- * @brief gets multiple values from a json string
+ * @brief gets multiple values from a json string. It is parsed once and the
+ * values are filled in one sweep.
  * @param json the json string to be parsed
  * @param pairs an array of key_value pairs. The keys are used as keys. A
  * pointer to the result is stored in the value field. The previous pointer is
@@ -148,75 +458,109 @@ char* getJSONValue(const char* json, const char* key) {
  * return the number of set values or -1 on failure
  */
 oidc_error_t getJSONValues(const char* json, struct key_value* pairs, size_t size) {
-  oidc_error_t e;
+  return getJSONValuesByKeySet(json, pairs, size, NULL);
+}
+
+/** @fn int getJSONValuesByKeySet(const char* json, struct key_value* pairs,
+ * size_t size, struct json_keyset* keyset)
+ * @brief like \f getJSONValues, but the keys are looked up in a precomputed
+ * hash instead of being compared one by one. Meant for json that is parsed
+ * often with the same keys.
+ * @param keyset a keyset initialized with JSON_KEYSET_INIT. It is built from
+ * the keys of \p pairs on first use, so it has to be used with the same keys
+ * in the same order every time, usually as a static variable next to the
+ * \p pairs. Can be shared between threads. If NULL or if there are too many
+ * keys, the keys are compared one by one.
+ * return the number of set values or -1 on failure
+ */
+oidc_error_t getJSONValuesByKeySet(const char* json, struct key_value* pairs, size_t size, struct json_keyset* keyset) {
   if(NULL==json || NULL==pairs || size==0) {
     oidc_setArgNullFuncError(__func__);
     return oidc_errno;
   }
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Parsing json '%s'", json);
-  int r;
-  jsmn_parser p;
-  jsmn_init(&p);
-  int token_needed = jsmn_parse(&p, json, strlen(json), NULL, 0);
-  if(token_needed < 0) {
-    oidc_errno = OIDC_EJSONPARS;
-    return OIDC_EJSONPARS;
+  struct key_view views[JSON_MAX_KEYS];
+  if(size > JSON_MAX_KEYS) {
+    oidc_seterror("Too many json keys requested");
+    oidc_errno = OIDC_EERROR;
+    return oidc_errno;
   }
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Token needed for parsing: %d",token_needed);
-  jsmntok_t t[token_needed]; 
-  jsmn_init(&p);
-  r = jsmn_parse(&p, json, strlen(json), t, sizeof(t)/sizeof(t[0]));
-
-  if((e = checkParseResult(r, t[0]))!=OIDC_SUCCESS) {
+  size_t i;
+  for(i=0; i<size; i++) {
+    views[i].key = pairs[i].key;
+  }
+  oidc_error_t e = getJSONViews(json, views, size, keyset);
+  if(e<0) {
     return e;
   }
-  unsigned int i;
-  for(i=0; i<size;i++){
-    pairs[i].value = getValuefromTokens(t, r, pairs[i].key, json);
+  for(i=0; i<size; i++) {
+    pairs[i].value = json_viewCopy(views[i].value);
   }
-  return i;
+  return size;
 }
 
-int isJSONObject(const char* json) {
-  if(json==NULL) {
+/** @fn int getJSONViews(const char* json, struct key_view* pairs, size_t
+ * size, struct json_keyset* keyset)
+ * @brief gets multiple values from a json string without copying them. The
+ * views point into \p json and are valid as long as it is; values that are
+ * kept have to be copied using \f json_viewCopy.
+ * @param keyset see \f getJSONValuesByKeySet; may be NULL
+ * return the number of requested values or -1 on failure
+ */
+oidc_error_t getJSONViews(const char* json, struct key_view* pairs, size_t size, struct json_keyset* keyset) {
+  if(NULL==json || NULL==pairs || size==0) {
     oidc_setArgNullFuncError(__func__);
-    return 0;
+    return oidc_errno;
   }
-  int r;
-  jsmn_parser p;
-  jsmn_init(&p);
-  int token_needed = jsmn_parse(&p, json, strlen(json), NULL, 0);
-  if(token_needed < 0) {
-    oidc_errno = OIDC_EJSONPARS;
-    return OIDC_EJSONPARS;
+  struct json_object object;
+  oidc_error_t e = json_parseObject(json, &object);
+  if(e!=OIDC_SUCCESS) {
+    return e;
   }
-  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Token needed for parsing: %d",token_needed);
-  jsmntok_t t[token_needed]; 
-  jsmn_init(&p);
-  r = jsmn_parse(&p, json, strlen(json), t, sizeof(t)/sizeof(t[0]));
+  return json_objectViews(&object, pairs, size, keyset);
+}
 
-  if(checkParseResult(r, t[0])!=OIDC_SUCCESS) {
-    return 0;
+/** @fn oidc_error_t json_parseObject(const char* json, struct json_object* object)
+ * @brief parses a json object, so that values can be looked up in multiple
+ * steps using \f json_objectViews without parsing it again
+ * @param object is set to the parsed object. Its tokens are stored in a
+ * buffer of the calling thread, so it is only valid until the next json
+ * string is parsed on that thread.
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t json_parseObject(const char* json, struct json_object* object) {
+  if(NULL==json || NULL==object) {
+    oidc_setArgNullFuncError(__func__);
+    return oidc_errno;
   }
-  return 1;
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Parsing json '%s'", json);
+  object->json = json;
+  object->count = tokenize(json, &object->tokens);
+  return checkParseResult(object->count, object->tokens[0]);
 }
 
-char* getValuefromTokens(jsmntok_t t[], int r, const char* key, const char* json) {
-  /* Loop over all keys of the root object */
-  int i;
-  for (i = 1; i < r; i++) {
-    if (jsoneq(json, &t[i], key) == 0) {
-      if(i==r-1) {
-        return NULL;
-      }
-      /* We may use strndup() to fetch string value */
-      char* value = oidc_sprintf("%.*s", t[i+1].end-t[i+1].start, json + t[i+1].start);
-      value = strelimIfFollowed(value, '\\', '/'); // needed for escaped slashes, which are json comforn but not correctly parsed
-      value = strelimIfFollowed(value, '\\', '"'); 
-      return value;
-    } 
-  }
-  return NULL;
+/** @fn int json_objectViews(const struct json_object* object, struct
+ * key_view* pairs, size_t size, struct json_keyset* keyset)
+ * @brief like \f getJSONViews for an object parsed with \f json_parseObject
+ * return the number of requested values or -1 on failure
+ */
+oidc_error_t json_objectViews(const struct json_object* object, struct key_view* pairs, size_t size, struct json_keyset* keyset) {
+  if(NULL==object || NULL==pairs) {
+    oidc_setArgNullFuncError(__func__);
+    return oidc_errno;
+  }
+  keyset = prepareKeySet(keyset, pairs, sizeof(*pairs), size);
+  extractViews(object->json, object->tokens, object->count, pairs, size, keyset);
+  return size;
+}
+
+int isJSONObject(const char* json) {
+  if(json==NULL) {
+    oidc_setArgNullFuncError(__func__);
+    return 0;
+  }
+  jsmntok_t* t;
+  int r = tokenize(json, &t);
+  return checkParseResult(r, t[0])==OIDC_SUCCESS;
 }
 
 int jsoneq(const char *json, jsmntok_t *tok, const char *s) {
@@ -260,71 +604,6 @@ oidc_error_t checkArrayParseResult(int r, jsmntok_t t) {
 }
 
 
-char* json_arrAdd(char* json, const char* value) {
-  if(json==NULL || value==NULL) {
-    oidc_setArgNullFuncError(__func__);
-    return NULL;
-  }
-  const char* const fmt = "%s, \"%s\"]";
-  int len = strlen(json);
-  if(json[len-1]!=']') {
-    oidc_errno = OIDC_EJSONADD;
-    return json;
-  }
-  json[len-1] = '\0';
-  char* tmp = oidc_sprintf(fmt, json, value);
-  if(tmp==NULL) {
-    return json;
-  }
-  if(tmp[1]==',') {
-    memmove(tmp+1, tmp+3, strlen(tmp+3)); //removes the the added comma and space if there was no element in the array
-    tmp[strlen(tmp)-1]='\0';
-    tmp[strlen(tmp)-1]='\0'; //removes the two last char (we moved everything two chars to the front)
-  }
-  clearFreeString(json);
-  oidc_errno = OIDC_SUCCESS;
-  return tmp;
-
-}
-
-char* json_addValue(char* json, const char* key, const char* value) {
-  if(json==NULL || key==NULL || value==NULL) {
-    oidc_setArgNullFuncError(__func__);
-    return NULL;
-  }
-  const char* const fmt = "%s, \"%s\":%s}";
-  int len = strlen(json);
-  if(json[len-1]!='}') {
-    oidc_errno = OIDC_EJSONADD;
-    return json;
-  }
-  json[len-1] = '\0';
-  char* tmp = oidc_sprintf(fmt, json, key, value);
-  if(tmp==NULL) {
-    return json;
-  }
-  if(tmp[1]==',') {
-    tmp[1]=' ';
-  }
-  clearFreeString(json);
-  oidc_errno = OIDC_SUCCESS;
-  return tmp;
-}
-
-char* json_addStringValue(char* json, const char* key, char* value) {
-  if(json==NULL || key==NULL || value==NULL) {
-    oidc_setArgNullFuncError(__func__);
-    return NULL;
-  }
-  char* tmp = oidc_sprintf("\"%s\"", value);
-  if(tmp==NULL) {
-    return json;
-  }
-  char* res = json_addValue(json, key, tmp);
-  clearFreeString(tmp);
-  return res;
-}
-
 int json_hasKey(char* json, const char* key) {
   char* value = getJSONValue(json, key);
   if(isValid(value)) {
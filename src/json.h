@@ -12,6 +12,50 @@ struct key_value {
   char* value;
 };
 
+/* a value inside a json string. It is neither copied nor unescaped; see
+ * \f getJSONViews */
+struct json_view {
+  const char* data; // NULL if the key is not present
+  size_t len;
+  int string; // the value is a json string, it is unescaped when copied
+};
+
+struct key_view {
+  const char* key;
+  struct json_view value;
+};
+
+/* a json object parsed once to look up values in multiple steps; see
+ * \f json_parseObject */
+struct json_object {
+  const char* json;
+  jsmntok_t* tokens;
+  int count;
+};
+
+/* the parses and heap allocations done by the json functions on a thread */
+struct json_stats {
+  unsigned long parses;
+  unsigned long allocations;
+};
+
+/* the limit for the tokens of one json document and for the keys requested
+ * at once */
+#define JSON_MAX_TOKENS 16384
+#define JSON_MAX_KEYS 32
+
+/* a precomputed hash over the keys of a key_value array, so that the values
+ * are found in one sweep over the parsed json; see \f getJSONValuesByKeySet */
+#define JSON_KEYSET_SLOTS 64
+#define JSON_KEYSET_SEEDS 1024
+struct json_keyset {
+  int ready;
+  unsigned int seed;
+  size_t size;
+  unsigned char slots[JSON_KEYSET_SLOTS]; // index of the key plus 1; 0 if empty
+};
+#define JSON_KEYSET_INIT { 0, 0, 0, {0} }
+
 static inline void clearFreeKeyValuePairs(struct key_value* pairs, size_t size) {
   size_t i;
   for(i=0; i<size; i++) {
@@ -21,12 +65,17 @@ static inline void clearFreeKeyValuePairs(struct key_value* pairs, size_t size)
 
 char* getJSONValue(const char* json, const char* key) ;
 int getJSONValues(const char* json, struct key_value* pairs, size_t size) ;
-char* getValuefromTokens(jsmntok_t t[], int r, const char* key, const char* json) ;
+int getJSONValuesByKeySet(const char* json, struct key_value* pairs, size_t size, struct json_keyset* keyset) ;
+int getJSONViews(const char* json, struct key_view* pairs, size_t size, struct json_keyset* keyset) ;
+oidc_error_t json_parseObject(const char* json, struct json_object* object) ;
+int json_objectViews(const struct json_object* object, struct key_view* pairs, size_t size, struct json_keyset* keyset) ;
+char* json_viewCopy(struct json_view view) ;
+char* json_viewToken(struct json_view view) ;
+int json_viewEquals(struct json_view view, const char* str) ;
+long json_viewToLong(struct json_view view) ;
+struct json_stats json_getStats() ;
 int jsoneq(const char *json, jsmntok_t *tok, const char *s) ;
 int checkParseResult(int r, jsmntok_t t) ;
-char* json_addValue(char* json, const char* key, const char* value) ;
-char* json_addStringValue(char* json, const char* key, char* value) ;
-char* json_arrAdd(char* json, const char* value) ;
 int json_hasKey(char* json, const char* key) ;
 oidc_error_t checkArrayParseResult(int r, jsmntok_t t) ;
 int JSONArrrayToArray(const char* json, char** arr) ;
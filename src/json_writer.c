@@ -0,0 +1,302 @@
+#include "json_writer.h"
+#include "ipc_tlv.h"
+#include "oidc_utilities.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+
+#define JSON_WRITER_INITIAL_CAPACITY 256
+
+void jsonwriter_init(struct json_writer* w) {
+  memset(w, 0, sizeof(struct json_writer));
+}
+
+/** @fn void jsonwriter_initBinary(struct json_writer* w, int (*field_id)(const char* key))
+ * @brief initializes a writer for a binary message. The keys of the top
+ * level object are mapped to field ids by \p field_id; string values are
+ * written unescaped, all other values as json.
+ */
+void jsonwriter_initBinary(struct json_writer* w, int (*field_id)(const char* key)) {
+  jsonwriter_init(w);
+  w->field_id = field_id;
+}
+
+/** @fn int reserve(struct json_writer* w, size_t n)
+ * @brief makes room for \p n more characters and the terminating 0. The
+ * capacity is doubled, so building a string is linear in its length. The old
+ * buffer is cleared, because it might contain tokens.
+ * @return 1 if there is enough room; 0 if the writer failed
+ */
+static int reserve(struct json_writer* w, size_t n) {
+  if(w->failed) {
+    return 0;
+  }
+  if(w->len + n + 1 <= w->capacity) {
+    return 1;
+  }
+  size_t capacity = w->capacity ? w->capacity : JSON_WRITER_INITIAL_CAPACITY;
+  while(w->len + n + 1 > capacity) {
+    capacity *= 2;
+  }
+  char* buf = malloc(capacity);
+  if(buf==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    w->failed = 1;
+    return 0;
+  }
+  if(w->buf) {
+    memcpy(buf, w->buf, w->len);
+    clearFree(w->buf, w->capacity);
+  }
+  w->buf = buf;
+  w->capacity = capacity;
+  return 1;
+}
+
+static void append(struct json_writer* w, const char* str, size_t n) {
+  if(reserve(w, n)) {
+    memcpy(w->buf + w->len, str, n);
+    w->len += n;
+  }
+}
+
+static void appendChar(struct json_writer* w, char c) {
+  if(reserve(w, 1)) {
+    w->buf[w->len++] = c;
+  }
+}
+
+/** @fn int isBinaryField(struct json_writer* w)
+ * @return 1 if the next value is the value of a binary field
+ */
+static int isBinaryField(struct json_writer* w) {
+  return w->field_id && w->depth==1;
+}
+
+/** @fn void endBinaryField(struct json_writer* w)
+ * @brief fills in the length of the current binary field
+ */
+static void endBinaryField(struct json_writer* w) {
+  if(w->field_start==0 || w->failed) {
+    return;
+  }
+  uint32_t len = htonl(w->len - w->field_start);
+  memcpy(w->buf + w->field_start - sizeof(len), &len, sizeof(len));
+  w->field_start = 0;
+}
+
+/** @fn int skipNullField(struct json_writer* w)
+ * @brief removes the current binary field, which has no value
+ * @return 1 if the field was removed; 0 if no binary field is written
+ */
+static int skipNullField(struct json_writer* w) {
+  if(!isBinaryField(w) || w->field_start==0) {
+    return 0;
+  }
+  w->len = w->field_start - TLV_HEADER_LEN;
+  w->field_start = 0;
+  return 1;
+}
+
+/** @fn void beginValue(struct json_writer* w)
+ * @brief writes the comma separating a value from the previous one, unless
+ * it is the value of a key
+ */
+static void beginValue(struct json_writer* w) {
+  if(w->after_key) {
+    w->after_key = 0;
+    return;
+  }
+  if(w->depth>0) {
+    if(w->has_elements[w->depth-1]) {
+      appendChar(w, ',');
+    }
+    w->has_elements[w->depth-1] = 1;
+  }
+}
+
+static void begin(struct json_writer* w, char c) {
+  beginValue(w);
+  if(w->depth>=JSON_WRITER_MAX_DEPTH) {
+    syslog(LOG_AUTHPRIV|LOG_ERR, "%s: json nested too deep", __func__);
+    w->failed = 1;
+    return;
+  }
+  if(!w->field_id || w->depth>0) {
+    appendChar(w, c);
+  } else if(c!='{') {
+    w->failed = 1; // a binary message is always an object
+  }
+  w->has_elements[w->depth++] = 0;
+}
+
+static void end(struct json_writer* w, char c) {
+  if(w->depth==0) {
+    w->failed = 1;
+    return;
+  }
+  if(isBinaryField(w)) {
+    endBinaryField(w);
+  } else {
+    appendChar(w, c);
+  }
+  w->depth--;
+}
+
+void jsonwriter_beginObject(struct json_writer* w) {
+  begin(w, '{');
+}
+
+void jsonwriter_endObject(struct json_writer* w) {
+  end(w, '}');
+}
+
+void jsonwriter_beginArray(struct json_writer* w) {
+  begin(w, '[');
+}
+
+void jsonwriter_endArray(struct json_writer* w) {
+  end(w, ']');
+}
+
+/** @fn void appendEscaped(struct json_writer* w, const char* str)
+ * @brief appends \p str as a quoted json string. Quotes, backslashes and
+ * control characters are escaped; everything else, including UTF-8
+ * sequences, is copied unchanged.
+ */
+static void appendEscaped(struct json_writer* w, const char* str) {
+  appendChar(w, '"');
+  const char* run = str; // characters that need no escaping are copied at once
+  const char* c;
+  for(c=str; *c; c++) {
+    unsigned char u = *c;
+    if(u!='"' && u!='\\' && u>=0x20) {
+      continue;
+    }
+    append(w, run, c - run);
+    run = c + 1;
+    switch(u) {
+      case '"': append(w, "\\\"", 2); break;
+      case '\\': append(w, "\\\\", 2); break;
+      case '\n': append(w, "\\n", 2); break;
+      case '\r': append(w, "\\r", 2); break;
+      case '\t': append(w, "\\t", 2); break;
+      case '\b': append(w, "\\b", 2); break;
+      case '\f': append(w, "\\f", 2); break;
+      default: {
+                 char esc[7];
+                 snprintf(esc, sizeof(esc), "\\u%04x", u);
+                 append(w, esc, 6);
+               }
+    }
+  }
+  append(w, run, c - run);
+  appendChar(w, '"');
+}
+
+void jsonwriter_key(struct json_writer* w, const char* key) {
+  if(isBinaryField(w)) {
+    endBinaryField(w);
+    int id = w->field_id(key);
+    if(id<0) {
+      syslog(LOG_AUTHPRIV|LOG_ERR, "%s: no field id for key '%s'", __func__, key);
+      w->failed = 1;
+      return;
+    }
+    char header[TLV_HEADER_LEN] = {id};
+    append(w, header, sizeof(header));
+    w->field_start = w->len;
+    w->after_key = 1;
+    return;
+  }
+  beginValue(w);
+  appendEscaped(w, key);
+  appendChar(w, ':');
+  w->after_key = 1;
+}
+
+/** @fn void jsonwriter_string(struct json_writer* w, const char* value)
+ * @brief writes a string value; NULL is written as null
+ */
+void jsonwriter_string(struct json_writer* w, const char* value) {
+  beginValue(w);
+  if(value==NULL) {
+    if(!skipNullField(w)) {
+      append(w, "null", 4);
+    }
+  } else if(isBinaryField(w)) {
+    append(w, value, strlen(value));
+  } else {
+    appendEscaped(w, value);
+  }
+}
+
+void jsonwriter_unsigned(struct json_writer* w, unsigned long value) {
+  beginValue(w);
+  char num[24];
+  int n = snprintf(num, sizeof(num), "%lu", value);
+  append(w, num, n);
+}
+
+/** @fn void jsonwriter_raw(struct json_writer* w, const char* json)
+ * @brief writes a value that is already json encoded, e.g. an object built
+ * elsewhere; NULL is written as null
+ */
+void jsonwriter_raw(struct json_writer* w, const char* json) {
+  beginValue(w);
+  if(json==NULL) {
+    if(!skipNullField(w)) {
+      append(w, "null", 4);
+    }
+  } else {
+    append(w, json, strlen(json));
+  }
+}
+
+void jsonwriter_addString(struct json_writer* w, const char* key, const char* value) {
+  jsonwriter_key(w, key);
+  jsonwriter_string(w, value);
+}
+
+void jsonwriter_addUnsigned(struct json_writer* w, const char* key, unsigned long value) {
+  jsonwriter_key(w, key);
+  jsonwriter_unsigned(w, value);
+}
+
+void jsonwriter_addRaw(struct json_writer* w, const char* key, const char* json) {
+  jsonwriter_key(w, key);
+  jsonwriter_raw(w, json);
+}
+
+/** @fn char* jsonwriter_finish(struct json_writer* w)
+ * @brief takes the built json string out of the writer
+ * @return a pointer to the json string. Has to be freed after usage. If
+ * writing failed or objects or arrays were not closed, NULL is returned and
+ * oidc_errno is set.
+ */
+char* jsonwriter_finish(struct json_writer* w) {
+  if(w->failed || w->depth!=0 || !reserve(w, 0)) {
+    jsonwriter_discard(w);
+    oidc_seterror("Could not build json");
+    oidc_errno = OIDC_EERROR;
+    return NULL;
+  }
+  w->buf[w->len] = '\0';
+  char* json = w->buf;
+  jsonwriter_init(w);
+  return json;
+}
+
+/** @fn void jsonwriter_discard(struct json_writer* w)
+ * @brief frees the buffer of a writer that is not finished
+ */
+void jsonwriter_discard(struct json_writer* w) {
+  if(w->buf) {
+    clearFree(w->buf, w->capacity);
+  }
+  jsonwriter_init(w);
+}
@@ -0,0 +1,44 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include "oidc_error.h"
+
+#include <stddef.h>
+
+#define JSON_WRITER_MAX_DEPTH 16
+
+/* builds a json string by appending to a growing buffer. Commas between
+ * members and elements are inserted automatically and strings are escaped.
+ * If an allocation fails or the nesting is too deep, further calls are
+ * ignored and \f jsonwriter_finish fails.
+ * A writer initialized with \f jsonwriter_initBinary writes the members of
+ * the top level object as binary fields instead, see ipc_tlv.h. */
+struct json_writer {
+  char* buf;
+  size_t len;
+  size_t capacity;
+  size_t depth;
+  int has_elements[JSON_WRITER_MAX_DEPTH]; // per level: a comma is needed before the next element
+  int after_key; // a key was written, its value follows
+  int failed;
+  int (*field_id)(const char* key); // if set, the top level object is written as binary fields
+  size_t field_start; // position of the value of the current binary field
+};
+
+void jsonwriter_init(struct json_writer* w) ;
+void jsonwriter_initBinary(struct json_writer* w, int (*field_id)(const char* key)) ;
+void jsonwriter_beginObject(struct json_writer* w) ;
+void jsonwriter_endObject(struct json_writer* w) ;
+void jsonwriter_beginArray(struct json_writer* w) ;
+void jsonwriter_endArray(struct json_writer* w) ;
+void jsonwriter_key(struct json_writer* w, const char* key) ;
+void jsonwriter_string(struct json_writer* w, const char* value) ;
+void jsonwriter_unsigned(struct json_writer* w, unsigned long value) ;
+void jsonwriter_raw(struct json_writer* w, const char* json) ;
+void jsonwriter_addString(struct json_writer* w, const char* key, const char* value) ;
+void jsonwriter_addUnsigned(struct json_writer* w, const char* key, unsigned long value) ;
+void jsonwriter_addRaw(struct json_writer* w, const char* key, const char* json) ;
+char* jsonwriter_finish(struct json_writer* w) ;
+void jsonwriter_discard(struct json_writer* w) ;
+
+#endif // JSON_WRITER_H
@@ -2,10 +2,14 @@
 
 #include "oidc-agent.h"
 #include "ipc.h"
+#include "ipc_tlv.h"
 #include "account.h"
 #include "settings.h"
 #include "oidc_error.h"
+#include "worker_pool.h"
 #include "agent_handler.h"
+#include "timer.h"
+#include "http.h"
 
 #include <time.h>
 #include <fcntl.h>
@@ -59,6 +63,357 @@ void daemonize() {
 }
 
 
+// the maximum number of fields a request type declares
+#define REQUEST_MAX_FIELDS 4
+
+struct request_type;
+
+struct agent_request {
+  struct connection* con;
+  struct account_table* loaded;
+  const struct request_type* type;
+  char* request_id; // as json token for json requests, see ipc_setResponseContext
+  struct key_value fields[REQUEST_MAX_FIELDS]; // values of the fields of the type, in the same order
+};
+
+// how a request read by the event loop continues
+#define REQUEST_DONE    0 // answered
+#define REQUEST_ASYNC   1 // has to be passed to handleRequest
+#define REQUEST_WAITING 2 // waits for a token refresh
+
+/* requests that wait for a worker or an OpenID Provider, in total and per
+ * user of the client processes */
+struct peer_load {
+  uid_t uid;
+  size_t pending;
+};
+
+static size_t max_queued = 0;
+static size_t max_peer_requests = 0;
+static size_t queued = 0;
+static list_t* peers = NULL;
+
+/** @fn struct peer_load* getPeerLoad(uid_t uid)
+ * @return the load of the user \p uid or NULL on failure
+ */
+static struct peer_load* getPeerLoad(uid_t uid) {
+  if(peers==NULL) {
+    peers = list_new();
+    if(peers==NULL) {
+      return NULL;
+    }
+    peers->free = free;
+  }
+  list_node_t* node;
+  for(node=peers->head; node; node=node->next) {
+    struct peer_load* peer = node->val;
+    if(peer->uid==uid) {
+      return peer;
+    }
+  }
+  struct peer_load* peer = calloc(sizeof(struct peer_load), 1);
+  if(peer==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    return NULL;
+  }
+  peer->uid = uid;
+  list_rpush(peers, list_node_new(peer));
+  return peer;
+}
+
+/** @fn int admitRequest(struct agent_request* req)
+ * @brief checks if a request that has to wait for a worker or an OpenID
+ * Provider can be queued. If too many requests, in total or of the same
+ * user, are waiting already, it is answered with busy.
+ * @return 1 if the request can be queued; 0 if it was answered
+ */
+static int admitRequest(struct agent_request* req) {
+  struct peer_load* peer = getPeerLoad(req->con->uid);
+  int peer_busy = max_peer_requests>0 && peer && peer->pending>=max_peer_requests;
+  if(!peer_busy && (max_queued==0 || queued<max_queued)) {
+    return 1;
+  }
+  unsigned long rejected_requests = ipc_countRejectedRequest();
+  syslog(LOG_AUTHPRIV|(rejected_requests==1 ? LOG_NOTICE : LOG_DEBUG), "Rejecting request of uid %d: %lu requests queued, %lu of them by this user", (int) req->con->uid, (unsigned long) queued, (unsigned long) (peer ? peer->pending : 0));
+  ipc_writeBusy(*(req->con->msgsock), BUSY_RETRY_AFTER);
+  return 0;
+}
+
+/** @fn void addPending(struct connection* con)
+ * @brief counts a request of \p con that is handled by another thread or
+ * waits for an OpenID Provider
+ */
+static void addPending(struct connection* con) {
+  struct peer_load* peer = getPeerLoad(con->uid);
+  con->pending++;
+  queued++;
+  if(peer) {
+    peer->pending++;
+  }
+}
+
+/** @fn void removePending(struct connection* con)
+ * @brief counts a request added with \f addPending as done
+ */
+static void removePending(struct connection* con) {
+  struct peer_load* peer = getPeerLoad(con->uid);
+  con->pending--;
+  queued--;
+  if(peer && peer->pending>0) {
+    peer->pending--;
+  }
+}
+
+/* a request type the agent handles. Only the fields the handlers need are
+ * extracted from a request. Requests are handled by handleInline on the
+ * thread running the event loop, if they can be answered without blocking,
+ * and by handle on a worker thread otherwise. */
+struct request_type {
+  const char* name;
+  const char* fields[REQUEST_MAX_FIELDS]; // NULL after the last field
+  int (*handleInline)(struct agent_request* req); // returns REQUEST_*; if NULL, handle is used
+  void (*handle)(struct agent_request* req); // if NULL, the request is always handled inline
+  struct json_keyset keyset; // for the fields
+};
+
+static int handleTokenInline(struct agent_request* req) {
+  struct key_value* f = req->fields; // account, min_valid_period, scope
+  if(agent_handleCachedToken(*(req->con->msgsock), req->loaded, f[0].value, f[1].value, f[2].value)) {
+    return REQUEST_DONE;
+  }
+  if(!admitRequest(req)) {
+    return REQUEST_DONE;
+  }
+  if(!agent_joinTokenRefresh(req->con, req->request_id, f[0].value, f[1].value, f[2].value)) {
+    agent_handleToken(req->con, req->request_id, req->loaded, f[0].value, f[1].value, f[2].value);
+  }
+  return REQUEST_WAITING;
+}
+
+static int handleTokenBatchInline(struct agent_request* req) {
+  if(!admitRequest(req)) {
+    return REQUEST_DONE;
+  }
+  return agent_handleTokenBatch(req->con, req->request_id, req->loaded, req->fields[0].value) ? REQUEST_DONE : REQUEST_WAITING;
+}
+
+static int handleListInline(struct agent_request* req) {
+  agent_handleList(*(req->con->msgsock), req->loaded);
+  return REQUEST_DONE;
+}
+
+static int handleStateLookUpInline(struct agent_request* req) {
+  agent_handleStateLookUp(*(req->con->msgsock), req->loaded, req->fields[0].value);
+  return REQUEST_DONE;
+}
+
+static void handleGen(struct agent_request* req) {
+  agent_handleGen(*(req->con->msgsock), req->loaded, req->fields[0].value, req->fields[1].value);
+}
+
+static void handleCodeExchange(struct agent_request* req) {
+  struct key_value* f = req->fields; // config, code, redirect_uri, state
+  agent_handleCodeExchange(*(req->con->msgsock), req->loaded, f[0].value, f[1].value, f[2].value, f[3].value);
+}
+
+static void handleDeviceLookup(struct agent_request* req) {
+  agent_handleDeviceLookup(*(req->con->msgsock), req->loaded, req->fields[0].value, req->fields[1].value);
+}
+
+static void handleAdd(struct agent_request* req) {
+  agent_handleAdd(*(req->con->msgsock), req->loaded, req->fields[0].value);
+}
+
+static void handleRemove(struct agent_request* req) {
+  agent_handleRm(*(req->con->msgsock), req->loaded, req->fields[0].value, 0);
+}
+
+static void handleDelete(struct agent_request* req) {
+  agent_handleRm(*(req->con->msgsock), req->loaded, req->fields[0].value, 1);
+}
+
+static void handleRegister(struct agent_request* req) {
+  agent_handleRegister(*(req->con->msgsock), req->loaded, req->fields[0].value, req->fields[1].value);
+}
+
+static struct request_type request_types[] = {
+  { REQUEST_VALUE_ACCESSTOKEN, {"account", "min_valid_period", "scope"}, handleTokenInline, NULL, JSON_KEYSET_INIT },
+  { REQUEST_VALUE_ACCESSTOKENBATCH, {IPC_KEY_TOKENS}, handleTokenBatchInline, NULL, JSON_KEYSET_INIT },
+  { REQUEST_VALUE_ACCOUNTLIST, {NULL}, handleListInline, NULL, JSON_KEYSET_INIT },
+  { REQUEST_VALUE_STATELOOKUP, {"state"}, handleStateLookUpInline, NULL, JSON_KEYSET_INIT },
+  { REQUEST_VALUE_GEN, {"config", "flow"}, NULL, handleGen, JSON_KEYSET_INIT },
+  { REQUEST_VALUE_CODEEXCHANGE, {"config", "code", "redirect_uri", "state"}, NULL, handleCodeExchange, JSON_KEYSET_INIT },
+  { REQUEST_VALUE_DEVICELOOKUP, {"config", "oidc_device"}, NULL, handleDeviceLookup, JSON_KEYSET_INIT },
+  { REQUEST_VALUE_ADD, {"config"}, NULL, handleAdd, JSON_KEYSET_INIT },
+  { REQUEST_VALUE_REMOVE, {"config"}, NULL, handleRemove, JSON_KEYSET_INIT },
+  { REQUEST_VALUE_DELETE, {"config"}, NULL, handleDelete, JSON_KEYSET_INIT },
+  { REQUEST_VALUE_REGISTER, {"config", "authorization"}, NULL, handleRegister, JSON_KEYSET_INIT },
+};
+
+#define REQUEST_TYPE_COUNT (sizeof(request_types)/sizeof(*request_types))
+#define REQUEST_TYPE_SLOTS 32 // a power of 2, at least twice the number of request types
+
+// index of the request type plus 1; 0 if empty
+static unsigned char request_type_slots[REQUEST_TYPE_SLOTS];
+
+/** @fn unsigned int requestTypeHash(const char* name, size_t len)
+ * @brief FNV-1a over \p len bytes of \p name
+ */
+static unsigned int requestTypeHash(const char* name, size_t len) {
+  unsigned int h = 2166136261u;
+  size_t i;
+  for(i=0; i<len; i++) {
+    h ^= (unsigned char) name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/** @fn void initRequestTypes()
+ * @brief builds the hash table of the request types. Has to be called before
+ * the first request is read.
+ */
+void initRequestTypes() {
+  size_t i;
+  for(i=0; i<REQUEST_TYPE_COUNT; i++) {
+    unsigned int h = requestTypeHash(request_types[i].name, strlen(request_types[i].name)) & (REQUEST_TYPE_SLOTS - 1);
+    while(request_type_slots[h]) {
+      h = (h + 1) & (REQUEST_TYPE_SLOTS - 1);
+    }
+    request_type_slots[h] = i + 1;
+  }
+}
+
+/** @fn struct request_type* findRequestType(struct json_view name)
+ * @return the request type called \p name or NULL if there is none
+ */
+static struct request_type* findRequestType(struct json_view name) {
+  unsigned int h = requestTypeHash(name.data, name.len) & (REQUEST_TYPE_SLOTS - 1);
+  while(request_type_slots[h]) {
+    struct request_type* type = &request_types[request_type_slots[h] - 1];
+    if(json_viewEquals(name, type->name)) {
+      return type;
+    }
+    h = (h + 1) & (REQUEST_TYPE_SLOTS - 1);
+  }
+  return NULL;
+}
+
+void clearFreeAgentRequest(struct agent_request* req) {
+  clearFreeKeyValuePairs(req->fields, REQUEST_MAX_FIELDS);
+  clearFreeString(req->request_id);
+  clearFree(req, sizeof(struct agent_request));
+}
+
+/** @fn struct agent_request* parseAgentRequest(struct connection* con, struct
+ * account_table* loaded, const char* msg, size_t len)
+ * @brief parses a request in the protocol of \p con. The request type is
+ * looked up first and then only the fields it declares are extracted.
+ * Invalid requests are answered.
+ * @return a pointer to the request or NULL if it was invalid. Has to be freed
+ * using \f clearFreeAgentRequest
+ */
+struct agent_request* parseAgentRequest(struct connection* con, struct account_table* loaded, const char* msg, size_t len) {
+  int sock = *(con->msgsock);
+  int binary = con->protocol==IPC_PROTOCOL_TLV;
+  struct json_object object;
+  struct key_view header[2] = { {"request"}, {IPC_KEY_REQUESTID} };
+  static struct json_keyset header_keyset = JSON_KEYSET_INIT;
+  int parsed = binary ? tlv_getViews(msg, len, header, 2) : json_parseObject(msg, &object);
+  if(parsed>=0 && !binary) {
+    parsed = json_objectViews(&object, header, 2, &header_keyset);
+  }
+  if(parsed<0) {
+    ipc_setResponseContext(con, NULL);
+    ipc_writeBadRequest(sock, oidc_serror());
+    ipc_setResponseContext(NULL, NULL);
+    return NULL;
+  }
+  struct agent_request* req = calloc(sizeof(struct agent_request), 1);
+  if(req==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+  req->con = con;
+  req->loaded = loaded;
+  req->request_id = binary ? json_viewCopy(header[1].value) : json_viewToken(header[1].value);
+  struct request_type* type = header[0].value.data ? findRequestType(header[0].value) : NULL;
+  if(type==NULL) {
+    ipc_setResponseContext(con, req->request_id);
+    ipc_writeBadRequest(sock, header[0].value.data ? "Unknown request type." : "No request type.");
+    ipc_setResponseContext(NULL, NULL);
+    clearFreeAgentRequest(req);
+    return NULL;
+  }
+  req->type = type;
+  struct key_view fields[REQUEST_MAX_FIELDS];
+  size_t count;
+  for(count=0; count<REQUEST_MAX_FIELDS && type->fields[count]; count++) {
+    fields[count].key = type->fields[count];
+  }
+  if(count>0) {
+    if(binary) {
+      tlv_getViews(msg, len, fields, count);
+    } else {
+      json_objectViews(&object, fields, count, &type->keyset);
+    }
+  }
+  size_t i;
+  for(i=0; i<count; i++) {
+    req->fields[i].key = fields[i].key;
+    req->fields[i].value = json_viewCopy(fields[i].value);
+  }
+  return req;
+}
+
+/** @fn void* handleRequest(void* arg)
+ * @brief handles a request that might need to contact an OpenID Provider.
+ * Runs on a worker thread.
+ * @param arg the agent_request; it is freed
+ * @return the connection the request was read from, so that the event loop
+ * knows the request is done
+ */
+void* handleRequest(void* arg) {
+  struct agent_request* req = arg;
+  struct connection* con = req->con;
+  ipc_setResponseContext(con, req->request_id);
+  req->type->handle(req);
+  ipc_setResponseContext(NULL, NULL);
+  clearFreeAgentRequest(req);
+  return con;
+}
+
+/** @fn void finishRequest(void* result, void* arg)
+ * @brief bookkeeping for a finished request. A connection whose client
+ * already disconnected is closed after its last request is done.
+ * @param result the connection the request was read from
+ * @param arg the list of client connections
+ */
+static void finishRequest(void* result, void* arg) {
+  list_t* clientcons = arg;
+  struct connection* con = result;
+  removePending(con);
+  if(con->closing && con->pending==0) {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Remove con from pool");
+    removeConnection(clientcons, con);
+  } else if(con->pending==0) {
+    con->last_active = time(NULL);
+  }
+}
+
+/** @fn void handleFinishedRequests(int fd, void* arg)
+ * @brief bookkeeping for all requests the worker threads finished; see
+ * \f finishRequest
+ * @param fd the result fd of the worker pool
+ * @param arg the list of client connections
+ */
+void handleFinishedRequests(int fd __attribute__((unused)), void* arg) {
+  struct connection* con;
+  while((con = workerpool_nextResult())) {
+    finishRequest(con, arg);
+  }
+}
+
 int main(int argc, char** argv) {
   openlog("oidc-agent", LOG_CONS|LOG_PID, LOG_AUTHPRIV);
   setlogmask(LOG_UPTO(LOG_NOTICE));
@@ -68,6 +423,16 @@ int main(int argc, char** argv) {
   arguments.kill_flag = 0;
   arguments.console = 0;
   arguments.debug = 0;
+  arguments.backlog = DEFAULT_LISTEN_BACKLOG;
+  arguments.workers = DEFAULT_WORKER_THREADS;
+  arguments.refresh_ahead = DEFAULT_REFRESH_AHEAD;
+  arguments.serve_stale = -1;
+  arguments.streams = DEFAULT_STREAMS_PER_HOST;
+  arguments.read_timeout = DEFAULT_READ_TIMEOUT;
+  arguments.idle_timeout = DEFAULT_IDLE_TIMEOUT;
+  arguments.max_connections = DEFAULT_MAX_CONNECTIONS;
+  arguments.max_queued = DEFAULT_MAX_QUEUED;
+  arguments.max_peer_requests = DEFAULT_MAX_PEER_REQUESTS;
   srandom(time(NULL));
 
   argp_parse (&argp, argc, argv, 0, 0, &arguments);
@@ -110,76 +475,105 @@ int main(int argc, char** argv) {
     daemonize();
   }
 
-  ipc_bindAndListen(listencon);
+  signal(SIGPIPE, SIG_IGN); // clients might disconnect before a worker answers
 
-  struct oidc_account* loaded_p = NULL;
-  struct oidc_account** loaded_p_addr = &loaded_p;
-  size_t loaded_p_count = 0;
+  if(ipc_bindAndListen(listencon, arguments.backlog)!=OIDC_SUCCESS) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s", oidc_serror());
+    exit(EXIT_FAILURE);
+  }
+  // threads do not survive fork, so the pool is started after daemonizing
+  if(workerpool_start(arguments.workers)!=OIDC_SUCCESS) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s", oidc_serror());
+    exit(EXIT_FAILURE);
+  }
 
-  struct connection* clientcons = NULL;
-  struct connection** clientcons_addr = &clientcons;
-  size_t number_clients = 0;
+  struct account_table* loaded = newAccountTable();
+  if(loaded==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s", oidc_serror());
+    exit(EXIT_FAILURE);
+  }
+
+  list_t* clientcons = newConnectionList();
+  if(ipc_addWatch(workerpool_getResultFd(), handleFinishedRequests, clientcons)==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s", oidc_serror());
+    exit(EXIT_FAILURE);
+  }
+  // requests finished by the event loop itself are not passed through the pipe
+  workerpool_setResultHandler(finishRequest, clientcons);
+  if(timer_init()!=OIDC_SUCCESS) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s", oidc_serror());
+    exit(EXIT_FAILURE);
+  }
+  if(ipc_setTimeouts(clientcons, arguments.read_timeout, arguments.idle_timeout)!=OIDC_SUCCESS) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s", oidc_serror());
+    exit(EXIT_FAILURE);
+  }
+  if(ipc_logStatsPeriodically(STATS_LOG_INTERVAL)!=OIDC_SUCCESS) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s", oidc_serror());
+    exit(EXIT_FAILURE);
+  }
+  if(httpAsyncInit(arguments.streams)!=OIDC_SUCCESS) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "%s", oidc_serror());
+    exit(EXIT_FAILURE);
+  }
+  initRequestTypes();
+  ipc_setConnectionLimit(arguments.max_connections);
+  max_queued = arguments.max_queued;
+  max_peer_requests = arguments.max_peer_requests;
+  agent_setRefreshAhead(arguments.refresh_ahead);
+  agent_setServeStale(arguments.serve_stale);
 
   while(1) {
-    struct connection* con = ipc_async(*listencon, clientcons_addr, &number_clients);
+    struct connection* con = ipc_async(*listencon, clientcons);
     if(con==NULL) {
       // should never happen
       syslog(LOG_AUTHPRIV|LOG_ALERT, "Something went wrong");
       exit(EXIT_FAILURE);
     } else {
-      char* q = ipc_read(*(con->msgsock));
-      if(NULL!=q) {
-        struct key_value pairs[11];
-        pairs[0].key = "request"; pairs[0].value = NULL;
-        pairs[1].key = "account"; pairs[1].value = NULL;
-        pairs[2].key = "min_valid_period"; pairs[2].value = NULL;
-        pairs[3].key = "config"; pairs[3].value = NULL;
-        pairs[4].key = "flow"; pairs[4].value = NULL;
-        pairs[5].key = "code"; pairs[5].value = NULL;
-        pairs[6].key = "redirect_uri"; pairs[6].value = NULL;
-        pairs[7].key = "state"; pairs[7].value = NULL;
-        pairs[8].key = "authorization"; pairs[8].value = NULL;
-        pairs[9].key = "scope"; pairs[9].value = NULL;
-        pairs[10].key = "oidc_device"; pairs[10].value = NULL;
-        if(getJSONValues(q, pairs, sizeof(pairs)/sizeof(*pairs))<0) {
-          ipc_write(*(con->msgsock), RESPONSE_BADREQUEST, oidc_serror());
+      size_t q_len = 0;
+      char* q = ipc_receive(con, &q_len);
+      if(NULL==q) { // client disconnected
+        if(con->pending > 0) { // close when its last request is done
+          ipc_pauseConnection(con);
+          con->closing = 1;
         } else {
-          if(pairs[0].value) {
-            if(strcmp(pairs[0].value, REQUEST_VALUE_GEN)==0) {
-              agent_handleGen(*(con->msgsock), loaded_p_addr, &loaded_p_count, pairs[3].value, pairs[4].value);
-            } else if(strcmp(pairs[0].value, REQUEST_VALUE_CODEEXCHANGE)==0 ) {
-              agent_handleCodeExchange(*(con->msgsock), loaded_p_addr, &loaded_p_count, pairs[3].value, pairs[5].value, pairs[6].value, pairs[7].value);
-            } else if(strcmp(pairs[0].value, REQUEST_VALUE_STATELOOKUP)==0 ) {
-              agent_handleStateLookUp(*(con->msgsock), *loaded_p_addr, loaded_p_count, pairs[7].value);
-            } else if(strcmp(pairs[0].value, REQUEST_VALUE_DEVICELOOKUP)==0 ) {
-              agent_handleDeviceLookup(*(con->msgsock), loaded_p_addr, &loaded_p_count, pairs[3].value, pairs[10].value);
-            } else if(strcmp(pairs[0].value, REQUEST_VALUE_ADD)==0) {
-              agent_handleAdd(*(con->msgsock), loaded_p_addr, &loaded_p_count, pairs[3].value);
-            } else if(strcmp(pairs[0].value, REQUEST_VALUE_REMOVE)==0) {
-              agent_handleRm(*(con->msgsock), loaded_p_addr, &loaded_p_count, pairs[3].value, 0);
-            } else if(strcmp(pairs[0].value, REQUEST_VALUE_DELETE)==0) {
-              agent_handleRm(*(con->msgsock), loaded_p_addr, &loaded_p_count, pairs[3].value, 1);
-            } else if(strcmp(pairs[0].value, REQUEST_VALUE_ACCESSTOKEN)==0) {
-              agent_handleToken(*(con->msgsock), *loaded_p_addr, loaded_p_count, pairs[1].value, pairs[2].value, pairs[9].value);
-            } else if(strcmp(pairs[0].value, REQUEST_VALUE_ACCOUNTLIST)==0) {
-              agent_handleList(*(con->msgsock), *loaded_p_addr, loaded_p_count);
-            } else if(strcmp(pairs[0].value, REQUEST_VALUE_REGISTER)==0) {
-              agent_handleRegister(*(con->msgsock), *loaded_p_addr, loaded_p_count, pairs[3].value, pairs[8].value);
-            } else {
-              ipc_write(*(con->msgsock), RESPONSE_BADREQUEST, "Unknown request type.");
-            }
-          } else {
-            ipc_write(*(con->msgsock), RESPONSE_BADREQUEST, "No request type.");
-          }
+          syslog(LOG_AUTHPRIV|LOG_DEBUG, "Remove con from pool");
+          removeConnection(clientcons, con);
         }
-        clearFreeKeyValuePairs(pairs, sizeof(pairs)/sizeof(*pairs));
-        clearFreeString(q);
+        continue;
+      }
+      if(ipc_negotiate(con, q, q_len)) {
+        continue;
+      }
+      // the connection stays open for further requests, which might be sent
+      // before this one is answered
+      struct json_stats before = json_getStats();
+      struct agent_request* req = parseAgentRequest(con, loaded, q, q_len);
+      memset(q, 0, q_len); // the buffer is reused
+      if(req==NULL) {
+        continue;
+      }
+      ipc_setResponseContext(con, req->request_id);
+      int state = REQUEST_DONE;
+      if(req->type->handleInline) {
+        state = req->type->handleInline(req);
+      } else if(admitRequest(req)) {
+        state = REQUEST_ASYNC;
+      }
+      ipc_setResponseContext(NULL, NULL);
+      struct json_stats after = json_getStats();
+      syslog(LOG_AUTHPRIV|LOG_DEBUG, "Request '%s' parsed and dispatched with %lu json parses and %lu json allocations", req->type->name, after.parses - before.parses, after.allocations - before.allocations);
+      if(state==REQUEST_DONE) {
+        clearFreeAgentRequest(req);
+        continue;
+      }
+      addPending(con);
+      if(state==REQUEST_ASYNC) {
+        workerpool_submit(handleRequest, req);
+      } else {
+        clearFreeAgentRequest(req);
       }
-      syslog(LOG_AUTHPRIV|LOG_DEBUG, "Remove con from pool");
-      clientcons = removeConnection(*clientcons_addr, &number_clients, con);
-      clientcons_addr = &clientcons;
     }
   }
   return EXIT_FAILURE;
 }
-
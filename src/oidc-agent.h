@@ -2,22 +2,57 @@
 #define OIDC_AGENT_H
 
 #include "version.h"
+#include "settings.h"
 
 #include <argp.h>
+#include <ctype.h>
+#include <stdlib.h>
 
 const char *argp_program_version = AGENT_VERSION;
 
 const char *argp_program_bug_address = BUG_ADDRESS;
 
+#define OPT_BACKLOG 1001
+#define OPT_WORKERS 1002
+#define OPT_REFRESHAHEAD 1003
+#define OPT_SERVESTALE 1004
+#define OPT_STREAMS 1005
+#define OPT_READTIMEOUT 1006
+#define OPT_IDLETIMEOUT 1007
+#define OPT_MAXCONNECTIONS 1008
+#define OPT_MAXQUEUED 1009
+#define OPT_MAXPEERREQUESTS 1010
+
 struct arguments {
   int kill_flag;
   int debug;
   int console;
+  int backlog;
+  int workers;
+  int refresh_ahead;
+  int serve_stale;
+  int streams;
+  int read_timeout;
+  int idle_timeout;
+  int max_connections;
+  int max_queued;
+  int max_peer_requests;
 };
 
 static struct argp_option options[] = {
   {0, 0, 0, 0, "General:", 1},
   {"kill", 'k', 0, 0, "Kill the current agent (given by the OIDCD_PID environment variable)", 1},
+  {0, 0, 0, 0, "Tuning:", 3},
+  {"backlog", OPT_BACKLOG, "SIZE", 0, "Maximum number of pending connections on the agent socket", 3},
+  {"workers", OPT_WORKERS, "N", 0, "Number of threads handling requests that need to contact an OpenID Provider, except token refreshes, which never block. If 0 these requests are handled sequentially", 3},
+  {"refresh-ahead", OPT_REFRESHAHEAD, "SECONDS", 0, "Access tokens of accounts in use are refreshed in the background when they are valid for less than SECONDS more than requested by clients. If 0 tokens are only refreshed on request", 3},
+  {"serve-stale", OPT_SERVESTALE, "SECONDS", 0, "Answer token requests the cached access token is not valid long enough for with that token, while it is refreshed in the background, as long as it is valid for more than SECONDS. Disabled by default", 3},
+  {"read-timeout", OPT_READTIMEOUT, "SECONDS", 0, "Close connections of clients that do not send a request within SECONDS after connecting. If 0 they are never closed", 3},
+  {"idle-timeout", OPT_IDLETIMEOUT, "SECONDS", 0, "Close connections of clients that do not send another request within SECONDS after their last one was answered. If 0 they are never closed", 3},
+  {"max-connections", OPT_MAXCONNECTIONS, "N", 0, "Maximum number of client connections. Further connections are answered with busy and closed. If 0 there is no limit", 3},
+  {"max-queued", OPT_MAXQUEUED, "N", 0, "Maximum number of requests waiting for a worker or an OpenID Provider. Further requests are answered with busy. If 0 there is no limit", 3},
+  {"max-peer-requests", OPT_MAXPEERREQUESTS, "N", 0, "Maximum number of requests of one user, identified by the uid of the client process, waiting for a worker or an OpenID Provider. Further requests of that user are answered with busy. If 0 there is no limit", 3},
+  {"streams", OPT_STREAMS, "N", 0, "Maximum number of concurrent token refreshes sent to one OpenID Provider. They are multiplexed over one connection if the provider supports HTTP/2; further refreshes are queued", 3},
   {0, 0, 0, 0, "Verbosity:", 2},
   {"debug", 'g', 0, 0, "Sets the log level to DEBUG", 2},
   {"console", 'c', 0, 0, "Runs oidc-agent on the console, without daemonizing", 2},
@@ -29,7 +64,7 @@ static struct argp_option options[] = {
 static char args_doc[] = "";
 static char doc[] = "oidc-agent -- An agent to manage oidc token";
 
-static error_t parse_opt (int key, char *arg __attribute__((unused)), struct argp_state *state) {
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
   struct arguments *arguments = state->input;
   switch (key) {
     case 'k':
@@ -41,6 +76,66 @@ static error_t parse_opt (int key, char *arg __attribute__((unused)), struct arg
     case 'c':
       arguments->console = 1;
       break;
+    case OPT_BACKLOG:
+      if(!isdigit(*arg) || atoi(arg) <= 0) {
+        argp_error(state, "SIZE has to be a positive number");
+      }
+      arguments->backlog = atoi(arg);
+      break;
+    case OPT_WORKERS:
+      if(!isdigit(*arg) || atoi(arg) < 0) {
+        argp_error(state, "N has to be a non-negative number");
+      }
+      arguments->workers = atoi(arg);
+      break;
+    case OPT_REFRESHAHEAD:
+      if(!isdigit(*arg) || atoi(arg) < 0) {
+        argp_error(state, "SECONDS has to be a non-negative number");
+      }
+      arguments->refresh_ahead = atoi(arg);
+      break;
+    case OPT_SERVESTALE:
+      if(!isdigit(*arg) || atoi(arg) < 0) {
+        argp_error(state, "SECONDS has to be a non-negative number");
+      }
+      arguments->serve_stale = atoi(arg);
+      break;
+    case OPT_STREAMS:
+      if(!isdigit(*arg) || atoi(arg) <= 0) {
+        argp_error(state, "N has to be a positive number");
+      }
+      arguments->streams = atoi(arg);
+      break;
+    case OPT_READTIMEOUT:
+      if(!isdigit(*arg) || atoi(arg) < 0) {
+        argp_error(state, "SECONDS has to be a non-negative number");
+      }
+      arguments->read_timeout = atoi(arg);
+      break;
+    case OPT_IDLETIMEOUT:
+      if(!isdigit(*arg) || atoi(arg) < 0) {
+        argp_error(state, "SECONDS has to be a non-negative number");
+      }
+      arguments->idle_timeout = atoi(arg);
+      break;
+    case OPT_MAXCONNECTIONS:
+      if(!isdigit(*arg) || atoi(arg) < 0) {
+        argp_error(state, "N has to be a non-negative number");
+      }
+      arguments->max_connections = atoi(arg);
+      break;
+    case OPT_MAXQUEUED:
+      if(!isdigit(*arg) || atoi(arg) < 0) {
+        argp_error(state, "N has to be a non-negative number");
+      }
+      arguments->max_queued = atoi(arg);
+      break;
+    case OPT_MAXPEERREQUESTS:
+      if(!isdigit(*arg) || atoi(arg) < 0) {
+        argp_error(state, "N has to be a non-negative number");
+      }
+      arguments->max_peer_requests = atoi(arg);
+      break;
     case 'h':
       argp_state_help (state, state->out_stream, ARGP_HELP_STD_HELP);
       break;
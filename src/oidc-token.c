@@ -17,8 +17,30 @@ int main (int argc, char **argv) {
       clearFreeString(accountList);
     }
   }
-  if(arguments.args[0]) {
-    char* access_token = getAccessToken(arguments.args[0], arguments.min_valid_period, arguments.scope); // for getting an valid access token just call the api
+  if(arguments.account_count > 1) {
+    struct token_request requests[arguments.account_count];
+    size_t i;
+    for(i=0; i<arguments.account_count; i++) {
+      requests[i].accountname = arguments.accounts[i];
+      requests[i].min_valid_period = arguments.min_valid_period;
+      requests[i].scope = arguments.scope;
+    }
+    if(getAccessTokens(requests, arguments.account_count) < 0) { // multiple tokens are requested at once
+      printError("Error: %s\n", oidcagent_serror());
+      return 0;
+    }
+    for(i=0; i<arguments.account_count; i++) {
+      if(requests[i].access_token==NULL) {
+        printError("Error for account %s: %s\n", requests[i].accountname, requests[i].error);
+        printf("\n"); // keep the tokens in line with the accounts
+      } else {
+        printf("%s\n", requests[i].access_token);
+      }
+      clearFreeString(requests[i].access_token);
+      clearFreeString(requests[i].error);
+    }
+  } else if(arguments.account_count == 1) {
+    char* access_token = getAccessToken(arguments.accounts[0], arguments.min_valid_period, arguments.scope); // for getting an valid access token just call the api
     if(access_token==NULL) {
       printError("Error: %s\n", oidcagent_serror());
     } else {
@@ -11,7 +11,8 @@ const char *argp_program_version = TOKEN_VERSION;
 const char *argp_program_bug_address = BUG_ADDRESS;
 
 struct arguments {
-  char* args[1];            /* account shortname */
+  char** accounts;          /* account shortnames */
+  size_t account_count;
   int list_accounts;
   unsigned long min_valid_period;  
   char* scope;
@@ -48,17 +49,15 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     case 'h':
       argp_state_help (state, state->out_stream, ARGP_HELP_STD_HELP);
       break;
-    case ARGP_KEY_ARG:
-      if(state->arg_num >= 1) {
-        argp_usage(state);
-      }
-      arguments->args[state->arg_num] = arg;
+    case ARGP_KEY_ARGS:
+      arguments->accounts = state->argv + state->next;
+      arguments->account_count = state->argc - state->next;
       break;
     case ARGP_KEY_END:
       if(arguments->list_accounts) {
         break;
       }
-      if (state->arg_num < 1) {
+      if (arguments->account_count < 1) {
         argp_usage (state);
       }
       break;
@@ -68,16 +67,17 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
   return 0;
 }
 
-static char args_doc[] = "ACCOUNT_SHORTNAME | -l";
+static char args_doc[] = "ACCOUNT_SHORTNAME... | -l";
 
-static char doc[] = "oidc-token -- A client for oidc-agent for getting OIDC access tokens.";
+static char doc[] = "oidc-token -- A client for oidc-agent for getting OIDC access tokens.\vIf multiple account short names are given, all tokens are requested at once and printed one per line in the given order.";
 
 static struct argp argp = {options, parse_opt, args_doc, doc, 0, 0, 0};
 
 static void initArguments(struct arguments* arguments) {
   arguments->min_valid_period = 0;
   arguments->list_accounts = 0;
-  arguments->args[0] = NULL;
+  arguments->accounts = NULL;
+  arguments->account_count = 0;
   arguments->scope = NULL;
 }
 
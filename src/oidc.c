@@ -6,6 +6,7 @@
 #include "parse_oidp.h"
 #include "ipc_values.h"
 #include "issuer_helper.h"
+#include "discovery_cache.h"
 #include "oidc_utilities.h"
 
 #include <stdlib.h>
@@ -38,63 +39,168 @@ oidc_error_t tryPasswordFlow(struct oidc_account* p) {
   return passwordFlow(p);
 }
 
-/** @fn oidc_error_t refreshFlow(struct oidc_account* p)
- * @brief issues an access token via refresh flow
- * @param p a pointer to the account for whom an access token should be issued
- * @return 0 on success; 1 otherwise
+/** @fn int refreshErrorType(const char* error)
+ * @brief classifies an error returned by the token endpoint
+ * @param error the OAuth2 error code
+ * @return OIDC_EGRANT if the refresh token or client cannot be used anymore;
+ * OIDC_ESCOPE if the requested scope cannot be granted; in both cases
+ * retrying is useless. OIDC_EOIDC otherwise.
  */
-char* refreshFlow(struct oidc_account* p, const char* scope) {
-  syslog(LOG_AUTHPRIV|LOG_DEBUG,"Doing RefreshFlow\n");
+static int refreshErrorType(const char* error) {
+  if(error==NULL) {
+    return OIDC_EOIDC;
+  }
+  if(strcmp(error, "invalid_grant")==0 ||
+      strcmp(error, "invalid_client")==0 ||
+      strcmp(error, "unauthorized_client")==0) {
+    return OIDC_EGRANT;
+  }
+  if(strcmp(error, "invalid_scope")==0) {
+    return OIDC_ESCOPE;
+  }
+  return OIDC_EOIDC;
+}
+
+static char* refreshFlowData(struct oidc_account* p, const char* scope) {
   const char* format = isValid(scope) ?
     "client_id=%s&client_secret=%s&grant_type=refresh_token&refresh_token=%s&scope=%s" :
     "client_id=%s&client_secret=%s&grant_type=refresh_token&refresh_token=%s";
   char* data = oidc_sprintf(format, account_getClientId(*p), account_getClientSecret(*p), account_getRefreshToken(*p), scope);
   if(data == NULL) {
-    return NULL;;
+    return NULL;
   }
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Data to send: %s",data);
-  char* res = httpsPOST(account_getTokenEndpoint(*p), data, NULL, account_getCertPath(*p), account_getClientId(*p), account_getClientSecret(*p));
-  clearFreeString(data);
-  if(NULL==res) {
-    return NULL;;
-  }
-  struct key_value pairs[3];
+  return data;
+}
+
+/** @fn char* handleRefreshResponse(struct oidc_account* p, const char* scope,
+ * char* res)
+ * @brief stores the access token of a refresh flow response in the account
+ * @param res the response of the token endpoint; it is freed
+ * @return the access token; see \f refreshFlow
+ */
+static char* handleRefreshResponse(struct oidc_account* p, const char* scope, char* res) {
+  struct key_view pairs[6];
   pairs[0].key = "access_token";
   pairs[1].key = "expires_in";
   pairs[2].key = "refresh_token";
-  pairs[0].value = NULL;
-  pairs[1].value = NULL;
-  pairs[2].value = NULL;
-  if(getJSONValues(res, pairs, sizeof(pairs)/sizeof(pairs[0]))<0) {
+  pairs[3].key = "scope";
+  pairs[4].key = "error";
+  pairs[5].key = "error_description";
+  // only the values that are kept are copied
+  static struct json_keyset keyset = JSON_KEYSET_INIT;
+  if(getJSONViews(res, pairs, sizeof(pairs)/sizeof(pairs[0]), &keyset)<0) {
     syslog(LOG_AUTHPRIV|LOG_ALERT, "Error while parsing json\n");
     clearFreeString(res);
     return NULL;
   }
-  if(NULL!=pairs[1].value) {
-    account_setTokenExpiresAt(p, time(NULL)+atoi(pairs[1].value));
-    syslog(LOG_AUTHPRIV|LOG_DEBUG, "expires_at is: %lu\n",account_getTokenExpiresAt(*p));
-    clearFreeString(pairs[1].value);
+  unsigned long expires_at = 0;
+  if(NULL!=pairs[1].value.data) {
+    expires_at = time(NULL)+json_viewToLong(pairs[1].value);
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "expires_at is: %lu\n", expires_at);
   }
-  if(NULL==pairs[0].value) {
-    char* error = getJSONValue(res, "error");
-    char* errormessage = getJSONValue(res, "error_description");
+  if(NULL==pairs[0].value.data) {
+    char* error = json_viewCopy(pairs[4].value);
+    char* errormessage = json_viewCopy(pairs[5].value);
     syslog(LOG_AUTHPRIV|LOG_CRIT, "%s\n", errormessage ? errormessage : error);
     oidc_seterror(errormessage ? errormessage : error);
+    oidc_errno = refreshErrorType(error);
     clearFreeString(error);
     clearFreeString(errormessage);
     clearFreeString(res);
-    oidc_errno = OIDC_EOIDC;
     return NULL;
   }
-  if(isValid(pairs[2].value) && strcmp(account_getRefreshToken(*p), pairs[2].value)!=0) {
+  if(pairs[2].value.len>0 && !json_viewEquals(pairs[2].value, account_getRefreshToken(*p))) {
     syslog(LOG_AUTHPRIV|LOG_WARNING, "WARNING: Received new refresh token from OIDC Account. It's most likely that the old one was therefore revoked. We did not save the new refresh token. You may want to revoke it. You have to run oidc-gen again.");
   }
-  clearFreeString(pairs[2].value);
-  clearFreeString(res);
+  char* access_token = json_viewCopy(pairs[0].value);
   if(!isValid(scope)) {
-    account_setAccessToken(p, pairs[0].value);
+    account_setAccessToken(p, access_token);
+    if(expires_at) {
+      account_setTokenExpiresAt(p, expires_at);
+    }
+  } else if(expires_at) { // tokens for other scopes are cached separately
+    if(account_getScopedTokens(*p)==NULL) {
+      account_setScopedTokens(p, newTokenCache(MAX_SCOPED_TOKENS));
+    }
+    char* granted_scope = json_viewCopy(pairs[3].value);
+    tokencache_put(account_getScopedTokens(*p), scope, granted_scope, access_token, expires_at);
+    clearFreeString(granted_scope);
+  }
+  clearFreeString(res);
+  return access_token;
+}
+
+/** @fn oidc_error_t refreshFlow(struct oidc_account* p)
+ * @brief issues an access token via refresh flow
+ * @param p a pointer to the account for whom an access token should be issued
+ * @return 0 on success; 1 otherwise
+ */
+char* refreshFlow(struct oidc_account* p, const char* scope) {
+  syslog(LOG_AUTHPRIV|LOG_DEBUG,"Doing RefreshFlow\n");
+  char* data = refreshFlowData(p, scope);
+  if(data == NULL) {
+    return NULL;
+  }
+  char* res = httpsPOST(account_getTokenEndpoint(*p), data, NULL, account_getCertPath(*p), account_getClientId(*p), account_getClientSecret(*p));
+  clearFreeString(data);
+  if(NULL==res) {
+    return NULL;
+  }
+  return handleRefreshResponse(p, scope, res);
+}
+
+struct refresh_flow {
+  struct oidc_account* account;
+  char* scope;
+  refresh_callback callback;
+  void* arg;
+};
+
+static void refreshFlowDone(char* res, void* arg) {
+  struct refresh_flow* flow = arg;
+  char* access_token = res ? handleRefreshResponse(flow->account, flow->scope, res) : NULL;
+  // tokens for other scopes are not owned by the account
+  char* scoped_token = isValid(flow->scope) ? access_token : NULL;
+  flow->callback(flow->account, access_token, flow->arg);
+  clearFreeString(scoped_token);
+  clearFreeString(flow->scope);
+  clearFree(flow, sizeof(struct refresh_flow));
+}
+
+/** @fn void refreshFlowAsync(struct oidc_account* p, const char* scope,
+ * refresh_callback callback, void* arg)
+ * @brief issues an access token via refresh flow without waiting for the
+ * OpenID Provider. Has to be called by the thread running the event loop.
+ * @param p the account; it is updated like by \f refreshFlow and must not be
+ * used by anyone else until \p callback is called
+ * @param callback called exactly once, by the event loop when the request is
+ * done or immediately if it could not be started. It gets the access token
+ * (only valid during the call) or NULL on failure; then oidc_errno is set.
+ * @param arg passed to \p callback
+ */
+void refreshFlowAsync(struct oidc_account* p, const char* scope, refresh_callback callback, void* arg) {
+  syslog(LOG_AUTHPRIV|LOG_DEBUG,"Doing RefreshFlow asynchronously\n");
+  char* data = refreshFlowData(p, scope);
+  struct refresh_flow* flow = data ? calloc(sizeof(struct refresh_flow), 1) : NULL;
+  if(flow==NULL) {
+    if(data) {
+      syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+      oidc_errno = OIDC_EALLOC;
+    }
+    clearFreeString(data);
+    callback(p, NULL, arg);
+    return;
+  }
+  flow->account = p;
+  flow->scope = oidc_strcopyIfValid(scope);
+  flow->callback = callback;
+  flow->arg = arg;
+  oidc_error_t e = httpsPOSTAsync(account_getTokenEndpoint(*p), data, NULL, account_getCertPath(*p), account_getClientId(*p), account_getClientSecret(*p), refreshFlowDone, flow);
+  clearFreeString(data);
+  if(e!=OIDC_SUCCESS) {
+    refreshFlowDone(NULL, flow);
   }
-  return pairs[0].value;
 }
 
 //TODO refactor passwordflow and refreshFlow. There are some quite big
@@ -125,7 +231,8 @@ oidc_error_t passwordFlow(struct oidc_account* p) {
   pairs[0].value = NULL;
   pairs[1].value = NULL;
   pairs[2].value = NULL;
-  if(getJSONValues(res, pairs, sizeof(pairs)/sizeof(pairs[0]))<0) {
+  static struct json_keyset keyset = JSON_KEYSET_INIT;
+  if(getJSONValuesByKeySet(res, pairs, sizeof(pairs)/sizeof(pairs[0]), &keyset)<0) {
     syslog(LOG_AUTHPRIV|LOG_ALERT, "Error while parsing json\n");
     clearFreeString(res);
     return oidc_errno;
@@ -217,32 +324,34 @@ char* dynamicRegistration(struct oidc_account* account, int usePasswordGrantType
     return NULL;
   }
 
-  char* json = calloc(sizeof(char), 2+1);
-  strcpy(json, "{}");
-  json = json_addStringValue(json, "application_type", "web");
-  json = json_addStringValue(json, "client_name", client_name);
+  struct json_writer w;
+  jsonwriter_init(&w);
+  jsonwriter_beginObject(&w);
+  jsonwriter_addString(&w, "application_type", "web");
+  jsonwriter_addString(&w, "client_name", client_name);
   clearFreeString(client_name);
   char* response_types = getUsableResponseTypes(*account, usePasswordGrantType);
-  json = json_addValue(json, "response_types", response_types);
+  jsonwriter_addRaw(&w, "response_types", response_types);
   clearFreeString(response_types);
   char* grant_types = getUsableGrantTypes(account_getGrantTypesSupported(*account), usePasswordGrantType);
-  json = json_addValue(json, "grant_types", grant_types);
+  jsonwriter_addRaw(&w, "grant_types", grant_types);
   clearFreeString(grant_types);
-  json = json_addStringValue(json, "scope", account_getScope(*account));
-  char* redirect_uris_json = calloc(sizeof(char), 2+1);
-  strcpy(redirect_uris_json, "[]");
-  char* redirect_uri = portToUri(HTTP_DEFAULT_PORT);
-  redirect_uris_json = json_arrAdd(redirect_uris_json, redirect_uri);
-  clearFreeString(redirect_uri);
-  redirect_uri = portToUri(getRandomPort());
-  redirect_uris_json = json_arrAdd(redirect_uris_json, redirect_uri);
-  clearFreeString(redirect_uri);
-  redirect_uri = portToUri(HTTP_FALLBACK_PORT);
-  redirect_uris_json = json_arrAdd(redirect_uris_json, redirect_uri);
-  clearFreeString(redirect_uri);
-  json = json_addValue(json, "redirect_uris", redirect_uris_json);
-  clearFreeString(redirect_uris_json);
-
+  jsonwriter_addString(&w, "scope", account_getScope(*account));
+  jsonwriter_key(&w, "redirect_uris");
+  jsonwriter_beginArray(&w);
+  unsigned short ports[] = {HTTP_DEFAULT_PORT, getRandomPort(), HTTP_FALLBACK_PORT};
+  unsigned int i;
+  for(i=0; i<sizeof(ports)/sizeof(*ports); i++) {
+    char* redirect_uri = portToUri(ports[i]);
+    jsonwriter_string(&w, redirect_uri);
+    clearFreeString(redirect_uri);
+  }
+  jsonwriter_endArray(&w);
+  jsonwriter_endObject(&w);
+  char* json = jsonwriter_finish(&w);
+  if(json==NULL) {
+    return NULL;
+  }
 
   struct curl_slist* headers = curl_slist_append(NULL, "Content-Type: application/json");
   if(isValid(access_token)) {
@@ -280,7 +389,8 @@ oidc_error_t codeExchange(struct oidc_account* account, const char* code, const
   pairs[0].value = NULL;
   pairs[1].value = NULL;
   pairs[2].value = NULL;
-  if(getJSONValues(res, pairs, sizeof(pairs)/sizeof(pairs[0]))<0) {
+  static struct json_keyset keyset = JSON_KEYSET_INIT;
+  if(getJSONValuesByKeySet(res, pairs, sizeof(pairs)/sizeof(pairs[0]), &keyset)<0) {
     syslog(LOG_AUTHPRIV|LOG_ALERT, "Error while parsing json\n");
     clearFreeString(res);
     return oidc_errno;
@@ -350,7 +460,8 @@ oidc_error_t lookUpDeviceCode(struct oidc_account* account, const char* device_c
   pairs[2].key = "expires_in"; pairs[2].value = NULL;
   pairs[3].key = "error"; pairs[3].value = NULL;
   pairs[4].key = "error_description"; pairs[4].value = NULL;
-  if(getJSONValues(res, pairs, sizeof(pairs)/sizeof(pairs[0]))<0) {
+  static struct json_keyset keyset = JSON_KEYSET_INIT;
+  if(getJSONValuesByKeySet(res, pairs, sizeof(pairs)/sizeof(pairs[0]), &keyset)<0) {
     syslog(LOG_AUTHPRIV|LOG_ALERT, "Error while parsing json\n");
     clearFreeString(res);
     return oidc_errno;
@@ -420,7 +531,8 @@ char* buildCodeFlowUri(struct oidc_account* account, char* state) {
 }
 
 /** @fn oidc_error_t getIssuerConfig(struct oidc_account* account)
- * @brief retrieves issuer config from the configuration_endpoint
+ * @brief retrieves issuer config from the configuration_endpoint; it is
+ * cached, see \f discovery_get
  * @note the issuer url has to be set prior
  * @param account the account struct, will be updated with the retrieved
  * config
@@ -430,52 +542,12 @@ oidc_error_t getIssuerConfig(struct oidc_account* account) {
   char* configuration_endpoint = oidc_strcat(account_getIssuerUrl(*account), CONF_ENDPOINT_SUFFIX);
   issuer_setConfigurationEndpoint(account_getIssuer(*account), configuration_endpoint);
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "%s", account_getConfigEndpoint(*account));
-  char* res = httpsGET(account_getConfigEndpoint(*account), NULL, account_getCertPath(*account));
-  if(NULL==res) {
-    return oidc_errno;
-  }
-  struct key_value pairs[8];
-  pairs[0].key = "token_endpoint"; pairs[0].value = NULL;
-  pairs[1].key = "authorization_endpoint"; pairs[1].value = NULL;
-  pairs[2].key = "registration_endpoint"; pairs[2].value = NULL;
-  pairs[3].key = "revocation_endpoint"; pairs[3].value = NULL;
-  pairs[4].key = "device_authorization_endpoint"; pairs[3].value = NULL;
-  pairs[5].key = "scopes_supported"; pairs[4].value = NULL;
-  pairs[6].key = "grant_types_supported"; pairs[5].value = NULL;
-  pairs[7].key = "response_types_supported"; pairs[6].value = NULL;
-  if(getJSONValues(res, pairs, sizeof(pairs)/sizeof(*pairs))<0) {
-    clearFreeString(res);
-    return oidc_errno;
-  }
-  clearFreeString(res);
-
-  if(pairs[0].value==NULL) {
-    syslog(LOG_AUTHPRIV|LOG_ERR, "Could not get token_endpoint");
-    clearFreeKeyValuePairs(pairs, sizeof(pairs)/sizeof(*pairs));
-    oidc_seterror("Could not get token_endpoint from the configuration_endpoint. This could be because of a network issue. But it's more likely that your issuer is not correct.");
-    oidc_errno = OIDC_EERROR;
-    return oidc_errno;
-  }
-  if(pairs[0].value) {issuer_setTokenEndpoint(account_getIssuer(*account), pairs[0].value);}
-  if(pairs[1].value) {issuer_setAuthorizationEndpoint(account_getIssuer(*account), pairs[1].value);}
-  if(pairs[2].value) {issuer_setRegistrationEndpoint(account_getIssuer(*account), pairs[2].value);}
-  if(pairs[3].value) {issuer_setRevocationEndpoint(account_getIssuer(*account), pairs[3].value);}
-  if(pairs[4].value) {issuer_setDeviceAuthorizationEndpoint(account_getIssuer(*account), pairs[4].value);}
-  if(pairs[6].value==NULL) {
-    const char* defaultValue = "[\"authorization_code\", \"implicit\"]";
-    pairs[6].value = oidc_sprintf("%s", defaultValue);
-  }
-  char* scopes_supported = JSONArrrayToDelimitedString(pairs[5].value, ' ');
-  if(scopes_supported==NULL) {
-    clearFreeString(pairs[5].value);
-    clearFreeString(pairs[6].value);
-    clearFreeString(pairs[7].value);
+  struct oidc_issuer* metadata = discovery_get(account_getConfigEndpoint(*account), account_getCertPath(*account));
+  if(metadata==NULL) {
     return oidc_errno;
   }
-  account_setScopesSupported(account, scopes_supported);    
-  clearFreeString(pairs[5].value);
-  issuer_setGrantTypesSupported(account_getIssuer(*account), pairs[6].value);
-  issuer_setResponseTypesSupported(account_getIssuer(*account), pairs[7].value);
+  // also determines the usable scopes
+  account_setMetadata(account, metadata);
   syslog(LOG_AUTHPRIV|LOG_DEBUG, "Successfully retrieved endpoints.");
   return OIDC_SUCCESS;
 
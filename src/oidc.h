@@ -8,9 +8,12 @@
 
 #define FORCE_NEW_TOKEN -1
 
+typedef void (*refresh_callback)(struct oidc_account* p, const char* access_token, void* arg);
+
 char* tryRefreshFlow(struct oidc_account* p, const char* scope) ;
 oidc_error_t tryPasswordFlow(struct oidc_account* p) ;
 char* refreshFlow(struct oidc_account* p, const char* scope) ;
+void refreshFlowAsync(struct oidc_account* p, const char* scope, refresh_callback callback, void* arg) ;
 oidc_error_t passwordFlow(struct oidc_account* p) ;
 int tokenIsValidForSeconds(struct oidc_account p, time_t min_valid_period);
 char* dynamicRegistration(struct oidc_account* account, int useGrantType, const char* access_token) ;
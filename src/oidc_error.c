@@ -0,0 +1,4 @@
+#include "oidc_error.h"
+
+__thread int oidc_errno;
+__thread char oidc_error[256];
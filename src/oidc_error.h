@@ -34,6 +34,7 @@ enum _oidc_error {
   OIDC_EJSONARR = -32,
   OIDC_EJSONNOFOUND = -33,
   OIDC_EJSONADD   = -34,
+  OIDC_ETLV       = -35,
 
   OIDC_ETCS     = -40,
   OIDC_EIN      = -41,
@@ -43,6 +44,8 @@ enum _oidc_error {
   OIDC_ECRED      = -52,
   OIDC_ENOREFRSH  = -53,
   OIDC_ENODEVICE  = -54,
+  OIDC_EGRANT     = -55,
+  OIDC_ESCOPE     = -56,
 
   OIDC_EMKTMP     = -60,
   OIDC_EENVVAR    = -61,
@@ -52,6 +55,7 @@ enum _oidc_error {
   OIDC_ESOCKINV   = -65,
   OIDC_EIPCDIS    = -66,
 
+  OIDC_EEPOLL     = -67,
   OIDC_ESELECT    = -68,
   OIDC_EIOCTL     = -69,
 
@@ -61,6 +65,8 @@ enum _oidc_error {
   OIDC_EHTTPPORTS = -80,
   OIDC_ENOREURI   = -82,
 
+  OIDC_ETHREAD    = -90,
+
   OIDC_NOTIMPL    = -1000,
 
   OIDC_ENOPE      = -1337,
@@ -68,8 +74,10 @@ enum _oidc_error {
 
 typedef enum _oidc_error oidc_error_t;
 
-int oidc_errno;
-char oidc_error[256];
+// thread local, so that the agent's worker threads do not overwrite each
+// others errors; defined in oidc_error.c
+extern __thread int oidc_errno;
+extern __thread char oidc_error[256];
 
 static inline void oidc_seterror(char* error) {
   memset(oidc_error, 0, sizeof(oidc_error));
@@ -118,6 +126,7 @@ static inline char* oidc_serror() {
     case OIDC_EJSONARR: return "is not a json array";
     case OIDC_EJSONNOFOUND: return "could not find key";
     case OIDC_EJSONADD: return "The json string does not end with '}'";
+    case OIDC_ETLV: return "malformed binary message";
     case OIDC_ETCS: return "error tcsetattr";
     case OIDC_EIN: return "error getline";
     case OIDC_EBADCONFIG: return "bad configuration";
@@ -125,6 +134,8 @@ static inline char* oidc_serror() {
     case OIDC_ECRED: return "Bad credentials";
     case OIDC_ENOREFRSH: return "No refresh token";
     case OIDC_ENODEVICE: return "Device Flow not Supported";
+    case OIDC_EGRANT: return oidc_error;
+    case OIDC_ESCOPE: return oidc_error;
     case OIDC_EMKTMP: return "Could not make temp socket directory";
     case OIDC_EENVVAR: return "Env var not set";
     case OIDC_EBIND: return "Could not bind ipc-socket";
@@ -133,11 +144,13 @@ static inline char* oidc_serror() {
     case OIDC_ESOCKINV: return "Invalid socket";
     case OIDC_EIOCTL: return "error ioctl";
     case OIDC_EIPCDIS: return "the other party disconnected";
+    case OIDC_EEPOLL: return "error epoll";
     case OIDC_ESELECT: return "error select";
     case OIDC_EMAXTRIES: return "reached maximum number of tries";
     case OIDC_EHTTPD: return "Could not start http server";
     case OIDC_EHTTPPORTS: return "Could not start the http server on any of the registered redirect uris.";
     case OIDC_ENOREURI: return "No redirect_uri specified";
+    case OIDC_ETHREAD: return "Could not start worker thread";
     case OIDC_NOTIMPL: return "Not yet implemented";
     case OIDC_ENOPE: return "Computer says NO!";
     default: return "Computer says NO!";
@@ -109,6 +109,15 @@ char* oidc_strcopy(const char* str) {
   return oidc_sprintf("%s", str);
 }
 
+/** @fn char* oidc_strcopyIfValid(const char* str)
+ * @brief copies a string, but unlike \f oidc_strcopy keeps NULL as NULL
+ * @param str the string to be copied
+ * @return a copy of \p str or NULL. Has to be freed after usage.
+ */
+char* oidc_strcopyIfValid(const char* str) {
+  return str ? oidc_strcopy(str) : NULL;
+}
+
 
 
 long random_at_most(long max) {
@@ -184,10 +193,11 @@ char* delimitedListToJSONArray(char* str, char delimiter) {
   char* copy = oidc_sprintf("%s", str);
   int len = strlen(copy);
   char* delim = oidc_sprintf("%c", delimiter);
-  char* json = oidc_sprintf("\"%s\"", strtok(copy, delim));
+  char* saveptr = NULL;
+  char* json = oidc_sprintf("\"%s\"", strtok_r(copy, delim, &saveptr));
   size_t i;
   for(i=1; i<size; i++) {
-    char* tmp = oidc_sprintf("%s, \"%s\"", json, strtok(NULL, delim));
+    char* tmp = oidc_sprintf("%s, \"%s\"", json, strtok_r(NULL, delim, &saveptr));
     clearFreeString(json);
     if(tmp==NULL) {
       clearFreeString(delim);
@@ -249,10 +259,11 @@ list_t* delimitedStringToList(char* str, char delimiter) {
   list_t* list = list_new();
   list->free = (void(*) (void*)) &clearFreeString;
   list->match = (int(*) (void*, void*)) &strequal;
-  char* elem = strtok(copy, delim);
+  char* saveptr = NULL;
+  char* elem = strtok_r(copy, delim, &saveptr);
   while(elem!=NULL) {
-    list_rpush(list, list_node_new(oidc_sprintf(elem)));
-    elem = strtok(NULL, delim);
+    list_rpush(list, list_node_new(oidc_strcopy(elem)));
+    elem = strtok_r(NULL, delim, &saveptr);
   }
   clearFreeString(delim);
   clearFree(copy, len);
@@ -332,10 +343,11 @@ int listStringToArray(const char* str, char delimiter, char** arr) {
   if(arr_str[0]=='[') { arr_str++;  }
   if(arr_str[strlen(arr_str)-1]==']') { arr_str[strlen(arr_str)-1] = '\0'; }
   char* delim = oidc_sprintf("%c", delimiter);
-  arr[0] = oidc_sprintf("%s", strtok(arr_str, delim));
+  char* saveptr = NULL;
+  arr[0] = oidc_sprintf("%s", strtok_r(arr_str, delim, &saveptr));
   unsigned int i;
   for(i=1; i<size; i++) {
-    arr[i] = oidc_sprintf("%s", strtok(NULL, delim));
+    arr[i] = oidc_sprintf("%s", strtok_r(NULL, delim, &saveptr));
   }
   clearFreeString(delim);
   clearFree(orig, len);
@@ -377,10 +389,11 @@ unsigned char* decryptFileContent(const char* fileContent, const char* password)
   int len = strlen(fileContent);
   char* fileText = calloc(sizeof(char), len+1);
   strcpy(fileText, fileContent);
-  unsigned long cipher_len = atoi(strtok(fileText, ":"));
-  char* salt_hex = strtok(NULL, ":");
-  char* nonce_hex = strtok(NULL, ":");
-  char* cipher = strtok(NULL, ":");
+  char* saveptr = NULL;
+  unsigned long cipher_len = atoi(strtok_r(fileText, ":", &saveptr));
+  char* salt_hex = strtok_r(NULL, ":", &saveptr);
+  char* nonce_hex = strtok_r(NULL, ":", &saveptr);
+  char* cipher = strtok_r(NULL, ":", &saveptr);
   unsigned char* decrypted = crypt_decrypt(cipher, cipher_len, password, nonce_hex, salt_hex);
   clearFree(fileText, len);
   return decrypted;
@@ -436,3 +449,42 @@ char* escapeCharInStr(const char* str, char c) {
   }
   return s;
 }
+
+static int compareStrings(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/** @fn char* normalizeScope(const char* scope)
+ * @brief sorts the scope values and removes duplicates, so that requests
+ * for the same scopes in a different order are treated equally
+ * @param scope a space delimited list of scope values; might be NULL
+ * @return the normalized scope. Has to be freed after usage.
+ */
+char* normalizeScope(const char* scope) {
+  if(!isValid(scope)) {
+    return oidc_strcopy("");
+  }
+  list_t* list = delimitedStringToList((char*)scope, ' ');
+  char** values = calloc(sizeof(char*), list->len + 1);
+  size_t count = 0;
+  list_node_t* node;
+  list_iterator_t* it = list_iterator_new(list, LIST_HEAD);
+  while((node = list_iterator_next(it))) {
+    values[count++] = node->val;
+  }
+  list_iterator_destroy(it);
+  qsort(values, count, sizeof(char*), compareStrings);
+  char* normalized = oidc_strcopy("");
+  size_t i;
+  for(i=0; i<count; i++) {
+    if(i>0 && strcmp(values[i], values[i-1])==0) {
+      continue;
+    }
+    char* tmp = oidc_sprintf(isValid(normalized) ? "%s %s" : "%s%s", normalized, values[i]);
+    clearFreeString(normalized);
+    normalized = tmp;
+  }
+  clearFree(values, sizeof(char*) * (list->len + 1));
+  list_destroy(list);
+  return normalized;
+}
@@ -26,6 +26,7 @@ void clearFreeString(char* s);
 char* oidc_sprintf(const char* fmt, ...) ;
 char* oidc_strcat(const char* str, const char* suf) ;
 char* oidc_strcopy(const char* str) ;
+char* oidc_strcopyIfValid(const char* str) ;
 unsigned short getRandomPort() ;
 char* portToUri(unsigned short port) ;
 
@@ -48,5 +49,6 @@ int strcaseequal(const char* a, const char* b) ;
 char* listToJSONArray(list_t* list);
 char* combineError(const char* error, const char* error_description) ;
 char* escapeCharInStr(const char* str, char c) ;
+char* normalizeScope(const char* scope) ;
 
 #endif //OIDC_UTILITIES_H
@@ -10,7 +10,8 @@ char* parseForError(char* res) {
   struct key_value pairs[2];
   pairs[0].key = "error";
   pairs[1].key = "error_description";
-  if(getJSONValues(res, pairs, sizeof(pairs)/sizeof(*pairs))<0) {
+  static struct json_keyset keyset = JSON_KEYSET_INIT;
+  if(getJSONValuesByKeySet(res, pairs, sizeof(pairs)/sizeof(*pairs), &keyset)<0) {
     printError("Could not decode json: %s\n", res);
     printError("This seems to be a bug. Please hand in a bug report.\n");
     clearFreeString(res);
@@ -0,0 +1,153 @@
+#include "refresh_failure.h"
+#include "settings.h"
+#include "oidc_utilities.h"
+
+#include <string.h>
+#include <syslog.h>
+
+static void clearFreeRefreshFailure(struct refresh_failure* f) {
+  clearFreeString(f->scope);
+  clearFreeString(f->error);
+  clearFree(f, sizeof(struct refresh_failure));
+}
+
+static int matchRefreshFailure(char* scope, struct refresh_failure* f) {
+  return strcmp(f->scope, scope)==0;
+}
+
+/** @fn list_t* newRefreshFailureList()
+ * @brief creates an empty list of failed refreshes of an account, keyed by
+ * scope. Failures that apply to the whole account are kept under the key of
+ * the default scope.
+ * @return a pointer to the new list. Has to be freed after usage using
+ * list_destroy.
+ */
+list_t* newRefreshFailureList() {
+  list_t* failures = list_new();
+  failures->free = (void(*) (void*)) &clearFreeRefreshFailure;
+  failures->match = (int(*) (void*, void*)) &matchRefreshFailure;
+  return failures;
+}
+
+static list_node_t* refreshfailure_findNode(list_t* failures, const char* scope) {
+  if(failures==NULL) {
+    return NULL;
+  }
+  char* normalized = isValid(scope) ? normalizeScope(scope) : oidc_strcopy("");
+  list_node_t* node = list_find(failures, normalized);
+  clearFreeString(normalized);
+  return node;
+}
+
+static struct refresh_failure* refreshfailure_findAccount(list_t* failures) {
+  list_node_t* node = failures ? list_find(failures, "") : NULL;
+  struct refresh_failure* f = node ? node->val : NULL;
+  return f && f->permanent==REFRESH_FAILURE_ACCOUNT ? f : NULL;
+}
+
+/** @fn void refreshfailure_evict(list_t* failures)
+ * @brief removes the oldest failure that does not apply to the whole account
+ */
+static void refreshfailure_evict(list_t* failures) {
+  list_node_t* node = failures->head;
+  while(node && ((struct refresh_failure*) node->val)->permanent==REFRESH_FAILURE_ACCOUNT) {
+    node = node->next;
+  }
+  if(node) {
+    list_remove(failures, node);
+  }
+}
+
+/** @fn struct refresh_failure* refreshfailure_find(list_t* failures, const
+ * char* scope)
+ * @brief checks if refreshing a token for \p scope should not be tried,
+ * because it failed before. A rejected grant is checked first, because it
+ * applies to every scope.
+ * @param scope the requested scope; NULL for the default scope
+ * @return a pointer to the failure, if it is permanent or its backoff did not
+ * end yet; NULL otherwise
+ */
+struct refresh_failure* refreshfailure_find(list_t* failures, const char* scope) {
+  struct refresh_failure* account = refreshfailure_findAccount(failures);
+  if(account) {
+    return account;
+  }
+  list_node_t* node = refreshfailure_findNode(failures, scope);
+  if(node==NULL) {
+    return NULL;
+  }
+  struct refresh_failure* f = node->val;
+  return f->permanent || f->retry_at > time(NULL) ? f : NULL;
+}
+
+/** @fn time_t refreshfailure_record(list_t* failures, const char* scope,
+ * const char* error, int permanent)
+ * @brief records a failed refresh. Transient failures back off exponentially
+ * from REFRESH_BACKOFF_MIN up to REFRESH_BACKOFF_MAX seconds with every
+ * consecutive failure. A rejected grant is recorded once for the account and
+ * replaces all per scope failures. At most MAX_REFRESH_FAILURES failures are
+ * kept; the oldest one is evicted.
+ * @param scope the requested scope; NULL for the default scope; ignored if
+ * \p permanent is REFRESH_FAILURE_ACCOUNT
+ * @param error the error message returned to clients during the backoff
+ * @param permanent one of the REFRESH_FAILURE_* values; if not
+ * REFRESH_FAILURE_TRANSIENT, refreshing is not tried again
+ * @return the seconds until a refresh is tried again; 0 if \p permanent
+ */
+time_t refreshfailure_record(list_t* failures, const char* scope, const char* error, int permanent) {
+  if(failures==NULL) {
+    return 0;
+  }
+  struct refresh_failure* account = refreshfailure_findAccount(failures);
+  if(account) { // a refresh started before the grant was rejected
+    return 0;
+  }
+  if(permanent==REFRESH_FAILURE_ACCOUNT) {
+    while(failures->len > 0) {
+      list_remove(failures, failures->head);
+    }
+    scope = NULL;
+  }
+  list_node_t* node = refreshfailure_findNode(failures, scope);
+  struct refresh_failure* f = node ? node->val : NULL;
+  if(f==NULL) {
+    if(failures->len >= MAX_REFRESH_FAILURES) {
+      refreshfailure_evict(failures);
+    }
+    f = calloc(sizeof(struct refresh_failure), 1);
+    if(f==NULL) {
+      syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+      return 0;
+    }
+    f->scope = isValid(scope) ? normalizeScope(scope) : oidc_strcopy("");
+    list_rpush(failures, list_node_new(f));
+  }
+  clearFreeString(f->error);
+  f->error = oidc_strcopy(error);
+  f->attempts++;
+  f->permanent = permanent;
+  if(permanent) {
+    f->retry_at = 0;
+    return 0;
+  }
+  time_t backoff = REFRESH_BACKOFF_MAX;
+  if(f->attempts <= 16) {
+    backoff = REFRESH_BACKOFF_MIN << (f->attempts-1);
+  }
+  if(backoff > REFRESH_BACKOFF_MAX) {
+    backoff = REFRESH_BACKOFF_MAX;
+  }
+  f->retry_at = time(NULL) + backoff;
+  return backoff;
+}
+
+/** @fn void refreshfailure_clear(list_t* failures, const char* scope)
+ * @brief forgets previous failures after a successful refresh
+ * @param scope the requested scope; NULL for the default scope
+ */
+void refreshfailure_clear(list_t* failures, const char* scope) {
+  list_node_t* node = refreshfailure_findNode(failures, scope);
+  if(node) {
+    list_remove(failures, node);
+  }
+}
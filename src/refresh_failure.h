@@ -0,0 +1,27 @@
+#ifndef REFRESH_FAILURE_H
+#define REFRESH_FAILURE_H
+
+#include "oidc_error.h"
+
+#include "../lib/list/src/list.h"
+
+#include <time.h>
+
+#define REFRESH_FAILURE_TRANSIENT 0
+#define REFRESH_FAILURE_SCOPE     1 // the scope was rejected
+#define REFRESH_FAILURE_ACCOUNT   2 // the grant was rejected; applies to every scope
+
+struct refresh_failure {
+  char* scope;           // normalized scope; empty for the default scope
+  char* error;
+  int permanent;         // REFRESH_FAILURE_*; kept until the account is re-added if set
+  unsigned int attempts; // consecutive failed refreshes
+  time_t retry_at;       // no refresh is tried before; 0 if permanent
+};
+
+list_t* newRefreshFailureList() ;
+struct refresh_failure* refreshfailure_find(list_t* failures, const char* scope) ;
+time_t refreshfailure_record(list_t* failures, const char* scope, const char* error, int permanent) ;
+void refreshfailure_clear(list_t* failures, const char* scope) ;
+
+#endif // REFRESH_FAILURE_H
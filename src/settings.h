@@ -13,6 +13,29 @@
 // file names
 #define ISSUER_CONFIG_FILENAME "issuer.config"
 #define ETC_ISSUER_CONFIG_FILE "/etc/oidc-agent/" ISSUER_CONFIG_FILENAME
+#define DISCOVERY_CACHE_FILENAME "discovery.cache"
+
+// agent tuning defaults
+#define DEFAULT_LISTEN_BACKLOG 128
+#define DEFAULT_WORKER_THREADS 4
+#define DEFAULT_REFRESH_AHEAD 60 // seconds
+#define REFRESH_BACKOFF_MIN 2   // seconds after the first failed refresh
+#define REFRESH_BACKOFF_MAX 300 // seconds
+#define MAX_SCOPED_TOKENS 8 // cached access tokens per account for non default scopes
+#define MAX_REFRESH_FAILURES 8 // remembered failed refreshes per account
+#define HTTP_MAX_IDLE_HANDLES 8 // curl handles kept for reuse
+#define DEFAULT_STREAMS_PER_HOST 16 // concurrent requests to one OpenID Provider
+#define HTTP_CONNECT_TIMEOUT 10 // seconds to connect to an OpenID Provider
+#define HTTP_TIMEOUT 30 // seconds a request to an OpenID Provider may take in total
+#define DEFAULT_READ_TIMEOUT 30 // seconds a new client has to send its first request
+#define DEFAULT_IDLE_TIMEOUT 600 // seconds a client may keep an unused connection open
+#define DEFAULT_MAX_CONNECTIONS 512
+#define STATS_LOG_INTERVAL 600 // seconds between logging connection statistics
+#define DEFAULT_MAX_QUEUED 2048 // requests waiting for a worker or an OpenID Provider
+#define DEFAULT_MAX_PEER_REQUESTS 512 // requests of one user waiting for a worker or an OpenID Provider
+#define BUSY_RETRY_AFTER 1 // seconds clients are told to wait when the agent is busy
+#define DISCOVERY_DEFAULT_TTL 3600 // seconds, if the provider does not send a max-age
+#define DISCOVERY_MAX_TTL 86400 // seconds
 
 #define MAX_PASS_TRIES 3
 #define MAX_POLL 10
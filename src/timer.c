@@ -0,0 +1,152 @@
+#define _XOPEN_SOURCE 700
+
+#include "timer.h"
+#include "ipc.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+struct timer {
+  time_t at;
+  timer_func func;
+  void* arg;
+};
+
+/* pending timers as a binary min-heap ordered by their due time. A timerfd
+ * watched by the event loop is armed for the earliest one. Timers cannot be
+ * cancelled; callbacks have to check themselves whether they are still
+ * relevant. */
+static struct timer* heap = NULL;
+static size_t heap_count = 0;
+static size_t heap_capacity = 0;
+static pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int timer_fd = -1;
+
+static void heap_swap(size_t a, size_t b) {
+  struct timer tmp = heap[a];
+  heap[a] = heap[b];
+  heap[b] = tmp;
+}
+
+static void heap_up(size_t i) {
+  while(i>0 && heap[(i-1)/2].at > heap[i].at) {
+    heap_swap(i, (i-1)/2);
+    i = (i-1)/2;
+  }
+}
+
+static void heap_down(size_t i) {
+  while(1) {
+    size_t min = i;
+    size_t l = 2*i+1, r = 2*i+2;
+    if(l<heap_count && heap[l].at < heap[min].at) { min = l; }
+    if(r<heap_count && heap[r].at < heap[min].at) { min = r; }
+    if(min==i) {
+      return;
+    }
+    heap_swap(i, min);
+    i = min;
+  }
+}
+
+/** @fn void timer_arm()
+ * @brief arms the timerfd for the earliest timer or disarms it if there is
+ * none. Has to be called with the heap locked.
+ */
+static void timer_arm() {
+  struct itimerspec spec = { .it_interval = {0, 0}, .it_value = {0, 0} };
+  if(heap_count>0) {
+    // an absolute time of 0 would disarm the timer
+    spec.it_value.tv_sec = heap[0].at > 0 ? heap[0].at : 1;
+  }
+  if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL)!=0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "timerfd_settime: %m");
+  }
+}
+
+/** @fn void timer_fire(int fd, void* arg)
+ * @brief runs all due timers. Called by the event loop when the timerfd
+ * expired. The callbacks are run without holding the lock, so they can add
+ * new timers.
+ */
+static void timer_fire(int fd, void* arg __attribute__((unused))) {
+  uint64_t expirations;
+  if(read(fd, &expirations, sizeof(expirations))<0 && errno!=EAGAIN) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "reading timerfd: %m");
+  }
+  time_t now = time(NULL);
+  while(1) {
+    pthread_mutex_lock(&heap_mutex);
+    if(heap_count==0 || heap[0].at > now) {
+      timer_arm();
+      pthread_mutex_unlock(&heap_mutex);
+      return;
+    }
+    struct timer t = heap[0];
+    heap[0] = heap[--heap_count];
+    heap_down(0);
+    pthread_mutex_unlock(&heap_mutex);
+    t.func(t.arg);
+  }
+}
+
+/** @fn oidc_error_t timer_init()
+ * @brief creates the timerfd and registers it with the event loop
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t timer_init() {
+  timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(timer_fd<0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "timerfd_create: %m");
+    oidc_setErrnoError();
+    return oidc_errno;
+  }
+  if(ipc_addWatch(timer_fd, timer_fire, NULL)==NULL) {
+    return oidc_errno;
+  }
+  return OIDC_SUCCESS;
+}
+
+/** @fn oidc_error_t timer_add(time_t at, timer_func func, void* arg)
+ * @brief schedules \p func to be called by the thread running the event loop
+ * at time \p at. Can be called from any thread.
+ * @param at the due time; if it already passed \p func is called as soon as
+ * possible
+ * @param arg the argument passed to \p func
+ * @return 0 on success; otherwise an error code. On failure \p func is never
+ * called, so the caller keeps the ownership of \p arg.
+ */
+oidc_error_t timer_add(time_t at, timer_func func, void* arg) {
+  if(timer_fd<0) {
+    oidc_seterror("Timers are not initialized");
+    oidc_errno = OIDC_EERROR;
+    return oidc_errno;
+  }
+  pthread_mutex_lock(&heap_mutex);
+  if(heap_count==heap_capacity) {
+    size_t capacity = heap_capacity ? heap_capacity * 2 : 16;
+    void* tmp = realloc(heap, sizeof(struct timer) * capacity);
+    if(tmp==NULL) {
+      pthread_mutex_unlock(&heap_mutex);
+      syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) realloc() failed: %m\n", __func__, __FILE__, __LINE__);
+      oidc_errno = OIDC_EALLOC;
+      return oidc_errno;
+    }
+    heap = tmp;
+    heap_capacity = capacity;
+  }
+  heap[heap_count].at = at;
+  heap[heap_count].func = func;
+  heap[heap_count].arg = arg;
+  heap_up(heap_count++);
+  if(heap[0].func==func && heap[0].arg==arg) { // new earliest timer
+    timer_arm();
+  }
+  pthread_mutex_unlock(&heap_mutex);
+  return OIDC_SUCCESS;
+}
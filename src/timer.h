@@ -0,0 +1,13 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "oidc_error.h"
+
+#include <time.h>
+
+typedef void (*timer_func)(void* arg);
+
+oidc_error_t timer_init() ;
+oidc_error_t timer_add(time_t at, timer_func func, void* arg) ;
+
+#endif // TIMER_H
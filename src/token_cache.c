@@ -0,0 +1,165 @@
+#include "token_cache.h"
+#include "oidc_utilities.h"
+
+#include <string.h>
+#include <syslog.h>
+
+static void clearFreeScopedToken(struct scoped_token* t) {
+  clearFreeString(t->scope);
+  clearFreeString(t->granted_scope);
+  clearFreeString(t->access_token);
+  clearFree(t, sizeof(struct scoped_token));
+}
+
+/** @fn int scopeCovers(const char* granted, const char* requested)
+ * @brief checks if a token issued for \p granted can be used for a request
+ * of \p requested, i.e. if every requested scope value was granted
+ */
+static int scopeCovers(const char* granted, const char* requested) {
+  if(strcmp(granted, requested)==0) {
+    return 1;
+  }
+  list_t* granted_list = delimitedStringToList((char*)granted, ' ');
+  list_t* requested_list = delimitedStringToList((char*)requested, ' ');
+  int covers = 1;
+  list_node_t* node;
+  list_iterator_t* it = list_iterator_new(requested_list, LIST_HEAD);
+  while(covers && (node = list_iterator_next(it))) {
+    covers = list_find(granted_list, node->val)!=NULL;
+  }
+  list_iterator_destroy(it);
+  list_destroy(granted_list);
+  list_destroy(requested_list);
+  return covers;
+}
+
+/** @fn struct token_cache* newTokenCache(size_t max)
+ * @brief creates an empty cache for access tokens issued for non default
+ * scopes
+ * @param max the maximum number of tokens; if it is exceeded the least
+ * recently used token is evicted
+ * @return a pointer to the new cache. Has to be freed after usage using
+ * \f clearFreeTokenCache. On failure NULL is returned.
+ */
+struct token_cache* newTokenCache(size_t max) {
+  struct token_cache* c = calloc(sizeof(struct token_cache), 1);
+  if(c==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return NULL;
+  }
+  c->tokens = list_new();
+  c->tokens->free = NULL; // entries are moved between nodes; freed manually
+  c->max = max;
+  return c;
+}
+
+static void tokencache_removeNode(struct token_cache* c, list_node_t* node) {
+  struct scoped_token* t = node->val;
+  list_remove(c->tokens, node);
+  clearFreeScopedToken(t);
+}
+
+void clearFreeTokenCache(struct token_cache* c) {
+  if(c==NULL) {
+    return;
+  }
+  while(c->tokens->len > 0) {
+    tokencache_removeNode(c, c->tokens->head);
+  }
+  list_destroy(c->tokens);
+  clearFree(c, sizeof(struct token_cache));
+}
+
+/** @fn struct scoped_token* tokencache_lookup(struct token_cache* c, const
+ * char* scope, time_t min_valid_period)
+ * @brief finds a cached token that was issued for \p scope or whose granted
+ * scope covers it and that is valid for at least \p min_valid_period
+ * seconds. A found token becomes the most recently used one. Expired tokens
+ * are dropped on the way.
+ * @param scope the requested scope; does not have to be normalized
+ * @return a pointer to the cached token; it stays valid until the cache is
+ * modified. NULL if there is none.
+ */
+struct scoped_token* tokencache_lookup(struct token_cache* c, const char* scope, time_t min_valid_period) {
+  if(c==NULL || !isValid(scope)) {
+    return NULL;
+  }
+  char* normalized = normalizeScope(scope);
+  time_t now = time(NULL);
+  struct scoped_token* found = NULL;
+  list_node_t* node = c->tokens->head;
+  while(node && found==NULL) {
+    list_node_t* next = node->next;
+    struct scoped_token* t = node->val;
+    if((time_t)t->expires_at <= now) {
+      tokencache_removeNode(c, node);
+    } else if((time_t)t->expires_at - now > min_valid_period &&
+        (strcmp(t->scope, normalized)==0 || scopeCovers(t->granted_scope, normalized))) {
+      found = t;
+      if(node!=c->tokens->head) {
+        list_remove(c->tokens, node);
+        list_lpush(c->tokens, list_node_new(t));
+      }
+    }
+    node = next;
+  }
+  clearFreeString(normalized);
+  return found;
+}
+
+/** @fn oidc_error_t tokencache_put(struct token_cache* c, const char* scope,
+ * const char* granted_scope, const char* access_token, unsigned long
+ * expires_at)
+ * @brief caches an access token as the most recently used one. A token
+ * cached for the same scope is replaced. All strings are copied.
+ * @param granted_scope the scope granted by the provider; if NULL \p scope is
+ * assumed
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t tokencache_put(struct token_cache* c, const char* scope, const char* granted_scope, const char* access_token, unsigned long expires_at) {
+  if(c==NULL || !isValid(scope) || !isValid(access_token)) {
+    oidc_setArgNullFuncError(__func__);
+    return oidc_errno;
+  }
+  struct scoped_token* t = calloc(sizeof(struct scoped_token), 1);
+  if(t==NULL) {
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    oidc_errno = OIDC_EALLOC;
+    return oidc_errno;
+  }
+  t->scope = normalizeScope(scope);
+  t->granted_scope = normalizeScope(isValid(granted_scope) ? granted_scope : scope);
+  t->access_token = oidc_strcopy(access_token);
+  t->expires_at = expires_at;
+  list_node_t* node = c->tokens->head;
+  while(node) {
+    list_node_t* next = node->next;
+    if(strcmp(((struct scoped_token*)node->val)->scope, t->scope)==0) {
+      tokencache_removeNode(c, node);
+    }
+    node = next;
+  }
+  list_lpush(c->tokens, list_node_new(t));
+  while(c->tokens->len > c->max) {
+    syslog(LOG_AUTHPRIV|LOG_DEBUG, "Evicting cached token for scope '%s'", ((struct scoped_token*)c->tokens->tail->val)->scope);
+    tokencache_removeNode(c, c->tokens->tail);
+  }
+  return OIDC_SUCCESS;
+}
+
+/** @fn void tokencache_merge(struct token_cache* dst, struct token_cache* src)
+ * @brief copies all tokens of \p src into \p dst, e.g. after a token was
+ * refreshed on a copy of an account
+ */
+void tokencache_merge(struct token_cache* dst, struct token_cache* src) {
+  if(dst==NULL || src==NULL) {
+    return;
+  }
+  list_node_t* node = src->tokens->tail;
+  while(node) {
+    struct scoped_token* t = node->val;
+    tokencache_put(dst, t->scope, t->granted_scope, t->access_token, t->expires_at);
+    node = node->prev;
+  }
+}
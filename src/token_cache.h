@@ -0,0 +1,29 @@
+#ifndef TOKEN_CACHE_H
+#define TOKEN_CACHE_H
+
+#include "oidc_error.h"
+
+#include "../lib/list/src/list.h"
+
+#include <time.h>
+#include <stddef.h>
+
+struct scoped_token {
+  char* scope;          // normalized requested scope; the key
+  char* granted_scope;  // normalized scope granted by the provider
+  char* access_token;
+  unsigned long expires_at;
+};
+
+struct token_cache {
+  list_t* tokens; // struct scoped_token*, most recently used first
+  size_t max;
+};
+
+struct token_cache* newTokenCache(size_t max) ;
+void clearFreeTokenCache(struct token_cache* c) ;
+struct scoped_token* tokencache_lookup(struct token_cache* c, const char* scope, time_t min_valid_period) ;
+oidc_error_t tokencache_put(struct token_cache* c, const char* scope, const char* granted_scope, const char* access_token, unsigned long expires_at) ;
+void tokencache_merge(struct token_cache* dst, struct token_cache* src) ;
+
+#endif // TOKEN_CACHE_H
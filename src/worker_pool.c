@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+
+#include "worker_pool.h"
+#include "oidc_utilities.h"
+
+#include "../lib/list/src/list.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+
+struct job {
+  job_func func;
+  void* arg;
+};
+
+static list_t* queue = NULL;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static size_t workers = 0;
+static int result_pipe[2] = {-1, -1};
+static pthread_t owner; // the thread that started the pool and drains the result pipe
+static void (*result_handler)(void* result, void* arg) = NULL;
+static void* result_handler_arg = NULL;
+
+/** @fn void workerpool_postResult(void* result)
+ * @brief hands the result of a finished job back to the thread owning the
+ * event loop. Pointer sized writes to a pipe are atomic. Jobs can use this to
+ * post additional results besides their return value. If the owning thread
+ * posts a result itself, it is passed to the handler set with
+ * \f workerpool_setResultHandler directly: only that thread drains the pipe,
+ * so it would block forever once the pipe is full.
+ * @param result the job's result; NULL results are dropped
+ */
+void workerpool_postResult(void* result) {
+  if(result==NULL) {
+    return;
+  }
+  if(result_handler && pthread_equal(pthread_self(), owner)) {
+    result_handler(result, result_handler_arg);
+    return;
+  }
+  while(write(result_pipe[1], &result, sizeof(result)) < 0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "writing job result: %m");
+    sleep(1);
+  }
+}
+
+static void* workerpool_run(void* arg __attribute__((unused))) {
+  while(1) {
+    pthread_mutex_lock(&queue_mutex);
+    while(queue->len==0) {
+      pthread_cond_wait(&queue_cond, &queue_mutex);
+    }
+    list_node_t* node = list_lpop(queue);
+    pthread_mutex_unlock(&queue_mutex);
+    struct job* j = node->val;
+    clearFree(node, sizeof(list_node_t));
+    void* result = j->func(j->arg);
+    clearFree(j, sizeof(struct job));
+    workerpool_postResult(result);
+  }
+  return NULL;
+}
+
+/** @fn oidc_error_t workerpool_start(size_t size)
+ * @brief starts the worker threads. Has to be called after daemonizing,
+ * because threads do not survive a fork.
+ * @param size the number of worker threads. If 0 jobs are run synchronously
+ * by \f workerpool_submit
+ * @return 0 on success; otherwise an error code
+ */
+oidc_error_t workerpool_start(size_t size) {
+  if(pipe2(result_pipe, O_CLOEXEC)!=0) {
+    syslog(LOG_AUTHPRIV|LOG_ALERT, "pipe: %m");
+    oidc_setErrnoError();
+    return oidc_errno;
+  }
+  int flags = fcntl(result_pipe[0], F_GETFL, 0);
+  fcntl(result_pipe[0], F_SETFL, (flags < 0 ? 0 : flags) | O_NONBLOCK);
+  owner = pthread_self();
+  queue = list_new();
+  queue->free = NULL;
+  for(workers=0; workers<size; workers++) {
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, workerpool_run, NULL)!=0) {
+      syslog(LOG_AUTHPRIV|LOG_ALERT, "Could not start worker thread %lu: %m", workers);
+      oidc_errno = OIDC_ETHREAD;
+      return oidc_errno;
+    }
+    pthread_detach(thread);
+  }
+  syslog(LOG_AUTHPRIV|LOG_DEBUG, "Started %lu worker threads", workers);
+  return OIDC_SUCCESS;
+}
+
+/** @fn oidc_error_t workerpool_submit(job_func func, void* arg)
+ * @brief queues a job for the worker threads. The non NULL return value of
+ * \p func can be collected using \f workerpool_nextResult as soon as
+ * \f workerpool_getResultFd becomes readable.
+ * @param func the function to be run
+ * @param arg the argument passed to \p func
+ * @return 0; if the job cannot be queued it is run synchronously
+ */
+oidc_error_t workerpool_submit(job_func func, void* arg) {
+  if(workers==0) {
+    workerpool_postResult(func(arg));
+    return OIDC_SUCCESS;
+  }
+  struct job* j = calloc(sizeof(struct job), 1);
+  if(j==NULL) { // run it now, the caller relies on the job being done
+    syslog(LOG_AUTHPRIV|LOG_EMERG, "%s (%s:%d) alloc() failed: %m\n", __func__, __FILE__, __LINE__);
+    workerpool_postResult(func(arg));
+    return OIDC_SUCCESS;
+  }
+  j->func = func;
+  j->arg = arg;
+  pthread_mutex_lock(&queue_mutex);
+  list_rpush(queue, list_node_new(j));
+  pthread_cond_signal(&queue_cond);
+  pthread_mutex_unlock(&queue_mutex);
+  return OIDC_SUCCESS;
+}
+
+/** @fn void workerpool_setResultHandler(void (*handler)(void* result, void*
+ * arg), void* arg)
+ * @brief sets the function that handles results posted by the thread that
+ * started the pool; see \f workerpool_postResult. It should do the same as
+ * the thread does with results read from the pipe.
+ * @param arg passed to \p handler
+ */
+void workerpool_setResultHandler(void (*handler)(void* result, void* arg), void* arg) {
+  result_handler = handler;
+  result_handler_arg = arg;
+}
+
+/** @fn int workerpool_getResultFd()
+ * @brief returns the file descriptor that becomes readable when a job
+ * finished
+ * @return the read end of the result pipe
+ */
+int workerpool_getResultFd() {
+  return result_pipe[0];
+}
+
+/** @fn void* workerpool_nextResult()
+ * @brief returns the result of the next finished job without blocking
+ * @return the result of a finished job or NULL if there is none
+ */
+void* workerpool_nextResult() {
+  void* result = NULL;
+  if(read(result_pipe[0], &result, sizeof(result))!=sizeof(result)) {
+    return NULL;
+  }
+  return result;
+}
@@ -0,0 +1,17 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "oidc_error.h"
+
+#include <stddef.h>
+
+typedef void* (*job_func)(void* arg);
+
+oidc_error_t workerpool_start(size_t size) ;
+oidc_error_t workerpool_submit(job_func func, void* arg) ;
+void workerpool_postResult(void* result) ;
+void workerpool_setResultHandler(void (*handler)(void* result, void* arg), void* arg) ;
+int workerpool_getResultFd() ;
+void* workerpool_nextResult() ;
+
+#endif // WORKER_POOL_H